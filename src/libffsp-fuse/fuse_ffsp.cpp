@@ -22,7 +22,9 @@
 #include "fuse_ffsp_log.hpp"
 #include "fuse_ffsp_utils.hpp"
 
+#include "libffsp/committer.hpp"
 #include "libffsp/debug.hpp"
+#include "libffsp/delalloc.hpp"
 #include "libffsp/eraseblk.hpp"
 #include "libffsp/ffsp.hpp"
 #include "libffsp/inode.hpp"
@@ -34,6 +36,8 @@
 #include "libffsp/utils.hpp"
 
 #include <memory>
+#include <mutex>
+#include <shared_mutex>
 #include <string>
 #include <vector>
 
@@ -50,6 +54,9 @@
 #include <time.h>
 #define S_ISDIR(mode) (((mode)&S_IFMT) == S_IFDIR)
 #endif
+#ifndef S_ISREG
+#define S_ISREG(mode) (((mode)&S_IFMT) == S_IFREG)
+#endif
 #else
 #include <unistd.h>
 #endif
@@ -65,8 +72,19 @@ static struct mount_options
     std::unique_ptr<std::string> device;
     std::unique_ptr<mkfs_options> mkfs_opts;
     size_t memsize{ 0 };
+    bool preload_inodes{ false };
+    bool delalloc{ false };
+    std::chrono::milliseconds commit_interval{ FFSP_COMMIT_INTERVAL };
 } mnt_opts;
 
+// Every operation holds the file system wide lock while it accesses the
+//  file system. The inode cache, the dirty inode tracking, the allocator
+//  and the garbage collector are shared by all inodes, so operations that
+//  change the file system are serialized. Read-only operations only share
+//  the lock and run concurrently with each other.
+using exclusive_lock = std::unique_lock<std::shared_mutex>;
+using shared_lock = std::shared_lock<std::shared_mutex>;
+
 // Convert from fuse_file_info->fh to ffsp_inode...
 static inode* get_inode(const fuse_file_info* fi)
 {
@@ -99,6 +117,47 @@ void set_options(size_t memsize, const mkfs_options& options)
     mnt_opts.memsize = memsize;
 }
 
+void set_preload_inodes(bool preload)
+{
+    mnt_opts.preload_inodes = preload;
+}
+
+void set_delalloc(bool delalloc)
+{
+    mnt_opts.delalloc = delalloc;
+}
+
+void set_commit_interval(std::chrono::milliseconds interval)
+{
+    mnt_opts.commit_interval = interval;
+}
+
+fs_context* mount(io_backend* io_ctx)
+{
+    fs_context* fs = ffsp::mount(io_ctx);
+    if (!fs)
+        return nullptr;
+
+    // Reading all inodes and dentries into memory makes metadata
+    //  operations independent of the device. The memory usage is logged.
+    if (mnt_opts.preload_inodes && (ffsp::preload_inodes(*fs) < 0))
+        log().error("fuse::mount(): preloading inodes failed");
+
+    // Delay the placement of file data until the file is released.
+    if (mnt_opts.delalloc)
+        fs->delalloc = ffsp::delalloc_init(*fs);
+
+    // Write back dirty inodes in the background once they waited for the
+    //  commit interval, even if no further operation comes along.
+    if (mnt_opts.commit_interval.count() > 0)
+    {
+        fs->commit_interval = mnt_opts.commit_interval;
+        fs->committer = ffsp::committer_init(*fs);
+    }
+
+    return fs;
+}
+
 void* init(fuse_conn_info* conn)
 {
     log().debug("init(conn={})", log_ptr(conn));
@@ -119,7 +178,7 @@ void* init(fuse_conn_info* conn)
         exit(EXIT_FAILURE);
     }
 
-    fs_context* fs = ffsp::mount(io_ctx);
+    fs_context* fs = fuse::mount(io_ctx);
     if (!fs)
     {
         log().error("fuse::init(): mounting failed");
@@ -146,11 +205,6 @@ void* init(fuse_conn_info* conn)
 #endif
     }
 
-    // TODO: Would it be ok to read all existing inode + dentry structs
-    //  into memory at mount time?
-    //  -> probably a good idea to be set via console arg to
-    //      measure max memory usage.
-
     return fs;
 }
 
@@ -170,6 +224,8 @@ int getattr(fs_context& fs, const char* path, struct ::stat* stbuf)
 {
     log().debug("getattr(path={}, stbuf={})", path, static_cast<void*>(stbuf));
 
+    shared_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return ffsp::debug_getattr(fs, path, *stbuf) ? 0 : -EIO;
 
@@ -218,6 +274,8 @@ int readdir(fs_context& fs, const char* path, void* buf, fuse_fill_dir_t filler,
 {
     log().debug("readdir(path={}, buf={}, filler_cb={}, offset={}, fi={})", path, buf, (filler != nullptr), offset, log_ptr(fi));
 
+    shared_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
     {
         std::vector<std::string> dirs;
@@ -261,6 +319,8 @@ int open(fs_context& fs, const char* path, fuse_file_info* fi)
 {
     log().debug("open(path={}, fi={})", path, log_ptr(fi));
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return ffsp::debug_open(fs, path) ? 0 : -EIO;
 
@@ -284,17 +344,25 @@ int release(fs_context& fs, const char* path, fuse_file_info* fi)
 {
     log().debug("release(path={}, fi={})", path, log_ptr(fi));
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return ffsp::debug_release(fs, path) ? 0 : -EIO;
 
+    // The file is complete for now; its delayed data can be laid out.
+    inode* ino = get_inode(fi);
+    int rc = ino ? ffsp::write_back(fs, *ino) : 0;
+
     set_inode(fi, nullptr);
-    return 0;
+    return rc;
 }
 
 int truncate(fs_context& fs, const char* path, FUSE_OFF_T length)
 {
     log().debug("truncate(path={}, length={})", path, length);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -315,6 +383,8 @@ int read(fs_context& fs, const char* path, char* buf, size_t nbyte,
 {
     log().debug("read(path={}, buf={}, nbyte={}, offset={}, fi={})", path, static_cast<void*>(buf), nbyte, offset, log_ptr(fi));
 
+    shared_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return static_cast<int>(ffsp::debug_read(fs, path, buf, nbyte, static_cast<uint64_t>(offset)));
 
@@ -342,6 +412,8 @@ int write(fs_context& fs, const char* path, const char* buf, size_t nbyte,
 {
     log().debug("write(path={}, buf={}, nbyte={}, offset={}, fi={})", path, static_cast<const void*>(buf), nbyte, offset, log_ptr(fi));
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -364,10 +436,48 @@ int write(fs_context& fs, const char* path, const char* buf, size_t nbyte,
     return static_cast<int>(ffsp::write(fs, *ino, buf, nbyte, static_cast<uint64_t>(offset)));
 }
 
+int fallocate(fs_context& fs, const char* path, int mode, FUSE_OFF_T offset,
+              FUSE_OFF_T length, fuse_file_info* fi)
+{
+    log().debug("fallocate(path={}, mode={:#x}, offset={}, length={}, fi={})", path, mode, offset, length, log_ptr(fi));
+
+    exclusive_lock lock{ fs.lock };
+
+    if (ffsp::is_debug_path(fs, path))
+        return -EPERM;
+
+    // The data type of a file depends on its size. Reserving space
+    //  behind the end of the file or punching holes is not supported.
+    if (mode != 0)
+        return -EOPNOTSUPP;
+
+    if ((offset < 0) || (length <= 0))
+        return -EINVAL;
+
+    inode* ino;
+    if (fi)
+    {
+        ino = get_inode(fi);
+    }
+    else
+    {
+        int rc = ffsp::lookup(fs, &ino, path);
+        if (rc < 0)
+            return rc;
+    }
+
+    if (!S_ISREG(get_be32(ino->i_mode)))
+        return -ENODEV;
+
+    return ffsp::fallocate(fs, *ino, static_cast<uint64_t>(offset), static_cast<uint64_t>(length));
+}
+
 int mknod(fs_context& fs, const char* path, mode_t mode, dev_t device)
 {
     log().debug("mknod(path={}, mode={:#o}, device={})", path, mode, device);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -383,6 +493,8 @@ int link(fs_context& fs, const char* oldpath, const char* newpath)
 {
     log().debug("link(oldpath={}, newpath={})", oldpath, newpath);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, oldpath) || ffsp::is_debug_path(fs, newpath))
         return -EPERM;
 
@@ -393,6 +505,8 @@ int symlink(fs_context& fs, const char* oldpath, const char* newpath)
 {
     log().debug("symlink(oldpath={}, newpath={})", oldpath, newpath);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, oldpath) || ffsp::is_debug_path(fs, newpath))
         return -EPERM;
 
@@ -406,6 +520,8 @@ int readlink(fs_context& fs, const char* path, char* buf, size_t bufsize)
 {
     log().debug("readlink(path={}, buf={}, bufsize={})", path, static_cast<void*>(buf), bufsize);
 
+    shared_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -416,6 +532,8 @@ int mkdir(fs_context& fs, const char* path, mode_t mode)
 {
     log().debug("mkdir(path={}, mode={:#o})", path, mode);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -429,6 +547,8 @@ int unlink(fs_context& fs, const char* path)
 {
     log().debug("unlink(path={})", path);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -439,6 +559,8 @@ int rmdir(fs_context& fs, const char* path)
 {
     log().debug("rmdir(path={})", path);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -449,6 +571,8 @@ int rename(fs_context& fs, const char* oldpath, const char* newpath)
 {
     log().debug("rename(oldpath={}, newpath={})", oldpath, newpath);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, oldpath) || is_debug_path(fs, newpath))
         return -EPERM;
 
@@ -459,6 +583,8 @@ int utimens(fs_context& fs, const char* path, const struct ::timespec tv[2])
 {
     log().debug("utimens(path={}, access={}, mod={})", path, tv[0], tv[1]);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -475,6 +601,8 @@ int chmod(fs_context& fs, const char* path, mode_t mode)
 {
     log().debug("chmod(path={}, mode={:#o})", path, mode);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -493,6 +621,8 @@ int chown(fs_context& fs, const char* path, uid_t uid, gid_t gid)
 {
     log().debug("chown(path={}, uid={}, gid={})", path, uid, gid);
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -512,6 +642,8 @@ int statfs(fs_context& fs, const char* path, struct ::statvfs* sfs)
 {
     log().debug("statfs(path={}, sfs={})", path, static_cast<void*>(sfs));
 
+    shared_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return -EPERM;
 
@@ -523,28 +655,61 @@ int flush(fs_context& fs, const char* path, fuse_file_info* fi)
 {
     log().debug("flush(path={}, fi={})", path, log_ptr(fi));
 
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return 0;
 
-    // TODO: Implement Me!
+    inode* ino;
+    if (fi)
+    {
+        ino = get_inode(fi);
+    }
+    else
+    {
+        int rc = ffsp::lookup(fs, &ino, path);
+        if (rc < 0)
+            return rc;
+    }
 
-    // Will write back the inode map and erase block usage data.
+    // Called on every close(). Place the file's delayed data so that
+    //  write errors are reported; durability is left to fsync().
+    int rc = ffsp::write_back(fs, *ino);
+    if (rc < 0)
+        return rc;
 
-    return 0;
+    return flush_inodes(fs, false);
 }
 
 int fsync(fs_context& fs, const char* path, int datasync, fuse_file_info* fi)
 {
     log().debug("fsync(path={}, datasync={}, fi={})", path, datasync, log_ptr(fi));
 
+    // Concurrent fsync() calls queue up on the lock. Remember which commit
+    //  was the last one before waiting so that a commit made on behalf of
+    //  another caller in the meantime is not repeated.
+    const uint64_t commit_gen = fs.commit_gen;
+
+    exclusive_lock lock{ fs.lock };
+
     if (ffsp::is_debug_path(fs, path))
         return 0;
 
-    // TODO: Implement Me!
-
-    // Will write back the file's dirty data.
+    inode* ino;
+    if (fi)
+    {
+        ino = get_inode(fi);
+    }
+    else
+    {
+        int rc = ffsp::lookup(fs, &ino, path);
+        if (rc < 0)
+            return rc;
+    }
 
-    return 0;
+    // File data is always written synchronously, so 'datasync' makes no
+    //  difference: the inode has to be written for the data to be found.
+    return ffsp::sync_inode(fs, *ino, commit_gen);
 }
 
 } // namespace fuse
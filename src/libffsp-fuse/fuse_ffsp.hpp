@@ -23,6 +23,8 @@
 
 #include "fuse.h"
 
+#include <chrono>
+
 #ifndef _WIN32
 #define FUSE_OFF_T off_t
 #endif
@@ -31,6 +33,7 @@ namespace ffsp
 {
 
 struct fs_context;
+struct io_backend;
 struct mkfs_options;
 
 namespace fuse
@@ -39,6 +42,14 @@ namespace fuse
 void set_options(const char* device);
 void set_options(const char* device, const mkfs_options& options);
 void set_options(size_t memsize, const mkfs_options& options);
+void set_preload_inodes(bool preload);
+void set_delalloc(bool delalloc);
+void set_commit_interval(std::chrono::milliseconds interval);
+
+// Mount the file system on the given I/O backend and apply the mount
+//  options that were set before (preloading, delayed allocation and the
+//  commit interval). init() mounts through this function.
+fs_context* mount(io_backend* io_ctx);
 
 void* init(fuse_conn_info* conn);
 
@@ -62,6 +73,8 @@ int read(fs_context& fs, const char* path, char* buf, size_t count, FUSE_OFF_T o
 
 int write(fs_context& fs, const char* path, const char* buf, size_t count, FUSE_OFF_T offset, fuse_file_info* fi);
 
+int fallocate(fs_context& fs, const char* path, int mode, FUSE_OFF_T offset, FUSE_OFF_T length, fuse_file_info* fi);
+
 int mknod(fs_context& fs, const char* path, mode_t mode, dev_t device);
 
 int link(fs_context& fs, const char* oldpath, const char* newpath);
@@ -34,10 +34,13 @@ static uint32_t free_cluster_cnt(const fs_context& fs)
         if (eb_is_type(fs, eb_id, eraseblock_type::ebin))
             continue;
 
+        if (eb_is_type(fs, eb_id, eraseblock_type::super))
+            continue; /* meta data journal */
+
         if (eb_is_type(fs, eb_id, eraseblock_type::empty))
             free_cl_cnt += (fs.erasesize / fs.clustersize);
         else
-            free_cl_cnt += (fs.erasesize / fs.clustersize) - get_be16(fs.eb_usage[eb_id].e_cvalid);
+            free_cl_cnt += (fs.erasesize / fs.clustersize) - fs.eb_usage[eb_id].e_cvalid;
     }
     return free_cl_cnt;
 }
@@ -47,7 +50,7 @@ static uint32_t inode_cnt(const fs_context& fs)
     uint32_t free_ino_cnt = 0;
 
     for (uint32_t ino_no = 1; ino_no < fs.nino; ino_no++)
-        if (get_be32(fs.ino_map[ino_no]) == FFSP_FREE_CL_ID)
+        if (fs.ino_map[ino_no] == FFSP_FREE_CL_ID)
             free_ino_cnt++;
     return fs.nino - free_ino_cnt;
 }
@@ -21,7 +21,9 @@
 #ifndef BYTE_ORDER_HPP
 #define BYTE_ORDER_HPP
 
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 
 #ifdef _WIN32
 #include <intrin.h>
@@ -174,4 +176,246 @@ static inline void dec_be64(be64_t& b)
     b = put_be64(get_be64(b) - 1);
 }
 
+/*
+ * Bulk conversion and scan kernels for the large arrays of the file system
+ * (erase block usage, erase counts, inode map). They are implemented with
+ * AVX2 or SSE2 if the compiler targets those instruction sets and fall back
+ * to plain loops otherwise, or if FFSP_NO_SIMD is defined.
+ */
+#if defined(FFSP_NO_SIMD)
+// plain loops only
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define FFSP_SIMD_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#include <emmintrin.h>
+#define FFSP_SIMD_SSE2 1
+#endif
+
+static inline unsigned int ffsp_ctz32(uint32_t v)
+{
+#ifdef _WIN32
+    unsigned long idx;
+    _BitScanForward(&idx, v);
+    return idx;
+#else
+    return static_cast<unsigned int>(__builtin_ctz(v));
+#endif
+}
+
+static inline uint16_t ffsp_swap16(uint16_t v)
+{
+    return static_cast<uint16_t>((v >> 8) | (v << 8));
+}
+
+static inline uint32_t ffsp_swap32(uint32_t v)
+{
+    return (v >> 24) | ((v >> 8) & 0x0000ff00) | ((v << 8) & 0x00ff0000) | (v << 24);
+}
+
+/* Swap the byte order of 'cnt' 16 bit values. 'dst' may equal 'src'. */
+static inline void bswap16_array(uint16_t* dst, const uint16_t* src, size_t cnt)
+{
+    size_t i = 0;
+#if defined(FFSP_SIMD_AVX2)
+    const __m256i mask = _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+                                          1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for (; i + 16 <= cnt; i += 16)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+#elif defined(FFSP_SIMD_SSE2)
+    for (; i + 8 <= cnt; i += 8)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        const __m128i r = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), r);
+    }
+#endif
+    for (; i < cnt; ++i)
+        dst[i] = ffsp_swap16(src[i]);
+}
+
+/* Swap the byte order of 'cnt' 32 bit values. 'dst' may equal 'src'. */
+static inline void bswap32_array(uint32_t* dst, const uint32_t* src, size_t cnt)
+{
+    size_t i = 0;
+#if defined(FFSP_SIMD_AVX2)
+    const __m256i mask = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12,
+                                          3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12);
+    for (; i + 8 <= cnt; i += 8)
+    {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_shuffle_epi8(v, mask));
+    }
+#elif defined(FFSP_SIMD_SSE2)
+    for (; i + 4 <= cnt; i += 4)
+    {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        // swap the bytes of every 16 bit half, then swap the halves
+        __m128i r = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+        r = _mm_shufflelo_epi16(r, _MM_SHUFFLE(2, 3, 0, 1));
+        r = _mm_shufflehi_epi16(r, _MM_SHUFFLE(2, 3, 0, 1));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), r);
+    }
+#endif
+    for (; i < cnt; ++i)
+        dst[i] = ffsp_swap32(src[i]);
+}
+
+static inline void be16_to_cpu_array(uint16_t* dst, const be16_t* src, size_t cnt)
+{
+#if FFSP_BYTE_ORDER == FFSP_LITTLE_ENDIAN
+    bswap16_array(dst, reinterpret_cast<const uint16_t*>(src), cnt);
+#elif FFSP_BYTE_ORDER == FFSP_BIG_ENDIAN
+    for (size_t i = 0; i < cnt; ++i)
+        dst[i] = src[i].v;
+#endif
+}
+
+static inline void be32_to_cpu_array(uint32_t* dst, const be32_t* src, size_t cnt)
+{
+#if FFSP_BYTE_ORDER == FFSP_LITTLE_ENDIAN
+    bswap32_array(dst, reinterpret_cast<const uint32_t*>(src), cnt);
+#elif FFSP_BYTE_ORDER == FFSP_BIG_ENDIAN
+    for (size_t i = 0; i < cnt; ++i)
+        dst[i] = src[i].v;
+#endif
+}
+
+static inline void cpu_to_be16_array(be16_t* dst, const uint16_t* src, size_t cnt)
+{
+#if FFSP_BYTE_ORDER == FFSP_LITTLE_ENDIAN
+    bswap16_array(reinterpret_cast<uint16_t*>(dst), src, cnt);
+#elif FFSP_BYTE_ORDER == FFSP_BIG_ENDIAN
+    for (size_t i = 0; i < cnt; ++i)
+        dst[i].v = src[i];
+#endif
+}
+
+static inline void cpu_to_be32_array(be32_t* dst, const uint32_t* src, size_t cnt)
+{
+#if FFSP_BYTE_ORDER == FFSP_LITTLE_ENDIAN
+    bswap32_array(reinterpret_cast<uint32_t*>(dst), src, cnt);
+#elif FFSP_BYTE_ORDER == FFSP_BIG_ENDIAN
+    for (size_t i = 0; i < cnt; ++i)
+        dst[i].v = src[i];
+#endif
+}
+
+/*
+ * Return the index of the first of the 'cnt' values that is equal
+ * (find_u32) or not equal (find_not_u32) to 'value', or 'cnt' if there
+ * is none.
+ */
+static inline size_t ffsp_find_u32(const uint32_t* data, size_t cnt, uint32_t value, bool equal)
+{
+    size_t i = 0;
+#if defined(FFSP_SIMD_AVX2)
+    const __m256i v = _mm256_set1_epi32(static_cast<int>(value));
+    const uint32_t flip = equal ? 0 : 0xffffffff;
+    for (; i + 8 <= cnt; i += 8)
+    {
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const uint32_t m = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(d, v))) ^ flip;
+        if (m)
+            return i + ffsp_ctz32(m) / sizeof(uint32_t);
+    }
+#elif defined(FFSP_SIMD_SSE2)
+    const __m128i v = _mm_set1_epi32(static_cast<int>(value));
+    const uint32_t flip = equal ? 0 : 0xffff;
+    for (; i + 4 <= cnt; i += 4)
+    {
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const uint32_t m = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi32(d, v))) ^ flip;
+        if (m)
+            return i + ffsp_ctz32(m) / sizeof(uint32_t);
+    }
+#endif
+    for (; i < cnt; ++i)
+        if ((data[i] == value) == equal)
+            return i;
+    return cnt;
+}
+
+static inline size_t find_u32(const uint32_t* data, size_t cnt, uint32_t value)
+{
+    return ffsp_find_u32(data, cnt, value, true);
+}
+
+static inline size_t find_not_u32(const uint32_t* data, size_t cnt, uint32_t value)
+{
+    return ffsp_find_u32(data, cnt, value, false);
+}
+
+/*
+ * Count how many of the 'cnt' eight byte entries in 'data' start with the
+ * byte 'value'. Used for the type of the erase block usage entries.
+ */
+static inline size_t count_u8_stride8(const void* data, size_t cnt, uint8_t value)
+{
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    size_t i = 0;
+    size_t found = 0;
+#if defined(FFSP_SIMD_AVX2)
+    const __m256i v = _mm256_set1_epi8(static_cast<char>(value));
+    for (; i + 4 <= cnt; i += 4)
+    {
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes + i * 8));
+        const uint32_t m = static_cast<uint32_t>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(d, v)));
+        found += (m & 1) + ((m >> 8) & 1) + ((m >> 16) & 1) + ((m >> 24) & 1);
+    }
+#elif defined(FFSP_SIMD_SSE2)
+    const __m128i v = _mm_set1_epi8(static_cast<char>(value));
+    for (; i + 2 <= cnt; i += 2)
+    {
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes + i * 8));
+        const uint32_t m = static_cast<uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(d, v)));
+        found += (m & 1) + ((m >> 8) & 1);
+    }
+#endif
+    for (; i < cnt; ++i)
+        if (bytes[i * 8] == value)
+            ++found;
+    return found;
+}
+
+/* Check whether the 'size' bytes in 'buf' are all zero. */
+static inline bool is_zero_buf(const void* buf, size_t size)
+{
+    const auto* bytes = static_cast<const uint8_t*>(buf);
+    size_t i = 0;
+#if defined(FFSP_SIMD_AVX2)
+    for (; i + 128 <= size; i += 128)
+    {
+        const auto* v = reinterpret_cast<const __m256i*>(bytes + i);
+        const __m256i acc = _mm256_or_si256(_mm256_or_si256(_mm256_loadu_si256(v), _mm256_loadu_si256(v + 1)),
+                                            _mm256_or_si256(_mm256_loadu_si256(v + 2), _mm256_loadu_si256(v + 3)));
+        if (!_mm256_testz_si256(acc, acc))
+            return false;
+    }
+#elif defined(FFSP_SIMD_SSE2)
+    for (; i + 64 <= size; i += 64)
+    {
+        const auto* v = reinterpret_cast<const __m128i*>(bytes + i);
+        const __m128i acc = _mm_or_si128(_mm_or_si128(_mm_loadu_si128(v), _mm_loadu_si128(v + 1)),
+                                         _mm_or_si128(_mm_loadu_si128(v + 2), _mm_loadu_si128(v + 3)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+            return false;
+    }
+#endif
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        if (word)
+            return false;
+    }
+    for (; i < size; ++i)
+        if (bytes[i])
+            return false;
+    return true;
+}
+
 #endif /* BYTE_ORDER_HPP */
@@ -0,0 +1,683 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "checkpoint.hpp"
+#include "debug.hpp"
+#include "io_raw.hpp"
+#include "log.hpp"
+#include "utils.hpp"
+
+#include <algorithm>
+#include <array>
+#include <vector>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+namespace ffsp
+{
+
+/*
+ * The meta data area covers the first erase block starting behind the super
+ * block cluster. It holds the erase block usage, the erase counts and the
+ * inode map. Changes to it are made durable in two steps:
+ *  - checkpoint_commit() appends the changed words as records to the journal
+ *    erase block. Every commit is one cheap, sequential write.
+ *  - If the journal is full (or at unmount), the changed clusters of the
+ *    meta data area are written in place and the checkpoint generation in
+ *    the super block is incremented. This invalidates all journal records.
+ *    A commit with more records than the empty journal holds is split into
+ *    several commits that are checkpointed one after the other.
+ * At mount time the records of the current generation are replayed.
+ */
+struct checkpoint
+{
+    // Copy of the super block; rewritten to commit a new generation.
+    superblock sb;
+
+    // Durable state of the meta data area, i.e. the meta data area
+    //  on disk with all committed journal records applied.
+    std::vector<char> shadow;
+
+    // Whether the shadow copy matches the durable state. A failed
+    //  journal write leaves the disk in an unknown state and forces a
+    //  full rewrite of the meta data on the next commit.
+    bool shadow_valid{ true };
+
+    // Clusters of the meta data area that are outdated on disk
+    //  because their changes are only recorded in the journal.
+    std::vector<bool> dirty;
+
+    // Pages of the inode map (one cluster of the meta data area each)
+    //  that were changed in memory since the last commit. Only those
+    //  and the clusters holding the erase block usage and erase counts
+    //  have to be compared against the shadow.
+    std::vector<bool> ino_map_changed;
+
+    // Clusters at the beginning of the meta data area that contain the
+    //  erase block usage and erase counts.
+    uint32_t eb_meta_cl_cnt{ 0 };
+
+    // Helper buffer for a single cluster of meta data or journal.
+    std::vector<char> cluster;
+
+    // Erase block id of the journal (zero if there is none) and the
+    //  position of the next cluster to be written into it.
+    eb_id_t journal_eb_id{ FFSP_INVALID_EB_ID };
+    uint32_t journal_pos{ 0 };
+
+    // Inode write sequence of the durable state. Inodes with a higher
+    //  sequence number were written after the last commit.
+    uint64_t wseq{ 0 };
+};
+
+// How the content of a meta data area is converted between its in-memory
+//  (native) and on-disk (big-endian) byte order.
+enum class meta_format
+{
+    eb_usage, // erase block usage entries: type, flags and 16 bit fields
+    be32,     // array of 32 bit values
+    ino_map,  // array of 32 bit cluster ids
+};
+
+struct meta_area
+{
+    char* data;
+    uint64_t offset;
+    uint64_t size;
+    meta_format format;
+};
+
+static std::array<meta_area, 3> get_meta_areas(fs_context& fs)
+{
+    const uint64_t eb_usage_size = fs.neraseblocks * sizeof(eraseblock);
+    const uint64_t eb_erase_cnt_size = fs.neraseblocks * sizeof(be32_t);
+    const uint64_t ino_map_size = fs.nino * sizeof(be32_t);
+
+    // The inode map is located at the very end of the first erase block.
+    return { {
+        { reinterpret_cast<char*>(fs.eb_usage.data()), 0, eb_usage_size, meta_format::eb_usage },
+        { reinterpret_cast<char*>(fs.eb_erase_cnt.data()), eb_usage_size, eb_erase_cnt_size, meta_format::be32 },
+        { reinterpret_cast<char*>(fs.ino_map.data()), fs.erasesize - fs.clustersize - ino_map_size, ino_map_size, meta_format::ino_map },
+    } };
+}
+
+/*
+ * Converts 'size' bytes of a meta data area that start 'area_off' bytes
+ * into the area from the on-disk byte order into the native one
+ * (to_mem=true) or the other way around (to_mem=false). The range is
+ * always aligned to four bytes because every area starts at such an offset
+ * and is accessed in units of clusters or journal records.
+ */
+static void convert_meta_data(const meta_area& area, char* dst, const char* src,
+                              uint64_t area_off, uint64_t size, bool to_mem)
+{
+    assert((area_off % sizeof(be32_t) == 0) && (size % sizeof(be32_t) == 0));
+
+    if (area.format != meta_format::eb_usage)
+    {
+        if (to_mem)
+        {
+            be32_to_cpu_array(reinterpret_cast<uint32_t*>(dst), reinterpret_cast<const be32_t*>(src), size / sizeof(be32_t));
+            return;
+        }
+        cpu_to_be32_array(reinterpret_cast<be32_t*>(dst), reinterpret_cast<const uint32_t*>(src), size / sizeof(be32_t));
+
+        // Inodes that were created but not yet written have no cluster on
+        //  the medium. They are stored as free; the parent directory that
+        //  refers to them was not written either.
+        if (area.format == meta_format::ino_map)
+        {
+            auto* cl_ids = reinterpret_cast<be32_t*>(dst);
+            for (uint64_t i = 0; i < size / sizeof(be32_t); ++i)
+            {
+                if (get_be32(cl_ids[i]) == FFSP_RESERVED_CL_ID)
+                    cl_ids[i] = put_be32(FFSP_FREE_CL_ID);
+            }
+        }
+        return;
+    }
+
+    if (to_mem)
+        be16_to_cpu_array(reinterpret_cast<uint16_t*>(dst), reinterpret_cast<const be16_t*>(src), size / sizeof(be16_t));
+    else
+        cpu_to_be16_array(reinterpret_cast<be16_t*>(dst), reinterpret_cast<const uint16_t*>(src), size / sizeof(be16_t));
+
+    // The type and the reserved byte at the start of every erase block
+    //  usage entry are single bytes that must not be swapped.
+    const uint64_t first = (area_off + sizeof(eraseblock) - 1) / sizeof(eraseblock) * sizeof(eraseblock);
+    for (uint64_t off = first; off < area_off + size; off += sizeof(eraseblock))
+        memcpy(dst + (off - area_off), src + (off - area_off), sizeof(be16_t));
+}
+
+/*
+ * Copies the given range of the in-memory meta data into the buffer in its
+ * on-disk format (to_mem=false) or the other way around (to_mem=true).
+ */
+static void copy_meta_data(fs_context& fs, char* buf, uint64_t offset, uint64_t size, bool to_mem)
+{
+    if (!to_mem)
+        memset(buf, 0, size);
+
+    for (const auto& area : get_meta_areas(fs))
+    {
+        const uint64_t begin = std::max(offset, area.offset);
+        const uint64_t end = std::min(offset + size, area.offset + area.size);
+
+        if (begin >= end)
+            continue;
+
+        if (to_mem)
+            convert_meta_data(area, area.data + (begin - area.offset), buf + (begin - offset),
+                              begin - area.offset, end - begin, true);
+        else
+            convert_meta_data(area, buf + (begin - offset), area.data + (begin - area.offset),
+                              begin - area.offset, end - begin, false);
+    }
+}
+
+static uint32_t journal_records_per_cluster(const fs_context& fs)
+{
+    return static_cast<uint32_t>((fs.clustersize - sizeof(journal_header)) / sizeof(journal_record));
+}
+
+static uint64_t journal_cluster_offset(const fs_context& fs, const checkpoint& cp, uint32_t pos)
+{
+    return uint64_t{ cp.journal_eb_id } * fs.erasesize + uint64_t{ pos } * fs.clustersize;
+}
+
+checkpoint* checkpoint_init(fs_context& fs)
+{
+    auto* cp = new checkpoint;
+
+    ssize_t rc = read_raw(*fs.io_ctx, &cp->sb, sizeof(superblock), 0);
+    if (rc < 0)
+    {
+        log().critical("reading super block failed");
+        delete cp;
+        return nullptr;
+    }
+    debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+
+    cp->journal_eb_id = get_be32(cp->sb.s_journaleb);
+    if (cp->journal_eb_id >= fs.neraseblocks)
+    {
+        log().error("invalid journal erase block {}; journaling disabled", cp->journal_eb_id);
+        cp->journal_eb_id = FFSP_INVALID_EB_ID;
+    }
+
+    cp->wseq = get_be64(cp->sb.s_wseq);
+    fs.wseq = cp->wseq;
+
+    cp->shadow.resize(fs.erasesize - fs.clustersize);
+    cp->dirty.resize(cp->shadow.size() / fs.clustersize, false);
+    cp->ino_map_changed.resize(cp->dirty.size(), false);
+    cp->cluster.resize(fs.clustersize);
+
+    const uint64_t eb_meta_size = fs.neraseblocks * (sizeof(eraseblock) + sizeof(be32_t));
+    cp->eb_meta_cl_cnt = static_cast<uint32_t>((eb_meta_size + fs.clustersize - 1) / fs.clustersize);
+
+    // Right after reading the meta data area it is the same as on disk.
+    copy_meta_data(fs, cp->shadow.data(), 0, cp->shadow.size(), false);
+    return cp;
+}
+
+void checkpoint_uninit(checkpoint* cp)
+{
+    delete cp;
+}
+
+/* Copies a range of the in-memory meta data into the shadow. */
+static void update_shadow(fs_context& fs, uint64_t offset, uint64_t size)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    copy_meta_data(fs, cp.shadow.data() + offset, offset, size, false);
+    for (uint64_t cl = offset / fs.clustersize; cl <= (offset + size - 1) / fs.clustersize; cl++)
+        cp.dirty[cl] = true;
+}
+
+static void apply_records(fs_context& fs, const std::vector<journal_record>& records, bool to_mem)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    for (const auto& rec : records)
+    {
+        const uint32_t offset = get_be32(rec.r_offset);
+
+        memcpy(cp.shadow.data() + offset, &rec.r_value, sizeof(rec.r_value));
+        cp.dirty[offset / fs.clustersize] = true;
+
+        if (to_mem)
+            copy_meta_data(fs, cp.shadow.data() + offset, offset, sizeof(rec.r_value), true);
+    }
+}
+
+/*
+ * Compares the in-memory meta data to the shadow word by word. Inode map
+ * pages that were not changed since the last commit are skipped.
+ */
+static std::vector<journal_record> collect_records(fs_context& fs)
+{
+    checkpoint& cp = *fs.checkpoint;
+    std::vector<journal_record> records;
+
+    for (uint64_t cl_off = 0; cl_off < cp.shadow.size(); cl_off += fs.clustersize)
+    {
+        const auto cl = static_cast<uint32_t>(cl_off / fs.clustersize);
+        if ((cl >= cp.eb_meta_cl_cnt) && !cp.ino_map_changed[cl])
+            continue;
+
+        const char* shadow_cl = cp.shadow.data() + cl_off;
+
+        copy_meta_data(fs, cp.cluster.data(), cl_off, fs.clustersize, false);
+        if (!memcmp(shadow_cl, cp.cluster.data(), fs.clustersize))
+            continue;
+
+        for (uint32_t i = 0; i < fs.clustersize; i += sizeof(be32_t))
+        {
+            if (!memcmp(shadow_cl + i, cp.cluster.data() + i, sizeof(be32_t)))
+                continue;
+
+            journal_record rec;
+            rec.r_offset = put_be32(static_cast<uint32_t>(cl_off + i));
+            memcpy(&rec.r_value, cp.cluster.data() + i, sizeof(rec.r_value));
+            records.push_back(rec);
+        }
+    }
+    return records;
+}
+
+/*
+ * Appends the records to the journal. The last written cluster carries the
+ * commit flag; records of clusters without a following commit are ignored
+ * during replay. 'wseq' becomes the durable inode write sequence once the
+ * commit is replayed. Returns -ENOSPC if the journal is too full.
+ */
+static int journal_append(fs_context& fs, const std::vector<journal_record>& records, uint64_t wseq)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    const uint32_t cl_per_eb = fs.erasesize / fs.clustersize;
+    const uint32_t rec_per_cl = journal_records_per_cluster(fs);
+    const auto cl_needed = static_cast<uint32_t>((records.size() + rec_per_cl - 1) / rec_per_cl);
+
+    if ((cp.journal_pos + cl_needed) > cl_per_eb)
+        return -ENOSPC;
+
+    for (uint32_t i = 0; i < cl_needed; i++)
+    {
+        const size_t first_rec = size_t{ i } * rec_per_cl;
+        const size_t rec_cnt = std::min(records.size() - first_rec, size_t{ rec_per_cl });
+
+        memset(cp.cluster.data(), 0, fs.clustersize);
+
+        journal_header hdr = {};
+        hdr.j_magic = put_be32(FFSP_JOURNAL_MAGIC);
+        hdr.j_cpgen = cp.sb.s_cpgen;
+        hdr.j_seq = put_be32(cp.journal_pos);
+        hdr.j_nrec = put_be32(static_cast<uint32_t>(rec_cnt));
+        hdr.j_flags = put_be32((i == (cl_needed - 1)) ? FFSP_JOURNAL_COMMIT : 0);
+        hdr.j_csum = put_be32(0);
+        hdr.j_wseq = put_be64(wseq);
+        memcpy(cp.cluster.data(), &hdr, sizeof(hdr));
+        memcpy(cp.cluster.data() + sizeof(hdr), records.data() + first_rec, rec_cnt * sizeof(journal_record));
+
+        hdr.j_csum = put_be32(checksum(cp.cluster.data(), fs.clustersize));
+        memcpy(cp.cluster.data(), &hdr, sizeof(hdr));
+
+        ssize_t rc = write_raw(*fs.io_ctx, cp.cluster.data(), fs.clustersize,
+                               journal_cluster_offset(fs, cp, cp.journal_pos));
+        if (rc < 0)
+        {
+            log().error("writing meta data journal failed");
+            cp.shadow_valid = false;
+            return static_cast<int>(rc);
+        }
+        debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
+        debug_update(fs, debug_metric::meta_write, static_cast<uint64_t>(rc));
+        cp.journal_pos++;
+    }
+    return 0;
+}
+
+static int write_super(fs_context& fs)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    ssize_t rc = write_raw(*fs.io_ctx, &cp.sb, sizeof(superblock), 0);
+    if (rc < 0)
+    {
+        log().error("writing super block failed");
+        return static_cast<int>(rc);
+    }
+    debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
+    debug_update(fs, debug_metric::meta_write, static_cast<uint64_t>(rc));
+    return 0;
+}
+
+static int write_shadow(fs_context& fs, uint32_t first_cl, uint32_t cl_cnt)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    const uint64_t offset = uint64_t{ first_cl } * fs.clustersize;
+    const uint64_t size = uint64_t{ cl_cnt } * fs.clustersize;
+
+    ssize_t rc = write_raw(*fs.io_ctx, cp.shadow.data() + offset, size, fs.clustersize + offset);
+    if (rc < 0)
+    {
+        log().error("writing meta data to first erase block failed");
+        return static_cast<int>(rc);
+    }
+    debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
+    debug_update(fs, debug_metric::meta_write, static_cast<uint64_t>(rc));
+    return 0;
+}
+
+/*
+ * Writes the dirty clusters of the shadow into the meta data area and
+ * increments the checkpoint generation, which empties the journal. Adjacent
+ * dirty clusters are combined into one request.
+ */
+static int write_shadow_checkpoint(fs_context& fs)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    if (cp.journal_pos)
+    {
+        // The journal erase block has to be erased before it can be
+        //  written again.
+        ++fs.eb_erase_cnt[cp.journal_eb_id];
+        update_shadow(fs, fs.neraseblocks * sizeof(eraseblock) + cp.journal_eb_id * sizeof(be32_t), sizeof(be32_t));
+    }
+
+    const auto cl_cnt = static_cast<uint32_t>(cp.dirty.size());
+    uint32_t run_first = 0;
+    uint32_t run_cnt = 0;
+    uint32_t written_cnt = 0;
+
+    for (uint32_t i = 0; i <= cl_cnt; i++)
+    {
+        if ((i < cl_cnt) && cp.dirty[i])
+        {
+            if (!run_cnt)
+                run_first = i;
+            run_cnt++;
+            continue;
+        }
+
+        if (run_cnt)
+        {
+            int rc = write_shadow(fs, run_first, run_cnt);
+            if (rc < 0)
+                return rc;
+            written_cnt += run_cnt;
+            run_cnt = 0;
+        }
+    }
+
+    if (!written_cnt && !cp.journal_pos)
+        return 0; // nothing changed since the last checkpoint
+
+    // The new generation invalidates the content of the journal.
+    inc_be32(cp.sb.s_cpgen);
+    cp.sb.s_wseq = put_be64(cp.wseq);
+    int rc = write_super(fs);
+    if (rc < 0)
+    {
+        dec_be32(cp.sb.s_cpgen);
+        return rc;
+    }
+
+    log().debug("ffsp::checkpoint: wrote {} of {} meta data clusters, generation {}",
+                written_cnt, cl_cnt, get_be32(cp.sb.s_cpgen));
+
+    std::fill(cp.dirty.begin(), cp.dirty.end(), false);
+    cp.journal_pos = 0;
+    return 0;
+}
+
+/*
+ * Makes the records durable that do not fit into the empty journal together
+ * with the rest. Each part is a commit of its own that is checkpointed
+ * before the next one is appended, so a crash in between leaves the meta
+ * data of the last complete part:
+ *  - The parts keep the durable inode write sequence. Recovery still finds
+ *    the inodes written since and completes the inode map.
+ *  - The erase block usage goes last and is part of the final commit
+ *    unless it alone exceeds the journal. Recovery relies on it to find
+ *    those inodes and must not see erase blocks as written or freed before
+ *    the inode map of the commit is durable.
+ * On return 'records' holds the last part, to be appended by the caller.
+ */
+static int journal_append_leading(fs_context& fs, std::vector<journal_record>& records)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    const uint32_t eb_usage_size = fs.neraseblocks * sizeof(eraseblock);
+    std::stable_partition(records.begin(), records.end(), [eb_usage_size](const journal_record& rec) {
+        return get_be32(rec.r_offset) >= eb_usage_size;
+    });
+
+    // The last part fills the whole (empty) journal.
+    const size_t max_recs = size_t{ fs.erasesize / fs.clustersize } * journal_records_per_cluster(fs);
+    const size_t last = records.size() - max_recs;
+
+    for (size_t first = 0; first < last;)
+    {
+        const size_t end = std::min(first + max_recs, last);
+        const std::vector<journal_record> part(records.begin() + first, records.begin() + end);
+
+        int rc = journal_append(fs, part, cp.wseq);
+        if (rc < 0)
+            return rc;
+        apply_records(fs, part, false);
+
+        rc = write_shadow_checkpoint(fs);
+        if (rc < 0)
+            return rc;
+        first = end;
+    }
+
+    log().info("ffsp::checkpoint: split commit of {} meta data records", records.size());
+    records.erase(records.begin(), records.begin() + last);
+    return 0;
+}
+
+/*
+ * Writes the current in-memory meta data directly into the meta data area.
+ * Only used if there is no journal or its state is unknown.
+ */
+static int write_direct_checkpoint(fs_context& fs)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    if (!cp.shadow_valid)
+    {
+        update_shadow(fs, 0, cp.shadow.size());
+        cp.shadow_valid = true;
+    }
+    else
+    {
+        apply_records(fs, collect_records(fs), false);
+    }
+    std::fill(cp.ino_map_changed.begin(), cp.ino_map_changed.end(), false);
+    cp.wseq = fs.wseq;
+    return write_shadow_checkpoint(fs);
+}
+
+int checkpoint_replay(fs_context& fs)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    if (cp.journal_eb_id == FFSP_INVALID_EB_ID)
+        return 0;
+
+    const uint32_t cl_per_eb = fs.erasesize / fs.clustersize;
+    const uint32_t rec_per_cl = journal_records_per_cluster(fs);
+    std::vector<journal_record> pending;
+    size_t replayed = 0;
+
+    for (uint32_t pos = 0; pos < cl_per_eb; pos++)
+    {
+        ssize_t rc = read_raw(*fs.io_ctx, cp.cluster.data(), fs.clustersize,
+                              journal_cluster_offset(fs, cp, pos));
+        if (rc < 0)
+        {
+            log().critical("reading meta data journal failed");
+            return static_cast<int>(rc);
+        }
+        debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+
+        journal_header hdr;
+        memcpy(&hdr, cp.cluster.data(), sizeof(hdr));
+
+        const uint32_t csum = get_be32(hdr.j_csum);
+        reinterpret_cast<journal_header*>(cp.cluster.data())->j_csum = put_be32(0);
+
+        // Stop at the first cluster that does not continue the journal
+        //  of the current checkpoint generation.
+        if (   (get_be32(hdr.j_magic) != FFSP_JOURNAL_MAGIC)
+            || (get_be32(hdr.j_cpgen) != get_be32(cp.sb.s_cpgen))
+            || (get_be32(hdr.j_seq) != pos)
+            || (get_be32(hdr.j_nrec) > rec_per_cl)
+            || (csum != checksum(cp.cluster.data(), fs.clustersize)))
+            break;
+
+        cp.journal_pos = pos + 1;
+
+        const auto* recs = reinterpret_cast<const journal_record*>(cp.cluster.data() + sizeof(hdr));
+        for (uint32_t i = 0; i < get_be32(hdr.j_nrec); i++)
+        {
+            const uint32_t offset = get_be32(recs[i].r_offset);
+            if ((offset % sizeof(be32_t)) || ((offset + sizeof(be32_t)) > cp.shadow.size()))
+            {
+                log().error("invalid meta data journal record at offset {}", offset);
+                continue;
+            }
+            pending.push_back(recs[i]);
+        }
+
+        if (get_be32(hdr.j_flags) & FFSP_JOURNAL_COMMIT)
+        {
+            apply_records(fs, pending, true);
+            replayed += pending.size();
+            pending.clear();
+            cp.wseq = get_be64(hdr.j_wseq);
+        }
+    }
+    fs.wseq = cp.wseq;
+
+    if (!cp.journal_pos)
+        return 0;
+
+    log().info("ffsp::mount(): replayed {} meta data journal records", replayed);
+    if (!pending.empty())
+        log().info("ffsp::mount(): dropped {} uncommitted journal records", pending.size());
+
+    // Start over with an empty journal.
+    return write_shadow_checkpoint(fs);
+}
+
+/*
+ * Makes all changes to the in-memory meta data durable by appending them to
+ * the journal. If the journal is full it is emptied by writing a checkpoint
+ * of the already journaled state first.
+ */
+int checkpoint_commit(fs_context& fs)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    if ((cp.journal_eb_id == FFSP_INVALID_EB_ID) || !cp.shadow_valid)
+        return write_direct_checkpoint(fs);
+
+    auto records = collect_records(fs);
+    if (records.empty())
+    {
+        std::fill(cp.ino_map_changed.begin(), cp.ino_map_changed.end(), false);
+        return 0;
+    }
+
+    int rc = journal_append(fs, records, fs.wseq);
+    if (rc == -ENOSPC)
+    {
+        rc = write_shadow_checkpoint(fs);
+        if (rc < 0)
+            return rc;
+
+        rc = journal_append(fs, records, fs.wseq);
+        if (rc == -ENOSPC)
+        {
+            // Too many changes for the journal.
+            rc = journal_append_leading(fs, records);
+            if (rc < 0)
+                return rc;
+            rc = journal_append(fs, records, fs.wseq);
+        }
+    }
+    if (rc < 0)
+        return rc;
+
+    apply_records(fs, records, false);
+    std::fill(cp.ino_map_changed.begin(), cp.ino_map_changed.end(), false);
+    cp.wseq = fs.wseq;
+    return 0;
+}
+
+void checkpoint_set_ino_map(fs_context& fs, ino_t ino_no, cl_id_t cl_id)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    fs.ino_map[ino_no] = cl_id;
+
+    const uint64_t ino_map_offset = fs.erasesize - fs.clustersize - fs.nino * sizeof(be32_t);
+    cp.ino_map_changed[(ino_map_offset + ino_no * sizeof(be32_t)) / fs.clustersize] = true;
+}
+
+bool checkpoint_is_clean(const fs_context& fs)
+{
+    return get_be32(fs.checkpoint->sb.s_state) == FFSP_STATE_CLEAN;
+}
+
+/*
+ * Marks the file system as (not) cleanly unmounted. A file system that is
+ * still marked as mounted at mount time requires recovery.
+ */
+int checkpoint_set_clean(fs_context& fs, bool clean)
+{
+    checkpoint& cp = *fs.checkpoint;
+
+    cp.sb.s_state = put_be32(clean ? FFSP_STATE_CLEAN : FFSP_STATE_MOUNTED);
+    return write_super(fs);
+}
+
+/*
+ * Writes all meta data into the meta data area and empties the journal.
+ */
+int checkpoint_write(fs_context& fs)
+{
+    int rc = checkpoint_commit(fs);
+    if (rc < 0)
+        return rc;
+    return write_shadow_checkpoint(fs);
+}
+
+} // namespace ffsp
@@ -0,0 +1,45 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include "ffsp.hpp"
+
+namespace ffsp
+{
+
+checkpoint* checkpoint_init(fs_context& fs);
+void checkpoint_uninit(checkpoint* cp);
+
+int checkpoint_replay(fs_context& fs);
+int checkpoint_commit(fs_context& fs);
+int checkpoint_write(fs_context& fs);
+
+// Every change of the inode map has to go through this function; the
+//  commit only compares the inode map pages that were changed.
+void checkpoint_set_ino_map(fs_context& fs, ino_t ino_no, cl_id_t cl_id);
+
+bool checkpoint_is_clean(const fs_context& fs);
+int checkpoint_set_clean(fs_context& fs, bool clean);
+
+} // namespace ffsp
+
+#endif /* CHECKPOINT_HPP */
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "committer.hpp"
+#include "debug.hpp"
+#include "inode.hpp"
+#include "log.hpp"
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+namespace ffsp
+{
+
+struct committer
+{
+    explicit committer(fs_context& fs)
+        : fs{ fs }
+    {
+    }
+
+    fs_context& fs;
+
+    std::mutex mutex;
+    std::condition_variable stop_cv;
+    bool stop{ false };
+
+    std::thread thread;
+};
+
+static void commit_periodically(committer& c)
+{
+    fs_context& fs = c.fs;
+    auto deadline = std::chrono::steady_clock::now() + fs.commit_interval;
+
+    std::unique_lock<std::mutex> guard{ c.mutex };
+    while (!c.stop_cv.wait_until(guard, deadline, [&c]() { return c.stop; }))
+    {
+        // The file system lock is taken by operations that may stop the
+        //  committer, so never wait for it while holding the mutex.
+        guard.unlock();
+        {
+            std::unique_lock<std::shared_mutex> lock{ fs.lock };
+            if (flush_inodes(fs, false) < 0)
+            {
+                // The oldest dirty inode is overdue already. Retry only
+                //  after another interval instead of keeping the file
+                //  system locked with attempts that fail again (ENOSPC).
+                log().error("ffsp::commit_periodically(): writing back dirty inodes failed");
+                debug_update(fs, debug_metric::commit_errors, 1);
+                deadline = std::chrono::steady_clock::now() + fs.commit_interval;
+            }
+            else
+            {
+                // Wake up again once the oldest remaining dirty inode is due.
+                deadline = (fs.dirty_ino_cnt ? fs.dirty_since : std::chrono::steady_clock::now())
+                         + fs.commit_interval;
+            }
+        }
+        guard.lock();
+    }
+}
+
+committer* committer_init(fs_context& fs)
+{
+    auto* c = new committer{ fs };
+    c->thread = std::thread{ commit_periodically, std::ref(*c) };
+    return c;
+}
+
+void committer_uninit(committer* c)
+{
+    if (!c)
+        return;
+
+    {
+        std::lock_guard<std::mutex> guard{ c->mutex };
+        c->stop = true;
+    }
+    c->stop_cv.notify_one();
+    c->thread.join();
+    delete c;
+}
+
+} // namespace ffsp
@@ -0,0 +1,42 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef COMMITTER_HPP
+#define COMMITTER_HPP
+
+#include "ffsp.hpp"
+
+namespace ffsp
+{
+
+struct committer;
+
+// Start a thread that writes back the dirty inodes and commits the
+//  checkpoint once the oldest of them waited for fs.commit_interval, even
+//  if no other operation comes along to do it.
+committer* committer_init(fs_context& fs);
+
+// Stop the thread and wait for it to finish. Must not be called while
+//  holding fs.lock.
+void committer_uninit(committer* c);
+
+} // namespace ffsp
+
+#endif /* COMMITTER_HPP */
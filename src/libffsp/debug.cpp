@@ -19,11 +19,13 @@
  */
 
 #include "debug.hpp"
+#include "eraseblk.hpp"
 #include "inode.hpp"
 #include "inode_group.hpp"
 #include "io_raw.hpp"
 #include "log.hpp"
 
+#include <atomic>
 #include <cerrno>
 #include <cinttypes>
 #include <cstdio>
@@ -40,15 +42,18 @@
 namespace ffsp
 {
 
+// The counters are updated from concurrently running operations.
 static struct ffsp_debug_info
 {
-    uint64_t read_raw;
-    uint64_t write_raw;
-    uint64_t fuse_read;
-    uint64_t fuse_write;
-    uint64_t gc_read;
-    uint64_t gc_write;
-} debug_info = {};
+    std::atomic<uint64_t> read_raw{ 0 };
+    std::atomic<uint64_t> write_raw{ 0 };
+    std::atomic<uint64_t> fuse_read{ 0 };
+    std::atomic<uint64_t> fuse_write{ 0 };
+    std::atomic<uint64_t> gc_read{ 0 };
+    std::atomic<uint64_t> gc_write{ 0 };
+    std::atomic<uint64_t> meta_write{ 0 };
+    std::atomic<uint64_t> commit_errors{ 0 };
+} debug_info;
 
 void debug_update(const fs_context& fs, debug_metric type, uint64_t val)
 {
@@ -74,6 +79,12 @@ void debug_update(const fs_context& fs, debug_metric type, uint64_t val)
         case debug_metric::gc_write:
             debug_info.gc_write += val;
             break;
+        case debug_metric::meta_write:
+            debug_info.meta_write += val;
+            break;
+        case debug_metric::commit_errors:
+            debug_info.commit_errors += val;
+            break;
     }
 }
 
@@ -126,7 +137,9 @@ static std::string get_metrics_info(fs_context& fs)
     os << "\"fuse_read\":" << debug_info.fuse_read << ",";
     os << "\"fuse_write\":" << debug_info.fuse_write << ",";
     os << "\"gc_read\":" << debug_info.gc_read << ",";
-    os << "\"gc_write\":" << debug_info.gc_write;
+    os << "\"gc_write\":" << debug_info.gc_write << ",";
+    os << "\"meta_write\":" << debug_info.meta_write << ",";
+    os << "\"commit_errors\":" << debug_info.commit_errors;
     os << "}";
 
     os << "}";
@@ -135,7 +148,7 @@ static std::string get_metrics_info(fs_context& fs)
 
 static std::string get_eb_info(fs_context& fs, eb_id_t eb_id)
 {
-    const eraseblock& eb = fs.eb_usage[eb_id];
+    const eraseblock_usage& eb = fs.eb_usage[eb_id];
 
     std::ostringstream os;
 
@@ -144,9 +157,10 @@ static std::string get_eb_info(fs_context& fs, eb_id_t eb_id)
     os << "\"eraseblock\":{";
     os << "\"eb_id\":" << eb_id << ",";
     os << "\"type\":" << int(eb.e_type) << ",";
-    os << "\"lastwrite\":" << get_be16(eb.e_lastwrite) << ",";
-    os << "\"cvalid\":" << get_be16(eb.e_cvalid) << ",";
-    os << "\"writeops\":" << get_be16(eb.e_writeops);
+    os << "\"lastwrite\":" << eb.e_lastwrite << ",";
+    os << "\"cvalid\":" << eb.e_cvalid << ",";
+    os << "\"writeops\":" << eb.e_writeops << ",";
+    os << "\"erasecnt\":" << eb_get_erase_cnt(fs, eb_id);
     os << "}";
 
     os << ",";
@@ -173,21 +187,21 @@ static std::string get_cl_info(fs_context& fs, cl_id_t cl_id)
     os << "{";
 
     const eb_id_t eb_id = cl_id * fs.clustersize / fs.erasesize;
-    const eraseblock& eb = fs.eb_usage[eb_id];
+    const eraseblock_usage& eb = fs.eb_usage[eb_id];
     os << "\"eraseblock\":{";
     os << "\"eb_id\":" << eb_id << ",";
     os << "\"type\":" << int(eb.e_type) << ",";
-    os << "\"lastwrite\":" << get_be16(eb.e_lastwrite) << ",";
-    os << "\"cvalid\":" << get_be16(eb.e_cvalid) << ",";
-    os << "\"writeops\":" << get_be16(eb.e_writeops);
+    os << "\"lastwrite\":" << eb.e_lastwrite << ",";
+    os << "\"cvalid\":" << eb.e_cvalid << ",";
+    os << "\"writeops\":" << eb.e_writeops << ",";
+    os << "\"erasecnt\":" << eb_get_erase_cnt(fs, eb_id);
     os << "}";
 
     os << ",";
     os << "\"cluster\":{";
     os << "\"cl_id\":" << cl_id << ",";
     os << "\"cl_offset\":" << (cl_id * fs.clustersize);
-    if (eb.e_type == eraseblock_type::dentry_inode ||
-        eb.e_type == eraseblock_type::file_inode)
+    if (is_inode_eraseblk_type(eb.e_type))
     {
         os << ",";
         os << "\"inodes\":[";
@@ -219,16 +233,17 @@ static std::string get_ino_info(fs_context& fs, uint32_t ino_no)
 
     os << "{";
 
-    const cl_id_t cl_id = get_be32(fs.ino_map[ino_no]);
+    const cl_id_t cl_id = fs.ino_map[ino_no];
     const eb_id_t eb_id = cl_id * fs.clustersize / fs.erasesize;
 
-    const eraseblock& eb = fs.eb_usage[eb_id];
+    const eraseblock_usage& eb = fs.eb_usage[eb_id];
     os << "\"eraseblock\":{";
     os << "\"eb_id\":" << eb_id << ",";
     os << "\"type\":" << int(eb.e_type) << ",";
-    os << "\"lastwrite\":" << get_be16(eb.e_lastwrite) << ",";
-    os << "\"cvalid\":" << get_be16(eb.e_cvalid) << ",";
-    os << "\"writeops\":" << get_be16(eb.e_writeops);
+    os << "\"lastwrite\":" << eb.e_lastwrite << ",";
+    os << "\"cvalid\":" << eb.e_cvalid << ",";
+    os << "\"writeops\":" << eb.e_writeops << ",";
+    os << "\"erasecnt\":" << eb_get_erase_cnt(fs, eb_id);
     os << "}";
 
     os << ",";
@@ -491,9 +506,8 @@ bool debug_readdir(fs_context& fs, const char* path, std::vector<std::string>& d
             const unsigned int cl_per_eb = fs.erasesize / fs.clustersize;
             for (eb_id_t eb_id = 0; eb_id < fs.neraseblocks; eb_id++)
             {
-                const eraseblock& eb = fs.eb_usage[eb_id];
-                if (eb.e_type == eraseblock_type::dentry_inode ||
-                    eb.e_type == eraseblock_type::file_inode)
+                const eraseblock_usage& eb = fs.eb_usage[eb_id];
+                if (is_inode_eraseblk_type(eb.e_type))
                 {
                     for (unsigned int cl_idx = 0; cl_idx < cl_per_eb; cl_idx++)
                     {
@@ -47,6 +47,8 @@ enum class debug_metric
     fuse_write,
     gc_read,
     gc_write,
+    meta_write,
+    commit_errors,
 };
 
 void debug_update(const fs_context& fs, debug_metric type, uint64_t val);
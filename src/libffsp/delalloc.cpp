@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "delalloc.hpp"
+
+#include <algorithm>
+#include <iterator>
+#include <unordered_map>
+
+#include <cstring>
+
+namespace ffsp
+{
+
+// Number of erase blocks worth of delayed data to keep in memory.
+constexpr uint64_t FFSP_DELALLOC_MAX_ERASEBLKS{ 16 };
+
+struct delalloc_cache
+{
+    explicit delalloc_cache(const fs_context& fs)
+        : max_bytes{ FFSP_DELALLOC_MAX_ERASEBLKS * fs.erasesize }
+    {
+    }
+
+    const uint64_t max_bytes;
+    uint64_t bytes{ 0 };
+    std::unordered_map<ino_t, delalloc_ranges> inodes;
+};
+
+static uint64_t range_end(const delalloc_ranges::value_type& range)
+{
+    return range.first + range.second.size();
+}
+
+delalloc_cache* delalloc_init(const fs_context& fs)
+{
+    return new delalloc_cache{ fs };
+}
+
+void delalloc_uninit(delalloc_cache* cache)
+{
+    delete cache;
+}
+
+void delalloc_add(delalloc_cache& cache, ino_t ino_no, const char* buf, uint64_t nbyte, uint64_t offset)
+{
+    if (!nbyte)
+        return;
+
+    delalloc_ranges& ranges = cache.inodes[ino_no];
+    const uint64_t end = offset + nbyte;
+
+    // Extend the range in front of the new data if it reaches up to it.
+    //  Sequential writes therefore keep appending to the same buffer.
+    auto it = ranges.upper_bound(offset);
+    if ((it != ranges.begin()) && (range_end(*std::prev(it)) >= offset))
+        --it;
+    else
+        it = ranges.emplace_hint(it, offset, std::vector<char>{});
+
+    std::vector<char>& data = it->second;
+    cache.bytes -= data.size();
+    if (range_end(*it) < end)
+        data.resize(end - it->first);
+
+    // Absorb the following ranges the new data overlaps or touches.
+    auto next = std::next(it);
+    while ((next != ranges.end()) && (next->first <= range_end(*it)))
+    {
+        if (range_end(*next) > range_end(*it))
+        {
+            uint64_t keep_off = range_end(*it) - next->first;
+            data.insert(data.end(), next->second.begin() + keep_off, next->second.end());
+        }
+        cache.bytes -= next->second.size();
+        next = ranges.erase(next);
+    }
+
+    memcpy(data.data() + (offset - it->first), buf, nbyte);
+    cache.bytes += data.size();
+}
+
+void delalloc_read(const delalloc_cache& cache, ino_t ino_no, char* buf, uint64_t nbyte, uint64_t offset)
+{
+    auto found = cache.inodes.find(ino_no);
+    if (found == cache.inodes.end())
+        return;
+
+    const delalloc_ranges& ranges = found->second;
+    const uint64_t end = offset + nbyte;
+
+    auto it = ranges.upper_bound(offset);
+    if (it != ranges.begin())
+        --it;
+    for (; (it != ranges.end()) && (it->first < end); ++it)
+    {
+        uint64_t first = std::max(offset, it->first);
+        uint64_t last = std::min(end, range_end(*it));
+        if (first < last)
+            memcpy(buf + (first - offset), it->second.data() + (first - it->first), last - first);
+    }
+}
+
+void delalloc_truncate(delalloc_cache& cache, ino_t ino_no, uint64_t length)
+{
+    auto found = cache.inodes.find(ino_no);
+    if (found == cache.inodes.end())
+        return;
+
+    delalloc_ranges& ranges = found->second;
+    auto it = ranges.lower_bound(length);
+    while (it != ranges.end())
+    {
+        cache.bytes -= it->second.size();
+        it = ranges.erase(it);
+    }
+    if (!ranges.empty() && (range_end(*ranges.rbegin()) > length))
+    {
+        auto& last = *ranges.rbegin();
+        cache.bytes -= last.second.size() - (length - last.first);
+        last.second.resize(length - last.first);
+    }
+    if (ranges.empty())
+        cache.inodes.erase(found);
+}
+
+delalloc_ranges delalloc_take(delalloc_cache& cache, ino_t ino_no)
+{
+    delalloc_ranges ranges;
+    auto found = cache.inodes.find(ino_no);
+    if (found == cache.inodes.end())
+        return ranges;
+
+    ranges.swap(found->second);
+    cache.inodes.erase(found);
+    for (const auto& range : ranges)
+        cache.bytes -= range.second.size();
+    return ranges;
+}
+
+bool delalloc_pending(const delalloc_cache& cache, ino_t ino_no)
+{
+    return cache.inodes.count(ino_no) != 0;
+}
+
+std::vector<ino_t> delalloc_inodes(const delalloc_cache& cache)
+{
+    std::vector<ino_t> ret;
+    for (const auto& entry : cache.inodes)
+        ret.push_back(entry.first);
+    return ret;
+}
+
+bool delalloc_full(const delalloc_cache& cache)
+{
+    return cache.bytes >= cache.max_bytes;
+}
+
+} // namespace ffsp
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DELALLOC_HPP
+#define DELALLOC_HPP
+
+#include "ffsp.hpp"
+
+#include <map>
+#include <vector>
+
+namespace ffsp
+{
+
+struct delalloc_cache;
+
+// File data that was written but not yet placed on the medium, keyed by
+//  the file offset it starts at. The ranges neither overlap nor touch.
+using delalloc_ranges = std::map<uint64_t, std::vector<char>>;
+
+delalloc_cache* delalloc_init(const fs_context& fs);
+void delalloc_uninit(delalloc_cache* cache);
+
+void delalloc_add(delalloc_cache& cache, ino_t ino_no, const char* buf, uint64_t nbyte, uint64_t offset);
+
+// Copy the delayed data inside the given range over 'buf'.
+void delalloc_read(const delalloc_cache& cache, ino_t ino_no, char* buf, uint64_t nbyte, uint64_t offset);
+
+// Drop the delayed data beyond 'length'.
+void delalloc_truncate(delalloc_cache& cache, ino_t ino_no, uint64_t length);
+
+// Remove and return all delayed data of the inode.
+delalloc_ranges delalloc_take(delalloc_cache& cache, ino_t ino_no);
+
+bool delalloc_pending(const delalloc_cache& cache, ino_t ino_no);
+std::vector<ino_t> delalloc_inodes(const delalloc_cache& cache);
+
+// Whether the delayed data takes up so much memory that it has to be
+//  written back.
+bool delalloc_full(const delalloc_cache& cache);
+
+} // namespace ffsp
+
+#endif /* DELALLOC_HPP */
@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "dir_index.hpp"
+
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+namespace ffsp
+{
+
+struct dir_index
+{
+    // Lookups run under the shared file system lock and fill in
+    //  directories that were dropped after a change.
+    std::mutex lock;
+    std::unordered_map<ino_t, std::vector<dentry>> dirs;
+};
+
+dir_index* dir_index_init(const fs_context& /*fs*/)
+{
+    return new dir_index;
+}
+
+void dir_index_uninit(dir_index* index)
+{
+    delete index;
+}
+
+bool dir_index_get(dir_index& index, ino_t ino_no, std::vector<dentry>& dentries)
+{
+    std::lock_guard<std::mutex> guard{ index.lock };
+    auto it = index.dirs.find(ino_no);
+    if (it == index.dirs.end())
+        return false;
+    dentries = it->second;
+    return true;
+}
+
+bool dir_index_find(dir_index& index, ino_t ino_no, const char* name, dentry& dent)
+{
+    std::lock_guard<std::mutex> guard{ index.lock };
+    auto it = index.dirs.find(ino_no);
+    if (it == index.dirs.end())
+        return false;
+
+    for (const auto& d : it->second)
+    {
+        if (get_be32(d.ino) == FFSP_INVALID_INO_NO)
+            continue; // Invalid ffsp_entry
+        if (!strncmp(d.name, name, FFSP_NAME_MAX))
+        {
+            dent = d;
+            return true;
+        }
+    }
+    dent.ino = put_be32(FFSP_INVALID_INO_NO);
+    return true;
+}
+
+void dir_index_insert(dir_index& index, ino_t ino_no, const std::vector<dentry>& dentries)
+{
+    std::lock_guard<std::mutex> guard{ index.lock };
+    index.dirs[ino_no] = dentries;
+}
+
+void dir_index_remove(dir_index& index, ino_t ino_no)
+{
+    std::lock_guard<std::mutex> guard{ index.lock };
+    index.dirs.erase(ino_no);
+}
+
+void dir_index_usage(dir_index& index, uint64_t& dir_cnt, uint64_t& bytes)
+{
+    std::lock_guard<std::mutex> guard{ index.lock };
+    dir_cnt = index.dirs.size();
+    bytes = 0;
+    for (const auto& dir : index.dirs)
+        bytes += dir.second.capacity() * sizeof(dentry);
+}
+
+} // namespace ffsp
@@ -0,0 +1,54 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef DIR_INDEX_HPP
+#define DIR_INDEX_HPP
+
+#include "ffsp.hpp"
+
+#include <vector>
+
+namespace ffsp
+{
+
+// In-memory copy of the dentries of directories, indexed by the inode
+//  number of the directory. Only used if the inodes are preloaded at
+//  mount time; it is then kept up-to-date by dropping the dentries of a
+//  directory whenever its data is changed.
+struct dir_index;
+
+dir_index* dir_index_init(const fs_context& fs);
+void dir_index_uninit(dir_index* index);
+
+// Copy of all dentries of the directory (readdir, rmdir).
+bool dir_index_get(dir_index& index, ino_t ino_no, std::vector<dentry>& dentries);
+// Path lookups only get the dentry called name; its inode number is
+//  FFSP_INVALID_INO_NO if the directory does not contain that name.
+//  Both return false if the directory is not indexed.
+bool dir_index_find(dir_index& index, ino_t ino_no, const char* name, dentry& dent);
+void dir_index_insert(dir_index& index, ino_t ino_no, const std::vector<dentry>& dentries);
+void dir_index_remove(dir_index& index, ino_t ino_no);
+
+// Number of directories and bytes used by their dentries.
+void dir_index_usage(dir_index& index, uint64_t& dir_cnt, uint64_t& bytes);
+
+} // namespace ffsp
+
+#endif /* DIR_INDEX_HPP */
@@ -25,6 +25,9 @@
 #include "log.hpp"
 #include "summary.hpp"
 
+#include <algorithm>
+
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 
@@ -38,28 +41,62 @@ bool eb_is_type(const fs_context& fs, eb_id_t eb_id, eraseblock_type type)
 
 int eb_get_cvalid(const fs_context& fs, eb_id_t eb_id)
 {
-    return get_be16(fs.eb_usage[eb_id].e_cvalid);
+    return fs.eb_usage[eb_id].e_cvalid;
 }
 
 void eb_inc_cvalid(fs_context& fs, eb_id_t eb_id)
 {
-    inc_be16(fs.eb_usage[eb_id].e_cvalid);
+    ++fs.eb_usage[eb_id].e_cvalid;
 }
 
 void eb_dec_cvalid(fs_context& fs, eb_id_t eb_id)
 {
-    dec_be16(fs.eb_usage[eb_id].e_cvalid);
+    --fs.eb_usage[eb_id].e_cvalid;
+}
+
+uint32_t eb_get_erase_cnt(const fs_context& fs, eb_id_t eb_id)
+{
+    return fs.eb_erase_cnt[eb_id];
+}
+
+static void eb_open(fs_context& fs, eb_id_t eb_id)
+{
+    // Writing into an empty erase block requires it to be erased first.
+    if (fs.eb_usage[eb_id].e_type == eraseblock_type::empty)
+    {
+        fs.eb_erase_cnt[eb_id] = eb_get_erase_cnt(fs, eb_id) + 1;
+        fs.eb_usage[eb_id].e_flags = 0;
+        ++fs.leveling_erase_cnt;
+    }
+}
+
+bool eb_is_unwritten(const fs_context& fs, eb_id_t eb_id)
+{
+    return fs.eb_usage[eb_id].e_flags & FFSP_EB_UNWRITTEN;
+}
+
+void eb_set_written(fs_context& fs, eb_id_t eb_id)
+{
+    fs.eb_usage[eb_id].e_flags &= static_cast<uint8_t>(~FFSP_EB_UNWRITTEN);
+}
+
+void eb_reserve(fs_context& fs, eb_id_t eb_id)
+{
+    // The erase block belongs to a file from now on but its stale
+    //  content must not be read until it was written.
+    eb_open(fs, eb_id);
+    fs.eb_usage[eb_id].e_type = eraseblock_type::ebin;
+    fs.eb_usage[eb_id].e_flags |= FFSP_EB_UNWRITTEN;
 }
 
 unsigned int emtpy_eraseblk_count(const fs_context& fs)
 {
-    unsigned int cnt = 0;
+    static_assert(offsetof(eraseblock_usage, e_type) == 0, "eraseblock_usage: unexpected layout");
+    static_assert(sizeof(eraseblock_usage) == 8, "eraseblock_usage: unexpected size");
 
     // Erase block id "0" is always reserved.
-    for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; ++eb_id)
-        if (fs.eb_usage[eb_id].e_type == eraseblock_type::empty)
-            ++cnt;
-    return cnt;
+    return static_cast<unsigned int>(count_u8_stride8(fs.eb_usage.data() + 1, fs.neraseblocks - 1,
+                                                      static_cast<uint8_t>(eraseblock_type::empty)));
 }
 
 eb_id_t find_empty_eraseblk(const fs_context& fs)
@@ -67,11 +104,30 @@ eb_id_t find_empty_eraseblk(const fs_context& fs)
     if (emtpy_eraseblk_count(fs) <= fs.nerasereserve)
         return FFSP_INVALID_EB_ID;
 
+    // Dynamic wear leveling: hand out the empty erase block that was
+    //  erased the least number of times instead of always cycling
+    //  through the first few erase blocks of the device.
+    eb_id_t found_eb_id = FFSP_INVALID_EB_ID;
+
     // Erase block id "0" is always reserved.
     for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; ++eb_id)
-        if (fs.eb_usage[eb_id].e_type == eraseblock_type::empty)
-            return eb_id;
-    return FFSP_INVALID_EB_ID;
+    {
+        if (fs.eb_usage[eb_id].e_type != eraseblock_type::empty)
+            continue;
+
+        if (   (found_eb_id == FFSP_INVALID_EB_ID)
+            || (eb_get_erase_cnt(fs, eb_id) < eb_get_erase_cnt(fs, found_eb_id)))
+            found_eb_id = eb_id;
+    }
+    return found_eb_id;
+}
+
+bool is_inode_eraseblk_type(eraseblock_type eb_type)
+{
+    return (eb_type == eraseblock_type::dentry_inode) ||
+           (eb_type == eraseblock_type::file_inode) ||
+           (eb_type == eraseblock_type::dentry_inode_cold) ||
+           (eb_type == eraseblock_type::file_inode_cold);
 }
 
 eraseblock_type get_eraseblk_type(const fs_context& fs, inode_data_type type, bool dentry)
@@ -130,6 +186,43 @@ eraseblock_type get_eraseblk_type(const fs_context& fs, inode_data_type type, bo
     return eraseblock_type::ebin;
 }
 
+eraseblock_type get_cold_eraseblk_type(const fs_context& fs, eraseblock_type eb_type)
+{
+    // Inodes that survived until their erase block got collected are
+    //  unlikely to be changed soon. Keep them apart from the freshly
+    //  written inodes so that invalidations concentrate in the "hot"
+    //  erase blocks and the GC has to copy less valid data.
+    // Only inodes are separated. Cluster indirect data is not collected
+    //  at all (see collect_clin() in gc.cpp) and erase block indirect
+    //  data belongs to a single file and is never relocated, so no data
+    //  cluster ever passes through the GC.
+
+    if (fs.neraseopen == 6)
+    {
+        // 1.-5. EB: see get_eraseblk_type()
+        // 6. EB: relocated inodes (dentry and file)
+
+        if (is_inode_eraseblk_type(eb_type))
+            return eraseblock_type::dentry_inode_cold;
+    }
+    else if (fs.neraseopen >= 7)
+    {
+        // 1.-5. EB: see get_eraseblk_type()
+        // 6. EB: relocated dentry inodes
+        // 7. EB: relocated file inodes
+
+        if (   eb_type == eraseblock_type::dentry_inode
+            || eb_type == eraseblock_type::dentry_inode_cold)
+            return eraseblock_type::dentry_inode_cold;
+        else if (   eb_type == eraseblock_type::file_inode
+                 || eb_type == eraseblock_type::file_inode_cold)
+            return eraseblock_type::file_inode_cold;
+    }
+    // Not enough open erase blocks: relocated data shares the erase
+    //  block with freshly written data of the same type.
+    return eb_type;
+}
+
 bool find_writable_cluster(const fs_context& fs, eraseblock_type eb_type,
                            eb_id_t& eb_id, cl_id_t& cl_id)
 {
@@ -150,7 +243,7 @@ bool find_writable_cluster(const fs_context& fs, eraseblock_type eb_type,
 
         // We found the right erase block type.
         // But it has to be open to be usable.
-        unsigned int cur_writeops = get_be16(fs.eb_usage[eb].e_writeops);
+        unsigned int cur_writeops = fs.eb_usage[eb].e_writeops;
         if (cur_writeops < max_writeops)
         {
             // This erase block is exactly what we were
@@ -196,6 +289,7 @@ void commit_write_operation(fs_context& fs, eraseblock_type eb_type,
         // Erase block indirect data is easy to handle.
         // It can never be "open" because it is always completely
         //  written by a single write operation.
+        eb_open(fs, eb_id);
         fs.eb_usage[eb_id].e_type = eb_type;
         return;
     }
@@ -203,14 +297,16 @@ void commit_write_operation(fs_context& fs, eraseblock_type eb_type,
     /* tell gcinfo that we wrote an erase block of a specific type */
     unsigned int write_time = gcinfo_update_writetime(fs, eb_type);
 
+    eb_open(fs, eb_id);
+
     // Update the meta data of the erase block that was written to.
     fs.eb_usage[eb_id].e_type = eb_type;
-    fs.eb_usage[eb_id].e_lastwrite = put_be16(write_time);
+    fs.eb_usage[eb_id].e_lastwrite = write_time;
     eb_inc_cvalid(fs, eb_id);
-    inc_be16(fs.eb_usage[eb_id].e_writeops);
+    ++fs.eb_usage[eb_id].e_writeops;
 
     int max_writeops = fs.erasesize / fs.clustersize;
-    uint16_t writeops = get_be16(fs.eb_usage[eb_id].e_writeops);
+    uint16_t writeops = fs.eb_usage[eb_id].e_writeops;
 
     if (!summary_required(fs, eb_type))
     {
@@ -254,54 +350,120 @@ void commit_write_operation(fs_context& fs, eraseblock_type eb_type,
          * tell gcinfo and update the erase block's usage data */
         write_time = gcinfo_update_writetime(fs, eb_type);
 
-        fs.eb_usage[eb_id].e_lastwrite = put_be16(write_time);
-        inc_be16(fs.eb_usage[eb_id].e_writeops);
+        fs.eb_usage[eb_id].e_lastwrite = write_time;
+        ++fs.eb_usage[eb_id].e_writeops;
         gcinfo_inc_writecnt(fs, eb_type);
     }
 }
 
-static bool free_eraseblk(eraseblock& eb)
+static bool free_eraseblk(eraseblock_usage& eb)
 {
-    if (   eb.e_type == eraseblock_type::dentry_inode
+    if (   is_inode_eraseblk_type(eb.e_type)
         || eb.e_type == eraseblock_type::dentry_clin
-        || eb.e_type == eraseblock_type::file_inode
         || eb.e_type == eraseblock_type::file_clin)
     {
         // The given erase block contains inodes or indirect pointers
         // and therefore tracks it's valid cluster count.
         // Set it to "free" if it doesn't contain any valid clusters.
-        if (get_be16(eb.e_cvalid) == 0)
+        if (eb.e_cvalid == 0)
         {
             eb.e_type = eraseblock_type::empty;
-            eb.e_lastwrite = put_be16(0);
-            eb.e_writeops = put_be16(0);
+            eb.e_lastwrite = 0;
+            eb.e_writeops = 0;
             return true;
         }
     }
-    else if (eb.e_type == eraseblock_type::ebin)
-    {
-        // TODO: implement me!
-        log().error("Unable to free ebin erase block {}", eb);
-    }
-    // the given erase block cannot be freed
+    // Erase block indirect data is freed by the file that owned it, see
+    //  release_replaced_eraseblk().
     return false;
 }
 
+static bool is_replaced_eraseblk(const fs_context& fs, eb_id_t eb_id)
+{
+    return std::find(fs.replaced_eraseblks.begin(), fs.replaced_eraseblks.end(), eb_id)
+        != fs.replaced_eraseblks.end();
+}
+
 void free_empty_eraseblks(fs_context& fs)
 {
     // Searches inside the erase block usage map for erase blocks
     // containing no valid data and sets them to "free".
 
+    // The old clusters of dirty inodes are no longer counted as valid
+    //  but the committed inode map still points to them.
+    if (fs.dirty_ino_cnt)
+        return;
+
+    unsigned int max_writeops = fs.erasesize / fs.clustersize;
+
     // erase block id "0" is reserved for the super erase block
     for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; eb_id++)
     {
+        eraseblock_type eb_type = fs.eb_usage[eb_id].e_type;
+        bool open = fs.eb_usage[eb_id].e_writeops < max_writeops;
+
+        // Erase blocks relocated by the GC are freed by the next commit.
+        if (is_inode_eraseblk_type(eb_type) && is_replaced_eraseblk(fs, eb_id))
+            continue;
+
         if (free_eraseblk(fs.eb_usage[eb_id]))
         {
+            // The cached summary of a freed open erase block must not
+            //  be continued by the next erase block of the same type.
+            if (open && summary_required(fs, eb_type))
+                summary_close(*fs.summary_cache, summary_get(*fs.summary_cache, eb_type));
+
             log().info("Empty erase block {} freed", eb_id);
         }
     }
 }
 
+void release_replaced_eraseblk(fs_context& fs, eb_id_t eb_id)
+{
+    // The erase block is still referenced by the inode on the medium or,
+    //  if the GC relocated its inodes, by the durable inode map.
+    fs.replaced_eraseblks.push_back(eb_id);
+}
+
+void free_replaced_eraseblks(fs_context& fs)
+{
+    // Only call this after all dirty inodes were written back; none of
+    //  them points to the replaced erase blocks any more.
+    for (eb_id_t eb_id : fs.replaced_eraseblks)
+    {
+        // Erase block indirect data is free as soon as its type says so.
+        //  Inode erase blocks relocated by the GC have no valid clusters
+        //  left and are reset like in free_eraseblk().
+        eraseblock_usage& eb = fs.eb_usage[eb_id];
+        eb.e_type = eraseblock_type::empty;
+        eb.e_lastwrite = 0;
+        eb.e_cvalid = 0;
+        eb.e_writeops = 0;
+        log().debug("Replaced erase block {} freed", eb_id);
+    }
+    fs.replaced_eraseblks.clear();
+}
+
+void close_orphaned_eraseblks(fs_context& fs)
+{
+    // The summaries of open erase blocks only exist in memory. They are
+    //  lost if the file system was not unmounted cleanly, so the affected
+    //  erase blocks cannot be continued and are closed without one.
+
+    unsigned int max_writeops = fs.erasesize / fs.clustersize;
+
+    for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; ++eb_id)
+    {
+        if (!summary_required(fs, fs.eb_usage[eb_id].e_type))
+            continue;
+        if (fs.eb_usage[eb_id].e_writeops == max_writeops)
+            continue;
+
+        log().info("Closing erase block {} without summary", eb_id);
+        fs.eb_usage[eb_id].e_writeops = max_writeops;
+    }
+}
+
 void close_eraseblks(fs_context& fs)
 {
     /* TODO: Error handling missing! */
@@ -312,15 +474,17 @@ void close_eraseblks(fs_context& fs)
             continue; /* can never be "open" */
         if (fs.eb_usage[eb_id].e_type == eraseblock_type::empty)
             continue; /* can never be "open" */
+        if (fs.eb_usage[eb_id].e_type == eraseblock_type::super)
+            continue; /* meta data journal */
 
         eraseblock_type eb_type = fs.eb_usage[eb_id].e_type;
-        unsigned int writeops = get_be16(fs.eb_usage[eb_id].e_writeops);
+        unsigned int writeops = fs.eb_usage[eb_id].e_writeops;
         unsigned int max_writeops = fs.erasesize / fs.clustersize;
 
         if (writeops == max_writeops)
             continue; /* erase block is already finalized/closed */
 
-        fs.eb_usage[eb_id].e_writeops = put_be16(max_writeops);
+        fs.eb_usage[eb_id].e_writeops = max_writeops;
 
         if (!summary_required(fs, eb_type))
             continue;
@@ -332,35 +496,8 @@ void close_eraseblks(fs_context& fs)
 
         /* tell gcinfo an erase block of a specific type was written */
         unsigned int write_time = gcinfo_update_writetime(fs, eb_type);
-        fs.eb_usage[eb_id].e_lastwrite = put_be16(write_time);
-    }
-}
-
-ssize_t write_meta_data(fs_context& fs)
-{
-    /*
-     * Copy erase block usage info and the content of the inode map
-     * into one continuous buffer so that we can initiate one
-     * cluster-aligned write request into the first erase block.
-     */
-
-    size_t eb_usage_size = fs.neraseblocks * sizeof(eraseblock);
-    memcpy(fs.buf, fs.eb_usage.data(), eb_usage_size);
-
-    size_t ino_map_size = fs.nino * sizeof(uint32_t);
-    memcpy(fs.buf + eb_usage_size, fs.ino_map.data(), ino_map_size);
-
-    size_t meta_data_size = eb_usage_size + ino_map_size;
-    uint64_t offset = fs.clustersize;
-
-    ssize_t rc = write_raw(*fs.io_ctx, fs.buf, meta_data_size, offset);
-    if (rc < 0)
-    {
-        log().error("writing meta data to first erase block failed");
-        return rc;
+        fs.eb_usage[eb_id].e_lastwrite = write_time;
     }
-    debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
-    return rc;
 }
 
 } // namespace ffsp
@@ -37,16 +37,24 @@ bool eb_is_type(const fs_context& fs, eb_id_t eb_id, eraseblock_type type);
 int eb_get_cvalid(const fs_context& fs, eb_id_t eb_id);
 void eb_inc_cvalid(fs_context& fs, eb_id_t eb_id);
 void eb_dec_cvalid(fs_context& fs, eb_id_t eb_id);
+uint32_t eb_get_erase_cnt(const fs_context& fs, eb_id_t eb_id);
+bool eb_is_unwritten(const fs_context& fs, eb_id_t eb_id);
+void eb_set_written(fs_context& fs, eb_id_t eb_id);
+void eb_reserve(fs_context& fs, eb_id_t eb_id);
 
+bool is_inode_eraseblk_type(eraseblock_type eb_type);
 eraseblock_type get_eraseblk_type(const fs_context& fs, inode_data_type type, bool dentry);
+eraseblock_type get_cold_eraseblk_type(const fs_context& fs, eraseblock_type eb_type);
 
 unsigned int emtpy_eraseblk_count(const fs_context& fs);
 eb_id_t find_empty_eraseblk(const fs_context& fs);
 bool find_writable_cluster(const fs_context& fs, eraseblock_type eb_type, eb_id_t& eb_id, cl_id_t& cl_id);
 void commit_write_operation(fs_context& fs, eraseblock_type eb_type, eb_id_t eb_id, be32_t ino_no);
 void free_empty_eraseblks(fs_context& fs);
+void release_replaced_eraseblk(fs_context& fs, eb_id_t eb_id);
+void free_replaced_eraseblks(fs_context& fs);
+void close_orphaned_eraseblks(fs_context& fs);
 void close_eraseblks(fs_context& fs);
-ssize_t write_meta_data(fs_context& fs);
 
 } // namespace ffsp
 
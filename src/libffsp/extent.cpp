@@ -0,0 +1,576 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "extent.hpp"
+#include "debug.hpp"
+#include "eraseblk.hpp"
+#include "inode.hpp"
+#include "io_raw.hpp"
+#include "log.hpp"
+#include "scratch.hpp"
+
+#include <algorithm>
+
+#include <cerrno>
+#include <cstring>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef S_ISDIR
+#include <io.h>
+#define S_ISDIR(mode) (((mode)&S_IFMT) == S_IFDIR)
+#endif
+#endif
+
+namespace ffsp
+{
+
+/*
+ * Files larger than what the erase block indirect pointers inside the inode
+ * can address map their erase blocks through a tree of extents. An extent
+ * covers a run of erase blocks that are contiguous inside the file as well
+ * as on the medium, so a sequentially written file needs only a few of them
+ * no matter how large it grows. Lookups descend from the root inside the
+ * inode and do a binary search on every level.
+ *
+ * The nodes below the root take up one cluster each and are never changed
+ * in place. A changed node is written into a new cluster of a cluster
+ * indirect erase block and its parent is updated to point to it, up to the
+ * root. The old cluster is invalidated just like an overwritten data
+ * cluster of a medium sized file.
+ */
+
+// Nodes deeper than this are considered to be corrupted.
+constexpr unsigned int FFSP_EXTENT_MAX_DEPTH{ 8 };
+
+struct extent_child
+{
+    uint32_t block; // first logical erase block covered by the node
+    cl_id_t cl_id;
+};
+
+struct extent_node
+{
+    unsigned int depth{ 0 };
+    std::vector<extent_run> runs;       // entries of a leaf node
+    std::vector<extent_child> children; // entries of an index node
+
+    size_t size() const { return depth ? children.size() : runs.size(); }
+    uint32_t first_block() const { return depth ? children.front().block : runs.front().block; }
+};
+
+// Nodes written and made obsolete by a change of the tree. Depending on
+//  whether the change succeeded one of them has to be released.
+struct extent_update
+{
+    std::vector<cl_id_t> written;
+    std::vector<cl_id_t> replaced;
+};
+
+static size_t entry_size(unsigned int depth)
+{
+    return depth ? sizeof(extent_idx) : sizeof(extent);
+}
+
+static uint64_t root_area_size(const fs_context& fs)
+{
+    return fs.clustersize - sizeof(inode);
+}
+
+static size_t root_capacity(const fs_context& fs, unsigned int depth)
+{
+    return (root_area_size(fs) - sizeof(extent_header)) / entry_size(depth);
+}
+
+static size_t node_capacity(const fs_context& fs, unsigned int depth)
+{
+    return (fs.clustersize - sizeof(extent_header)) / entry_size(depth);
+}
+
+static int decode_node(const char* buf, uint64_t buf_size, extent_node& node)
+{
+    const auto* hdr = reinterpret_cast<const extent_header*>(buf);
+    unsigned int depth = get_be16(hdr->eh_depth);
+    size_t entries = get_be16(hdr->eh_entries);
+
+    if ((depth > FFSP_EXTENT_MAX_DEPTH) || (entries > (buf_size - sizeof(extent_header)) / entry_size(depth)))
+    {
+        log().error("Invalid extent node: depth={}, entries={}", depth, entries);
+        return -EIO;
+    }
+    node.depth = depth;
+    node.runs.clear();
+    node.children.clear();
+
+    if (depth)
+    {
+        const auto* idx = reinterpret_cast<const extent_idx*>(hdr + 1);
+        node.children.reserve(entries);
+        for (size_t i = 0; i < entries; ++i)
+            node.children.push_back({ get_be32(idx[i].ei_block), get_be32(idx[i].ei_leaf) });
+    }
+    else
+    {
+        const auto* ext = reinterpret_cast<const extent*>(hdr + 1);
+        node.runs.reserve(entries);
+        for (size_t i = 0; i < entries; ++i)
+            node.runs.push_back({ get_be32(ext[i].ee_block), get_be32(ext[i].ee_len), get_be32(ext[i].ee_start) });
+    }
+    return 0;
+}
+
+static void encode_node(const extent_node& node, char* buf, uint64_t buf_size)
+{
+    auto* hdr = reinterpret_cast<extent_header*>(buf);
+    hdr->eh_entries = put_be16(static_cast<uint16_t>(node.size()));
+    hdr->eh_depth = put_be16(static_cast<uint16_t>(node.depth));
+    hdr->reserved = put_be32(0);
+
+    if (node.depth)
+    {
+        auto* idx = reinterpret_cast<extent_idx*>(hdr + 1);
+        for (const auto& child : node.children)
+        {
+            idx->ei_block = put_be32(child.block);
+            idx->ei_leaf = put_be32(child.cl_id);
+            ++idx;
+        }
+    }
+    else
+    {
+        auto* ext = reinterpret_cast<extent*>(hdr + 1);
+        for (const auto& run : node.runs)
+        {
+            ext->ee_block = put_be32(run.block);
+            ext->ee_len = put_be32(run.len);
+            ext->ee_start = put_be32(run.start);
+            ++ext;
+        }
+    }
+    uint64_t used = sizeof(extent_header) + node.size() * entry_size(node.depth);
+    memset(buf + used, 0, buf_size - used);
+}
+
+static int read_root(const fs_context& fs, const inode& ino, extent_node& root)
+{
+    return decode_node(static_cast<const char*>(inode_data(ino)), root_area_size(fs), root);
+}
+
+static void write_root(const fs_context& fs, inode& ino, const extent_node& root)
+{
+    encode_node(root, static_cast<char*>(inode_data(ino)), root_area_size(fs));
+}
+
+static int read_child(fs_context& fs, const extent_node& parent, size_t index, extent_node& child)
+{
+    cl_id_t cl_id = parent.children[index].cl_id;
+    if (!cl_id || (cl_id / (fs.erasesize / fs.clustersize) >= fs.neraseblocks))
+    {
+        log().error("Invalid extent node cluster id {}", cl_id);
+        return -EIO;
+    }
+
+    scratch_buf cl_buf{ fs, fs.clustersize };
+    ssize_t rc = read_raw(*fs.io_ctx, cl_buf.data(), fs.clustersize, uint64_t{ cl_id } * fs.clustersize);
+    if (rc < 0)
+        return static_cast<int>(rc);
+    debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+
+    int decode_rc = decode_node(cl_buf.data(), fs.clustersize, child);
+    if (decode_rc < 0)
+        return decode_rc;
+
+    if (child.depth + 1 != parent.depth)
+    {
+        log().error("Extent node {} has depth {} below depth {}", cl_id, child.depth, parent.depth);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int write_node(fs_context& fs, const inode& ino, const extent_node& node, cl_id_t& cl_id, extent_update& upd)
+{
+    bool for_dentry = S_ISDIR(get_be32(ino.i_mode));
+    eraseblock_type eb_type = get_eraseblk_type(fs, inode_data_type::clin, for_dentry);
+
+    eb_id_t eb_id;
+    if (!find_writable_cluster(fs, eb_type, eb_id, cl_id))
+    {
+        log().debug("Failed to find writable cluster for extent node");
+        return -ENOSPC;
+    }
+
+    scratch_buf cl_buf{ fs, fs.clustersize };
+    encode_node(node, cl_buf.data(), fs.clustersize);
+
+    ssize_t rc = write_raw(*fs.io_ctx, cl_buf.data(), fs.clustersize, uint64_t{ cl_id } * fs.clustersize);
+    if (rc < 0)
+        return static_cast<int>(rc);
+    debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
+
+    commit_write_operation(fs, eb_type, eb_id, ino.i_no);
+    upd.written.push_back(cl_id);
+    return 0;
+}
+
+/*
+ * Write the entries of 'node' into as many nodes as needed to not exceed
+ * 'capacity' entries per node and append them to 'written'. The entries
+ * are distributed evenly so that the new nodes have room for more.
+ */
+static int write_nodes(fs_context& fs, const inode& ino, const extent_node& node, size_t capacity,
+                       std::vector<extent_child>& written, extent_update& upd)
+{
+    const size_t cnt = node.size();
+    const size_t node_cnt = (cnt + capacity - 1) / capacity;
+
+    size_t first = 0;
+    for (size_t i = 0; i < node_cnt; ++i)
+    {
+        const size_t last = cnt * (i + 1) / node_cnt;
+
+        extent_node part;
+        part.depth = node.depth;
+        if (node.depth)
+            part.children.assign(node.children.begin() + first, node.children.begin() + last);
+        else
+            part.runs.assign(node.runs.begin() + first, node.runs.begin() + last);
+
+        cl_id_t cl_id;
+        int rc = write_node(fs, ino, part, cl_id, upd);
+        if (rc < 0)
+            return rc;
+        written.push_back({ part.first_block(), cl_id });
+        first = last;
+    }
+    return 0;
+}
+
+static int finish_update(fs_context& fs, const extent_update& upd, int rc)
+{
+    extent_release_nodes(fs, rc < 0 ? upd.written : upd.replaced);
+    return rc;
+}
+
+// Index of the child node that covers the logical erase block 'block'.
+static size_t find_child(const std::vector<extent_child>& children, uint32_t block)
+{
+    auto it = std::upper_bound(children.begin(), children.end(), block,
+                               [](uint32_t b, const extent_child& child) { return b < child.block; });
+    return (it == children.begin()) ? 0 : static_cast<size_t>(it - children.begin() - 1);
+}
+
+// First run that starts behind the logical erase block 'block'.
+static std::vector<extent_run>::iterator find_next_run(std::vector<extent_run>& runs, uint32_t block)
+{
+    return std::upper_bound(runs.begin(), runs.end(), block,
+                            [](uint32_t b, const extent_run& run) { return b < run.block; });
+}
+
+/*
+ * Change the mapping of a single erase block inside the runs of a leaf.
+ * Runs are split if the block is cut out of them and merged with their
+ * neighbours if the block fills the gap between them.
+ */
+static bool map_run(std::vector<extent_run>& runs, uint32_t block, eb_id_t eb_id)
+{
+    auto next = find_next_run(runs, block);
+    bool changed = false;
+
+    if (next != runs.begin())
+    {
+        auto cur = std::prev(next);
+        const uint32_t index = block - cur->block;
+        if (index < cur->len)
+        {
+            if (eb_id && (cur->start + index == eb_id))
+                return false; // Nothing to do
+
+            // Cut the block out of the run
+            extent_run tail{ block + 1, cur->len - index - 1, cur->start + index + 1 };
+            cur->len = index;
+            next = cur->len ? std::next(cur) : runs.erase(cur);
+            if (tail.len)
+                next = runs.insert(next, tail);
+            changed = true;
+        }
+    }
+    if (!eb_id)
+        return changed;
+
+    const bool join_next = (next != runs.end()) && (next->block == block + 1) && (next->start == eb_id + 1);
+    if (next != runs.begin())
+    {
+        auto prev = std::prev(next);
+        if ((prev->block + prev->len == block) && (prev->start + prev->len == eb_id))
+        {
+            ++prev->len;
+            if (join_next)
+            {
+                prev->len += next->len;
+                runs.erase(next);
+            }
+            return true;
+        }
+    }
+    if (join_next)
+    {
+        next->block = block;
+        next->start = eb_id;
+        ++next->len;
+        return true;
+    }
+    runs.insert(next, { block, 1, eb_id });
+    return true;
+}
+
+static int map_in_node(fs_context& fs, const inode& ino, extent_node& node, uint32_t block, eb_id_t eb_id,
+                       bool& changed, extent_update& upd)
+{
+    if (!node.depth)
+    {
+        changed = map_run(node.runs, block, eb_id);
+        return 0;
+    }
+    if (node.children.empty())
+        return -EIO;
+
+    const size_t index = find_child(node.children, block);
+    extent_node child;
+    int rc = read_child(fs, node, index, child);
+    if (rc < 0)
+        return rc;
+
+    rc = map_in_node(fs, ino, child, block, eb_id, changed, upd);
+    if ((rc < 0) || !changed)
+        return rc;
+
+    // Replace the child by its new version. It is split up if it grew too
+    //  large and dropped if it does not contain any entries anymore.
+    std::vector<extent_child> replacement;
+    rc = write_nodes(fs, ino, child, node_capacity(fs, child.depth), replacement, upd);
+    if (rc < 0)
+        return rc;
+    upd.replaced.push_back(node.children[index].cl_id);
+
+    auto pos = node.children.erase(node.children.begin() + index);
+    node.children.insert(pos, replacement.begin(), replacement.end());
+    return 0;
+}
+
+/* Push the root's entries down into new nodes until they fit into the inode. */
+static int store_root(fs_context& fs, inode& ino, extent_node& root, extent_update& upd)
+{
+    while (root.size() > root_capacity(fs, root.depth))
+    {
+        if (root.depth == FFSP_EXTENT_MAX_DEPTH)
+            return -EFBIG;
+
+        extent_node top;
+        top.depth = root.depth + 1;
+        int rc = write_nodes(fs, ino, root, node_capacity(fs, root.depth), top.children, upd);
+        if (rc < 0)
+            return rc;
+        root = std::move(top);
+    }
+    if (!root.size())
+        root.depth = 0;
+
+    write_root(fs, ino, root);
+    return 0;
+}
+
+static int collect_node(fs_context& fs, const extent_node& node, std::vector<extent_run>& runs,
+                        std::vector<cl_id_t>* nodes)
+{
+    if (!node.depth)
+    {
+        runs.insert(runs.end(), node.runs.begin(), node.runs.end());
+        return 0;
+    }
+    for (size_t i = 0; i < node.children.size(); ++i)
+    {
+        if (nodes)
+            nodes->push_back(node.children[i].cl_id);
+
+        extent_node child;
+        int rc = read_child(fs, node, i, child);
+        if (!(rc < 0))
+            rc = collect_node(fs, child, runs, nodes);
+        if (rc < 0)
+            return rc;
+    }
+    return 0;
+}
+
+uint64_t extent_root_size(const inode& ino)
+{
+    const auto* hdr = static_cast<const extent_header*>(inode_data(ino));
+    return sizeof(extent_header) + get_be16(hdr->eh_entries) * entry_size(get_be16(hdr->eh_depth));
+}
+
+int extent_lookup(fs_context& fs, const inode& ino, uint32_t block, extent_run& run)
+{
+    extent_node node;
+    int rc = read_root(fs, ino, node);
+    if (rc < 0)
+        return rc;
+
+    // The next run cannot start behind the next node on the way down.
+    uint32_t limit = UINT32_MAX;
+    while (node.depth && !node.children.empty())
+    {
+        const size_t index = find_child(node.children, block);
+        if (index + 1 < node.children.size())
+            limit = node.children[index + 1].block;
+
+        extent_node child;
+        rc = read_child(fs, node, index, child);
+        if (rc < 0)
+            return rc;
+        node = std::move(child);
+    }
+
+    auto next = find_next_run(node.runs, block);
+    if (next != node.runs.begin())
+    {
+        auto cur = std::prev(next);
+        if (block - cur->block < cur->len)
+        {
+            run = *cur;
+            return 0;
+        }
+    }
+    if (next != node.runs.end())
+        limit = std::min(limit, next->block);
+
+    run = { block, limit - block, FFSP_INVALID_EB_ID };
+    return 0;
+}
+
+int extent_map(fs_context& fs, inode& ino, uint32_t block, eb_id_t eb_id)
+{
+    extent_node root;
+    int rc = read_root(fs, ino, root);
+    if (rc < 0)
+        return rc;
+
+    extent_update upd;
+    bool changed = false;
+    rc = map_in_node(fs, ino, root, block, eb_id, changed, upd);
+    if (!(rc < 0) && changed)
+        rc = store_root(fs, ino, root, upd);
+    return finish_update(fs, upd, rc);
+}
+
+int extent_build(fs_context& fs, inode& ino, const std::vector<extent_run>& runs)
+{
+    extent_node root;
+    root.runs = runs;
+
+    extent_update upd;
+    return finish_update(fs, upd, store_root(fs, ino, root, upd));
+}
+
+int extent_collect(fs_context& fs, const inode& ino, std::vector<extent_run>& runs, std::vector<cl_id_t>* nodes)
+{
+    extent_node root;
+    int rc = read_root(fs, ino, root);
+    if (rc < 0)
+        return rc;
+    return collect_node(fs, root, runs, nodes);
+}
+
+int extent_truncate(fs_context& fs, inode& ino, uint32_t block_cnt)
+{
+    std::vector<extent_run> runs;
+    std::vector<cl_id_t> nodes;
+    int rc = extent_collect(fs, ino, runs, &nodes);
+    if (rc < 0)
+        return rc;
+
+    std::vector<extent_run> kept;
+    std::vector<extent_run> dropped;
+    for (const auto& run : runs)
+    {
+        if (run.block >= block_cnt)
+        {
+            dropped.push_back(run);
+        }
+        else if (block_cnt - run.block < run.len)
+        {
+            const uint32_t len = block_cnt - run.block;
+            kept.push_back({ run.block, len, run.start });
+            dropped.push_back({ block_cnt, run.len - len, run.start + len });
+        }
+        else
+        {
+            kept.push_back(run);
+        }
+    }
+    if (dropped.empty())
+        return 0;
+
+    // Shrinking is rare enough to simply rebuild the whole tree.
+    rc = extent_build(fs, ino, kept);
+    if (rc < 0)
+        return rc;
+
+    extent_release_nodes(fs, nodes);
+    extent_release_runs(fs, dropped);
+    return 0;
+}
+
+int extent_release(fs_context& fs, const inode& ino)
+{
+    std::vector<extent_run> runs;
+    std::vector<cl_id_t> nodes;
+    int rc = extent_collect(fs, ino, runs, &nodes);
+    if (rc < 0)
+        return rc;
+
+    extent_release_nodes(fs, nodes);
+    extent_release_runs(fs, runs);
+    return 0;
+}
+
+void extent_release_runs(fs_context& fs, const std::vector<extent_run>& runs)
+{
+    for (const auto& run : runs)
+    {
+        for (uint32_t i = 0; i < run.len; ++i)
+        {
+            // The inode on the medium still maps the erase block until
+            //  the next commit; only then may it be reused.
+            eb_id_t eb_id = run.start + i;
+            if (eb_id && (eb_id < fs.neraseblocks))
+                release_replaced_eraseblk(fs, eb_id);
+        }
+    }
+}
+
+void extent_release_nodes(fs_context& fs, const std::vector<cl_id_t>& nodes)
+{
+    const unsigned int cl_per_eb = fs.erasesize / fs.clustersize;
+    for (cl_id_t cl_id : nodes)
+        eb_dec_cvalid(fs, cl_id / cl_per_eb);
+}
+
+} // namespace ffsp
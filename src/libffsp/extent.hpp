@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef EXTENT_HPP
+#define EXTENT_HPP
+
+#include "ffsp.hpp"
+
+#include <vector>
+
+namespace ffsp
+{
+
+// In-memory copy of 'extent' in native byte order. A run with a 'start'
+//  of FFSP_INVALID_EB_ID describes a file hole.
+struct extent_run
+{
+    uint32_t block; // first logical erase block inside the file
+    uint32_t len;   // number of erase blocks
+    eb_id_t start;  // first physical erase block id
+};
+
+// Size of the extent tree root inside the inode's data section.
+uint64_t extent_root_size(const inode& ino);
+
+// Find the run containing the logical erase block 'block'. If the block is
+//  not mapped the returned run describes the file hole around it.
+int extent_lookup(fs_context& fs, const inode& ino, uint32_t block, extent_run& run);
+
+// Map the logical erase block 'block' to the erase block 'eb_id' or unmap
+//  it if 'eb_id' is FFSP_INVALID_EB_ID. The changed nodes are rewritten.
+int extent_map(fs_context& fs, inode& ino, uint32_t block, eb_id_t eb_id);
+
+// Replace the extent tree of the inode with one that contains 'runs'.
+//  The nodes of the old tree have to be released by the caller.
+int extent_build(fs_context& fs, inode& ino, const std::vector<extent_run>& runs);
+
+// Collect all runs of the tree in logical order and the cluster ids of
+//  its nodes (except the root).
+int extent_collect(fs_context& fs, const inode& ino, std::vector<extent_run>& runs, std::vector<cl_id_t>* nodes);
+
+// Drop all mappings starting at the logical erase block 'block_cnt'.
+int extent_truncate(fs_context& fs, inode& ino, uint32_t block_cnt);
+
+// Release all erase blocks and nodes of the tree.
+int extent_release(fs_context& fs, const inode& ino);
+
+void extent_release_runs(fs_context& fs, const std::vector<extent_run>& runs);
+void extent_release_nodes(fs_context& fs, const std::vector<cl_id_t>& nodes);
+
+} // namespace ffsp
+
+#endif /* EXTENT_HPP */
@@ -23,6 +23,10 @@
 
 #include "byteorder.hpp"
 
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <shared_mutex>
 #include <vector>
 
 #include <cassert>
@@ -48,11 +52,23 @@ struct superblock
     be32_t s_neraseopen;    // erase blocks to be hold open simultaneously
     be32_t s_nerasereserve; // number of erase blocks for internal use
     be32_t s_nerasewrites;  // number of erase block to finalize before GC
+    be32_t s_journaleb;     // erase block holding the meta data journal
+    be32_t s_cpgen;         // generation of the last meta data checkpoint
+    be32_t s_state;         // FFSP_STATE_CLEAN if unmounted cleanly
+    be64_t s_wseq;          // inode write sequence of the last checkpoint
+    be32_t s_seed;          // random value seeding the inode checksums
 
-    be32_t reserved[21]; // extend to 128 Bytes
+    be32_t reserved[15]; // extend to 128 Bytes
 };
 static_assert(sizeof(superblock) == 128, "superblock: unexpected size");
 
+// Files too large for cluster indirect pointers inside the inode use double
+//  cluster indirect pointers instead of erase block indirect ones or extents.
+constexpr uint32_t FFSP_SUPER_DCLIN{ 0x00000001 };
+
+constexpr uint32_t FFSP_STATE_CLEAN{ 0x00000000 };
+constexpr uint32_t FFSP_STATE_MOUNTED{ 0x00000001 };
+
 struct timespec
 {
 #ifdef _WIN32
@@ -81,6 +97,16 @@ enum class inode_data_type : uint8_t
     // The inode's data section contains erase block ids which contain the data
     // For large files (actual max size depends on the cluster size).
     ebin = 0x04,
+
+    // The inode's data section contains the root of an extent tree that
+    //  maps runs of erase blocks containing the data.
+    // For files too large for erase block indirect pointers.
+    extent = 0x08,
+
+    // The inode's data section contains cluster ids of pointer clusters
+    //  which contain the cluster ids of the data.
+    // For large files on file systems created with FFSP_SUPER_DCLIN.
+    dclin = 0x10,
 };
 
 struct inode
@@ -98,10 +124,50 @@ struct inode
     timespec i_ctime;
     timespec i_mtime;
 
-    be32_t reserved[13]; // extend to 128 Bytes
+    // sequence number of the write operation that put the inode on disk
+#ifdef _WIN32
+#pragma pack(push, 4)
+    be64_t i_wseq;
+#pragma pack(pop)
+#else
+    be64_t i_wseq __attribute__((packed, aligned(4)));
+#endif
+    // checksum of the inode seeded with the file system's s_seed and the
+    //  id of the cluster the inode was written to (calculated with i_csum=0)
+    be32_t i_csum;
+
+    be32_t reserved[10]; // extend to 128 Bytes
 };
 static_assert(sizeof(inode) == 128, "inode: unexpected size");
 
+// Every node of an extent tree starts with this header. The root node is
+//  located inside the inode's data section, all other nodes take up one
+//  cluster each. Nodes with a depth of 0 contain 'extent' entries, all
+//  other nodes 'extent_idx' entries, sorted by their first logical block.
+struct extent_header
+{
+    be16_t eh_entries; // number of entries following the header
+    be16_t eh_depth;   // distance to the leaf nodes
+    be32_t reserved;
+};
+static_assert(sizeof(extent_header) == 8, "extent_header: unexpected size");
+
+// Run of logically and physically contiguous erase blocks.
+struct extent
+{
+    be32_t ee_block; // first logical erase block inside the file
+    be32_t ee_len;   // number of erase blocks
+    be32_t ee_start; // first physical erase block id
+};
+static_assert(sizeof(extent) == 12, "extent: unexpected size");
+
+struct extent_idx
+{
+    be32_t ei_block; // first logical erase block covered by the node
+    be32_t ei_leaf;  // cluster id of the node
+};
+static_assert(sizeof(extent_idx) == 8, "extent_idx: unexpected size");
+
 enum class eraseblock_type : uint8_t
 {
     super = 0x00,
@@ -111,20 +177,53 @@ enum class eraseblock_type : uint8_t
     file_clin = 0x08,
     ebin = 0x10,
     empty = 0x20,
+    dentry_inode_cold = 0x40, // dentry inodes relocated by the GC
+    file_inode_cold = 0x80,   // file inodes relocated by the GC
     invalid = 0xff,
 };
 static_assert(sizeof(eraseblock_type) == 1, "eraseblock_type: unexpected size");
 
+// Erase block flags
+// The erase block was reserved for a file by fallocate() but not written
+//  yet. Its content is stale and reads as zeros.
+constexpr uint8_t FFSP_EB_UNWRITTEN{ 0x01 };
+
 struct eraseblock
 {
     eraseblock_type e_type{eraseblock_type::invalid};
-    uint8_t reserved;
+    uint8_t e_flags;
     be16_t e_lastwrite{0};
     be16_t e_cvalid{0};   // valid clusters inside the erase block
     be16_t e_writeops{0}; // how many writes were performed on this eb
 };
 static_assert(sizeof(eraseblock) == 8, "eraseblock: unexpected size");
 
+constexpr uint32_t FFSP_JOURNAL_MAGIC{ 0x4a524e4c }; // "JRNL"
+constexpr uint32_t FFSP_JOURNAL_COMMIT{ 0x00000001 };
+
+// Every cluster of the journal erase block starts with this header,
+//  followed by j_nrec journal records.
+struct journal_header
+{
+    be32_t j_magic;  // FFSP_JOURNAL_MAGIC
+    be32_t j_cpgen;  // checkpoint generation the records apply to
+    be32_t j_seq;    // position of the cluster inside the journal
+    be32_t j_nrec;   // number of records inside this cluster
+    be32_t j_flags;  // FFSP_JOURNAL_COMMIT on the last cluster of a commit
+    be32_t j_csum;   // checksum of the cluster (calculated with j_csum=0)
+    be64_t j_wseq;   // inode write sequence at the time of the commit
+};
+static_assert(sizeof(journal_header) == 32, "journal_header: unexpected size");
+
+// Change of four bytes inside the meta data area of the first erase block
+//  (erase block usage, erase counts and inode map).
+struct journal_record
+{
+    be32_t r_offset; // offset relative to the second cluster
+    be32_t r_value;  // new content, stored as is
+};
+static_assert(sizeof(journal_record) == 8, "journal_record: unexpected size");
+
 const unsigned int FFSP_NAME_MAX{ 248 };
 
 struct dentry
@@ -152,15 +251,41 @@ const cl_id_t FFSP_RESERVED_CL_ID{ 0xffffffff };
 // Erase block ids - 32bit
 const eb_id_t FFSP_INVALID_EB_ID{ 0x00000000 };
 
+// In-memory copy of 'eraseblock' in native byte order. It is converted
+//  from and to the on-disk format when the meta data is read or written.
+struct eraseblock_usage
+{
+    eraseblock_type e_type{eraseblock_type::invalid};
+    uint8_t e_flags{0};
+    uint16_t e_lastwrite{0};
+    uint16_t e_cvalid{0};   // valid clusters inside the erase block
+    uint16_t e_writeops{0}; // how many writes were performed on this eb
+};
+static_assert(sizeof(eraseblock_usage) == sizeof(eraseblock), "eraseblock_usage: unexpected size");
+
 struct io_backend;
 struct inode_cache;
 struct summary_cache;
 struct gcinfo;
+struct checkpoint;
+struct scratch_pool;
+struct delalloc_cache;
+struct cl_occupancy;
+struct dir_index;
+struct committer;
+
+// Dirty inodes are collected until they fill a number of clusters or until
+//  the oldest of them waited for this long. Each flush is a group commit of
+//  all operations since the last one.
+constexpr std::chrono::seconds FFSP_COMMIT_INTERVAL{ 5 };
 
 struct fs_context
 {
     io_backend* io_ctx{nullptr};
 
+    // Serializes the FUSE operations that access the file system.
+    std::shared_mutex lock;
+
     uint32_t fsid{ 0 };          // file system ID
     uint32_t flags{ 0 };         // mount flags - TODO: What are these for? -> noatime(?)
     uint32_t neraseblocks{ 0 };  // number of erase blocks
@@ -172,16 +297,38 @@ struct fs_context
     uint32_t neraseopen{ 0 };    // erase blocks to be hold open simultaneously
     uint32_t nerasereserve{ 0 }; // number of erase blocks for internal use
     uint32_t nerasewrites{ 0 };  // number of erase block to finalize before GC
+    uint32_t seed{ 0 };          // random value seeding the inode checksums
+
+    // Sequence number of the last inode cluster that was written. It is
+    //  stored inside every written inode to be able to tell inode clusters
+    //  that were written after the last checkpoint apart from stale ones.
+    uint64_t wseq{ 0 };
+
+    // Array with information about every erase block. Like the erase
+    //  counts and the inode map it is kept in native byte order and only
+    //  converted when it is read at mount time or written back to disk.
+    std::vector<eraseblock_usage> eb_usage;
 
-    // Array with information about every erase block
-    std::vector<eraseblock> eb_usage;
+    // Array with the erase count of every erase block. An erase block
+    //  counts as erased every time it is opened for writing after having
+    //  been empty. It resides right behind the erase block usage array
+    //  inside the first erase block and is used for wear leveling.
+    std::vector<uint32_t> eb_erase_cnt;
 
     // This array contains the cluster ids where the specified inode is
     //  located on disk. It is indexed using the inode number (ino->i_no).
     //  It is read at mount time and is occasionally written back to disk.
     //  It resides inside the first erase block of the file system and NOT
-    //  inside the log.
-    std::vector<be32_t> ino_map;
+    //  inside the log. It is changed through checkpoint_set_ino_map() only,
+    //  which keeps track of the changed pages.
+    std::vector<cl_id_t> ino_map;
+
+    // Erase blocks of erase block indirect and extent files that were
+    //  replaced by a completely rewritten copy, and inode erase blocks
+    //  that were relocated by the GC. The inode or inode map on the medium
+    //  still points to them until the dirty inodes are written back, so
+    //  they are only set free afterwards.
+    std::vector<eb_id_t> replaced_eraseblks;
 
     // Head of a linked list that contains all the erase block summary
     //  to all currently open cluster indirect erase blocks. When a
@@ -198,31 +345,70 @@ struct fs_context
     //  used to determine which of those inodes are dirty.
     ffsp::inode_cache* inode_cache{ nullptr };
 
+    // Dentries of the directories, kept in memory only if all inodes
+    //  were preloaded at mount time (see preload_inodes()).
+    ffsp::dir_index* dir_index{ nullptr };
+
     // A buffer that represents each (possible) inode with one bit. Its
     //  status indicates whether the (cached) inode was changed (is dirty)
     //  but was not yet written back to the medium.
     uint32_t* ino_status_map{ nullptr };
 
-    /* TODO: replace this with a real data structure and provide
-     * accessory functions for manipulation */
-    // A buffer where each element represents a cluster in the file system.
-    //  It contains information about how many valid inodes are present
-    //  inside the concerned cluster.The array is indexed using the
-    //  cluster id resp. cluster_offset / cluster_size.
-    std::vector<int> cl_occupancy;
+    // Contains information about how many valid inodes are present
+    //  inside every cluster of the file system. Counters are only kept
+    //  for erase blocks that contain clusters with valid inodes.
+    ffsp::cl_occupancy* cl_occupancy{ nullptr };
 
     // A variable that counting the number of dirty inodes cached in
     //  main memory. The dirty inodes should be written back to disk if
     //  this counter reaches fs.ninoopen which is set at mkfs time.
     unsigned int dirty_ino_cnt{ 0 };
 
+    // Number of erase blocks that were erased since static wear leveling
+    //  last compared the erase counts.
+    uint32_t leveling_erase_cnt{ 0 };
+
+    // The numbers of the dirty inodes, separated into dentries and files
+    //  because both are written into different erase block types. They
+    //  spare flushing from scanning the whole inode cache.
+    std::set<ino_t> dirty_dentries;
+    std::set<ino_t> dirty_files;
+
+    // Time the oldest of the currently dirty inodes was changed. Dirty
+    //  inodes are written back at the latest a commit interval later.
+    std::chrono::steady_clock::time_point dirty_since;
+    std::chrono::milliseconds commit_interval{ FFSP_COMMIT_INTERVAL };
+
+    // Incremented every time the dirty inodes were written back and the
+    //  checkpoint was committed. fsync() reads it before waiting for the
+    //  file system lock to find out if another commit already covered it.
+    std::atomic<uint64_t> commit_gen{ 0 };
+
     ffsp::gcinfo* gcinfo{ nullptr };
 
-    // Static helper buffer, one erase block large.
-    // It is used for moving around clusters or erase blocks.
+    // Tracks which parts of the meta data inside the first erase block
+    //  (erase block usage, erase counts and inode map) changed since
+    //  they were last written and when to write them back.
+    ffsp::checkpoint* checkpoint{ nullptr };
+
+    // Pool of temporary cluster and erase block sized buffers.
+    // They are used for moving around clusters or erase blocks.
     // For example when expanding inode embedded data to cluster indirect
     //  or from cluster indirect to erase block indirect.
-    char* buf{ nullptr };
+    ffsp::scratch_pool* scratch{ nullptr };
+
+    // Data of regular files that was written but not yet placed on the
+    //  medium (delayed allocation). It is written back when the file is
+    //  released, the file system is unmounted or the cache is full, and
+    //  always before the dirty inodes are committed: a durable file size
+    //  never covers data that only existed in memory.
+    //  Only set if delayed allocation was enabled at mount time.
+    ffsp::delalloc_cache* delalloc{ nullptr };
+
+    // Background thread that writes back the dirty inodes once the commit
+    //  interval expired while no operation changes the file system.
+    //  Only set if it was started at mount time.
+    ffsp::committer* committer{ nullptr };
 };
 
 } // namespace ffsp
@@ -20,14 +20,20 @@
 
 #include "gc.hpp"
 #include "bitops.hpp"
+#include "checkpoint.hpp"
 #include "debug.hpp"
 #include "eraseblk.hpp"
 #include "inode.hpp"
 #include "inode_group.hpp"
 #include "io_raw.hpp"
 #include "log.hpp"
+#include "occupancy.hpp"
+#include "scratch.hpp"
 #include "summary.hpp"
 
+#include <algorithm>
+
+#include <cerrno>
 #include <cstdlib>
 #include <cstring>
 
@@ -43,7 +49,7 @@ struct gcinfo
 
 gcinfo* gcinfo_init(const fs_context& fs)
 {
-    auto* info = new gcinfo[fs.neraseopen - 1];
+    auto* info = new gcinfo[fs.neraseopen - 1]();
 
     // FIXME: Too much hard coded crap in here!
 
@@ -92,6 +98,25 @@ gcinfo* gcinfo_init(const fs_context& fs)
         info[3].write_cnt = 0;
     }
 
+    // Open erase blocks for inodes relocated by the GC.
+    //  See get_cold_eraseblk_type().
+    if (fs.neraseopen == 6)
+    {
+        info[4].eb_type = eraseblock_type::dentry_inode_cold;
+        info[4].write_time = 0;
+        info[4].write_cnt = 0;
+    }
+    else if (fs.neraseopen >= 7)
+    {
+        info[4].eb_type = eraseblock_type::dentry_inode_cold;
+        info[4].write_time = 0;
+        info[4].write_cnt = 0;
+
+        info[5].eb_type = eraseblock_type::file_inode_cold;
+        info[5].write_time = 0;
+        info[5].write_cnt = 0;
+    }
+
     return info;
 }
 
@@ -103,7 +128,7 @@ void gcinfo_uninit(gcinfo* info)
 static bool is_eb_collectable(const fs_context& fs, eb_id_t eb_id)
 {
     int cvalid = eb_get_cvalid(fs, eb_id);
-    int writeops = get_be16(fs.eb_usage[eb_id].e_writeops);
+    int writeops = fs.eb_usage[eb_id].e_writeops;
 
     int max_writeops = fs.erasesize / fs.clustersize;
     int max_cvalid = max_writeops;
@@ -234,93 +259,185 @@ static unsigned int find_collectable_eraseblk(fs_context& fs, eraseblock_type eb
 }
 
 /*
- * Appends valid inode clusters from the source erase block to the destination
- * ease block. Updates erase block usage and inode map accordingly.
+ * Appends the valid inode clusters of the source erase block to the open
+ * erase block of the given (cold) type. Updates erase block usage, inode map
+ * and cluster occupancy accordingly.
  * The function stops if either the source erase block does not contain
- * any more valid inodes, or if the destination erase block is full.
- * Returns the number of valid inode clusters inside the destination
- * erase block.
+ * any more valid inodes, or if no writable cluster could be found.
+ * Returns the number of relocated inode clusters or a negative error code.
  */
-static unsigned int move_inodes(fs_context& fs, unsigned int src_eb_id,
-                                unsigned int dest_eb_id, unsigned int dest_moved)
+static int move_inodes(fs_context& fs, eb_id_t src_eb_id, eraseblock_type dest_type)
 {
-    /* TODO: Error handling missing! */
+    uint32_t cl_per_eb = fs.erasesize / fs.clustersize;
+    int moved = 0;
+    scratch_buf cl_buf{ fs, fs.clustersize };
 
-    uint32_t max_cvalid = fs.erasesize / fs.clustersize;
-    for (uint32_t i = 0; i < max_cvalid; i++)
+    for (uint32_t i = 0; i < cl_per_eb; i++)
     {
-        uint64_t eb_off = src_eb_id * fs.erasesize;
-        uint64_t cl_off = eb_off + (i * fs.clustersize);
-        cl_id_t cl_id = static_cast<cl_id_t>(cl_off / fs.clustersize);
+        cl_id_t src_cl_id = src_eb_id * cl_per_eb + i;
 
-        std::vector<inode*> inodes;
-        int rc = read_inode_group(fs, cl_id, inodes);
-        if (!rc)
+        // Clusters without valid inodes were already accounted for
+        //  as invalid (e.g. all of their inodes are dirty and will be
+        //  written somewhere else anyway).
+        if (!cl_occupancy_get(*fs.cl_occupancy, src_cl_id))
             continue;
 
-        ssize_t read_rc = read_raw(*fs.io_ctx, fs.buf, fs.clustersize, cl_off);
-        if (!(read_rc < 0))
-            debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(read_rc));
+        // The cluster is read only once; it is unpacked to learn which
+        //  inodes it contains and then written to its new location.
+        ssize_t read_rc = read_raw(*fs.io_ctx, cl_buf.data(), fs.clustersize, uint64_t{ src_cl_id } * fs.clustersize);
+        if (read_rc < 0)
+            return static_cast<int>(read_rc);
+        debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(read_rc));
+        debug_update(fs, debug_metric::gc_read, static_cast<uint64_t>(read_rc));
+
+        std::vector<inode*> inodes;
+        unpack_inode_group(fs, src_cl_id, cl_buf.data(), inodes);
+        if (inodes.empty())
+            continue;
 
-        eb_off = dest_eb_id * fs.erasesize;
-        cl_off = eb_off + (dest_moved * fs.clustersize);
+        eb_id_t dest_eb_id;
+        cl_id_t dest_cl_id;
+        if (!find_writable_cluster(fs, dest_type, dest_eb_id, dest_cl_id))
+        {
+            for (const auto& inode : inodes)
+                delete_inode(inode);
+            log().error("ffsp::gc(): no writable cluster for relocated inodes");
+            return -ENOSPC;
+        }
 
-        ssize_t write_rc = write_raw(*fs.io_ctx, fs.buf, fs.clustersize, cl_off);
-        if (!(write_rc < 0))
+        // The checksums of the inodes depend on their cluster id.
+        stamp_inode_group(fs, dest_cl_id, cl_buf.data());
+        ssize_t write_rc = write_raw(*fs.io_ctx, cl_buf.data(), fs.clustersize, uint64_t{ dest_cl_id } * fs.clustersize);
+        if (write_rc < 0)
         {
-            debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(write_rc));
-            debug_update(fs, debug_metric::gc_write, fs.clustersize);
+            for (const auto& inode : inodes)
+                delete_inode(inode);
+            return static_cast<int>(write_rc);
         }
+        debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(write_rc));
+        debug_update(fs, debug_metric::gc_write, static_cast<uint64_t>(write_rc));
+
+        // ignore the last parameter - inode erase blocks do not have a summary.
+        commit_write_operation(fs, dest_type, dest_eb_id, put_be32(0));
 
-        cl_id = static_cast<uint32_t>(cl_off / fs.clustersize);
         for (const auto& inode : inodes)
         {
-            fs.ino_map[get_be32(inode->i_no)] = put_be32(cl_id);
+            checkpoint_set_ino_map(fs, get_be32(inode->i_no), dest_cl_id);
             delete_inode(inode);
         }
+        cl_occupancy_move(*fs.cl_occupancy, src_cl_id, dest_cl_id);
 
-        eb_inc_cvalid(fs, dest_eb_id);
         eb_dec_cvalid(fs, src_eb_id);
-
-        /* check if the "new" erase block is full already */
-        if (++dest_moved == max_cvalid)
-            break;
+        ++moved;
     }
-    return dest_moved;
+    return moved;
 }
 
 /*
- * Collects one inode erase block.
+ * Relocates all valid inode clusters of the given erase block into the
+ * (cold) erase block type the GC uses for surviving inodes. The erase block
+ * is freed by the commit at the end of gc(); until then the durable inode
+ * map still points into it.
+ * Returns the number of relocated inode clusters or a negative error code.
  */
-static void collect_inodes(fs_context& fs, eraseblock_type eb_type)
+static int relocate_inode_eraseblk(fs_context& fs, eb_id_t eb_id)
 {
-    /* TODO: Error handling missing! */
+    eraseblock_type eb_type = fs.eb_usage[eb_id].e_type;
+    eraseblock_type dest_type = get_cold_eraseblk_type(fs, eb_type);
 
-    uint32_t max_writeops = fs.erasesize / fs.clustersize;
-    uint32_t max_cvalid = max_writeops;
+    int rc = move_inodes(fs, eb_id, dest_type);
+    if (rc < 0)
+        return rc;
 
-    unsigned int moved_cl_cnt = 0;
-    unsigned int free_eb_id = find_empty_eraseblk(fs);
+    log().debug("ffsp::gc(): moved {} clusters from eb {} ({}) into {}", rc, eb_id, eb_type, dest_type);
 
-    do
+    // Valid clusters that were not relocated are still referenced. The
+    //  erase block must not be reused then.
+    if (eb_get_cvalid(fs, eb_id))
+    {
+        log().error("ffsp::gc(): eb {} still has {} valid clusters after relocation", eb_id, eb_get_cvalid(fs, eb_id));
+        return -EIO;
+    }
+    release_replaced_eraseblk(fs, eb_id);
+    return rc;
+}
+
+/*
+ * Collects inode erase blocks of the given type until about one erase block
+ * worth of valid inode clusters was relocated.
+ * Returns true if any inode cluster was relocated.
+ */
+static bool collect_inodes(fs_context& fs, eraseblock_type eb_type)
+{
+    uint32_t max_writeops = fs.erasesize / fs.clustersize;
+    uint32_t moved_cl_cnt = 0;
+    bool relocated = false;
+
+    while (moved_cl_cnt < max_writeops)
     {
         eb_id_t eb_id = find_collectable_eraseblk(fs, eb_type);
         if (eb_id == FFSP_INVALID_EB_ID)
             break;
 
-        moved_cl_cnt = move_inodes(fs, eb_id, free_eb_id, moved_cl_cnt);
-    } while (moved_cl_cnt != max_cvalid);
+        // Even a failed relocation may have changed the inode map.
+        relocated = true;
+        int rc = relocate_inode_eraseblk(fs, eb_id);
+        if (rc < 0)
+            break;
+        moved_cl_cnt += static_cast<uint32_t>(rc);
+    }
+    return relocated;
+}
 
-    /* still "0" if no collectable erase block was found */
-    if (moved_cl_cnt)
+/*
+ * Static wear leveling: Erase blocks holding data that never changes are
+ * never collected and therefore never erased, while the remaining erase
+ * blocks keep cycling. If the erase counts drift too far apart, relocate
+ * the least worn closed inode erase block so that it is returned to the
+ * pool of empty erase blocks.
+ * Returns true if an erase block was relocated.
+ */
+static bool level_wear(fs_context& fs)
+{
+    if (fs.leveling_erase_cnt < FFSP_WEAR_LEVEL_PERIOD)
+        return false;
+    fs.leveling_erase_cnt = 0;
+
+    uint32_t max_writeops = fs.erasesize / fs.clustersize;
+    uint32_t max_erase_cnt = 0;
+    eb_id_t victim_eb_id = FFSP_INVALID_EB_ID;
+
+    /* erase block id "0" is always reserved */
+    for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; eb_id++)
     {
-        /* tell gcinfo that we wrote an eb of a specific type */
-        unsigned int write_time = gcinfo_update_writetime(fs, eb_type);
+        // The journal erase block cannot be relocated; ignore its wear.
+        if (fs.eb_usage[eb_id].e_type == eraseblock_type::super)
+            continue;
 
-        fs.eb_usage[free_eb_id].e_type = eb_type;
-        fs.eb_usage[free_eb_id].e_lastwrite = put_be16(write_time);
-        fs.eb_usage[free_eb_id].e_writeops = put_be16(max_writeops);
+        uint32_t erase_cnt = eb_get_erase_cnt(fs, eb_id);
+        max_erase_cnt = std::max(max_erase_cnt, erase_cnt);
+
+        if (   !is_inode_eraseblk_type(fs.eb_usage[eb_id].e_type)
+            || (fs.eb_usage[eb_id].e_writeops != max_writeops)
+            || !eb_get_cvalid(fs, eb_id))
+            continue;
+
+        if (   (victim_eb_id == FFSP_INVALID_EB_ID)
+            || (erase_cnt < eb_get_erase_cnt(fs, victim_eb_id)))
+            victim_eb_id = eb_id;
     }
+
+    if (victim_eb_id == FFSP_INVALID_EB_ID)
+        return false;
+
+    uint32_t min_erase_cnt = eb_get_erase_cnt(fs, victim_eb_id);
+    if ((max_erase_cnt - min_erase_cnt) <= FFSP_WEAR_LEVEL_THRESHOLD)
+        return false;
+
+    log().debug("ffsp::gc(): leveling wear of eb {} (erase count {}, max {})",
+                victim_eb_id, min_erase_cnt, max_erase_cnt);
+    relocate_inode_eraseblk(fs, victim_eb_id);
+    return true;
 }
 
 #if 0 // see ffsp_gc()
@@ -400,8 +517,8 @@ static void collect_clin(ffsp_fs& fs, ffsp_eraseblk_type eb_type)
         unsigned int write_time = ffsp_gcinfo_update_writetime(fs, eb_type);
 
         fs.eb_usage[free_eb_id].e_type = eb_type;
-        fs.eb_usage[free_eb_id].e_lastwrite = put_be16(write_time);
-        fs.eb_usage[free_eb_id].e_writeops = put_be16(max_writeops);
+        fs.eb_usage[free_eb_id].e_lastwrite = write_time;
+        fs.eb_usage[free_eb_id].e_writeops = max_writeops;
     }
     ffsp_delete_summary(eb_summary);
 }
@@ -429,16 +546,18 @@ void gc(fs_context& fs)
         return;
     }
 
-    // FIXME: ebin data is never freed!
+    // Erase blocks of ebin and extent files are not collected here. They
+    //  only hold data of a single inode and are freed by flush_inodes()
+    //  once the inode that replaced them was committed.
 
+    bool relocated = false;
     eraseblock_type eb_type;
     while ((eb_type = find_collectable_eb_type(fs)) != eraseblock_type::invalid)
     {
-        if (eb_type == eraseblock_type::dentry_inode ||
-            eb_type == eraseblock_type::file_inode)
+        if (is_inode_eraseblk_type(eb_type))
         {
             log().debug("ffsp::gc(): collecting eb_type {}", eb_type);
-            collect_inodes(fs, eb_type);
+            relocated |= collect_inodes(fs, eb_type);
         }
         else if (summary_required(fs, eb_type))
         {
@@ -459,6 +578,17 @@ void gc(fs_context& fs)
         gcinfo* info = get_gcinfo(fs, eb_type);
         info->write_cnt = 0;
     }
+
+    if (emtpy_eraseblk_count(fs) > fs.nerasereserve)
+        relocated |= level_wear(fs);
+
+    // The durable inode map must not point into the relocated erase
+    //  blocks anymore before they can be reused. That includes the old
+    //  clusters of dirty inodes, which move_inodes() skipped. A single
+    //  commit covers all erase blocks relocated during this pass and
+    //  frees them afterwards.
+    if (relocated && (flush_inodes(fs, true) < 0))
+        log().error("ffsp::gc(): committing the relocated erase blocks failed");
     free_empty_eraseblks(fs);
 }
 
@@ -26,6 +26,14 @@
 namespace ffsp
 {
 
+// Static wear leveling kicks in if the erase counts of the most and the
+//  least worn erase blocks differ by more than this value.
+constexpr uint32_t FFSP_WEAR_LEVEL_THRESHOLD{ 16 };
+
+// Static wear leveling looks at the erase counts only once this many erase
+//  blocks were erased and then relocates at most one erase block.
+constexpr uint32_t FFSP_WEAR_LEVEL_PERIOD{ 64 };
+
 gcinfo* gcinfo_init(const fs_context& fs);
 void gcinfo_uninit(gcinfo* info);
 
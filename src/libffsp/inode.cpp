@@ -20,7 +20,12 @@
 
 #include "inode.hpp"
 #include "bitops.hpp"
+#include "checkpoint.hpp"
+#include "debug.hpp"
+#include "delalloc.hpp"
+#include "dir_index.hpp"
 #include "eraseblk.hpp"
+#include "extent.hpp"
 #include "ffsp.hpp"
 #include "gc.hpp"
 #include "inode_cache.hpp"
@@ -28,9 +33,15 @@
 #include "io.hpp"
 #include "io_raw.hpp"
 #include "log.hpp"
+#include "occupancy.hpp"
+#include "scratch.hpp"
 #include "utils.hpp"
 
+#include <chrono>
+#include <set>
+
 #include <cerrno>
+#include <cstddef>
 #include <cstdlib>
 #include <cstring>
 #include <sys/stat.h>
@@ -41,6 +52,7 @@
 #define S_ISDIR(mode) (((mode)&S_IFMT) == S_IFDIR)
 #endif
 extern "C" char* strndup(const char* s, size_t n);
+#define strtok_r strtok_s
 #endif
 
 namespace ffsp
@@ -73,6 +85,13 @@ void* inode_data(const inode& ino)
     return &const_cast<inode&>(ino) + 1;
 }
 
+/* Return the number of file bytes addressed by one pointer cluster of a
+ * double cluster indirect file. */
+uint64_t dclin_ptr_size(const fs_context& fs)
+{
+    return uint64_t{ fs.clustersize } / sizeof(be32_t) * fs.clustersize;
+}
+
 /* Return the size of an inode (with its data or indirect pointers) in bytes. */
 uint64_t get_inode_size(const fs_context& fs, const inode& ino)
 {
@@ -81,6 +100,8 @@ uint64_t get_inode_size(const fs_context& fs, const inode& ino)
      * - embedded: the file size
      * - cluster indirect: the size of valid cluster indirect pointers
      * - erase block indirect: the size of valid eb indirect pointers
+     * - extent: the size of the extent tree root
+     * - double cluster indirect: the size of valid pointer cluster ids
      */
 
     auto ino_size = sizeof(inode);
@@ -95,9 +116,32 @@ uint64_t get_inode_size(const fs_context& fs, const inode& ino)
         ino_size += (i_size - 1) / fs.clustersize * sizeof(be32_t) + sizeof(be32_t);
     else if (data_type == inode_data_type::ebin)
         ino_size += (i_size - 1) / fs.erasesize * sizeof(be32_t) + sizeof(be32_t);
+    else if (data_type == inode_data_type::extent)
+        ino_size += extent_root_size(ino);
+    else if (data_type == inode_data_type::dclin)
+        ino_size += (i_size - 1) / dclin_ptr_size(fs) * sizeof(be32_t) + sizeof(be32_t);
     return ino_size;
 }
 
+/*
+ * Return the checksum of an inode that is located at the given cluster id.
+ * It is seeded with the file system's random seed and the cluster id so that
+ * inodes inside file data (e.g. an image of another ffsp) never match.
+ */
+uint32_t get_inode_checksum(const fs_context& fs, cl_id_t cl_id, const inode& ino)
+{
+    const be32_t seed[] = { put_be32(fs.seed), put_be32(cl_id) };
+    const be32_t csum_zero = put_be32(0);
+    const auto* ino_buf = reinterpret_cast<const char*>(&ino);
+    const size_t csum_off = offsetof(inode, i_csum);
+    const size_t rest_off = csum_off + sizeof(csum_zero);
+
+    uint32_t hash = checksum(seed, sizeof(seed));
+    hash = checksum(ino_buf, csum_off, hash);
+    hash = checksum(&csum_zero, sizeof(csum_zero), hash);
+    return checksum(ino_buf + rest_off, get_inode_size(fs, ino) - rest_off, hash);
+}
+
 /* Check if a given inode is located at the given cluster id. */
 bool is_inode_valid(const fs_context& fs, cl_id_t cl_id, const inode& ino)
 {
@@ -108,7 +152,7 @@ bool is_inode_valid(const fs_context& fs, cl_id_t cl_id, const inode& ino)
      * contains points back to the inode's cluster id.
      */
     return ((ino_no < fs.nino) /* sanity check */
-            && (get_be32(fs.ino_map[ino_no]) == cl_id));
+            && (fs.ino_map[ino_no] == cl_id));
 }
 
 static void split_path(const char* path, char** parent, char** name)
@@ -123,10 +167,11 @@ static void split_path(const char* path, char** parent, char** name)
 
 static unsigned int find_free_inode_no(fs_context& fs)
 {
-    for (ino_t ino_no = 1; ino_no < fs.nino; ino_no++)
-        if (get_be32(fs.ino_map[ino_no]) == FFSP_FREE_CL_ID)
-            return ino_no;
-    return FFSP_INVALID_INO_NO;
+    // Inode number "0" is always invalid.
+    const size_t idx = find_u32(fs.ino_map.data() + 1, fs.nino - 1, FFSP_FREE_CL_ID);
+    if (idx == fs.nino - 1)
+        return FFSP_INVALID_INO_NO;
+    return static_cast<ino_t>(idx + 1);
 }
 
 static void mk_directory(inode& ino, ino_t parent_ino_no)
@@ -147,6 +192,13 @@ static void mk_directory(inode& ino, ino_t parent_ino_no)
     ino.i_nlink = put_be32(2);
 }
 
+// The dentries of a directory changed; drop the ones kept in memory.
+static void drop_dir_index(fs_context& fs, ino_t ino_no)
+{
+    if (fs.dir_index)
+        dir_index_remove(*fs.dir_index, ino_no);
+}
+
 static int add_dentry(fs_context& fs, const char* path, ino_t ino_no,
                       mode_t mode, ino_t* parent_ino_no)
 {
@@ -173,6 +225,7 @@ static int add_dentry(fs_context& fs, const char* path, ino_t ino_no,
 
     // Append the new dentry at the inode's data.
     rc = write(fs, *parent_ino, (const char*)(&dent), sizeof(dent), get_be64(parent_ino->i_size));
+    drop_dir_index(fs, get_be32(parent_ino->i_no));
     if (rc < 0)
         return rc;
 
@@ -222,6 +275,7 @@ static int remove_dentry(fs_context& fs, const char* path, ino_t ino_no, mode_t
 
             // TODO: write only affected cluster.
             write(fs, *ino, (char*)dentries.data(), dentries.size() * sizeof(dentry), 0);
+            drop_dir_index(fs, get_be32(ino->i_no));
             break;
         }
     }
@@ -242,6 +296,10 @@ static int remove_dentry(fs_context& fs, const char* path, ino_t ino_no, mode_t
 
 static int find_dentry(fs_context& fs, const inode& ino, const char* name, dentry& out_dent)
 {
+    // Indexed directories are searched in place.
+    if (fs.dir_index && dir_index_find(*fs.dir_index, get_be32(ino.i_no), name, out_dent))
+        return (get_be32(out_dent.ino) == FFSP_INVALID_INO_NO) ? -1 : 0;
+
     // Number of potential ffsp_dentry elements. The exact number is not
     //  tracked. Return value of < 0 indicates an error.
     std::vector<dentry> dentries;
@@ -296,7 +354,7 @@ int lookup_no(fs_context& fs, inode** ino, ino_t ino_no)
     /* The requested inode is not present inside the inode list.
      * Read it from disk and add it to the inode list. */
 
-    cl_id_t cl_id = get_be32(fs.ino_map[ino_no]);
+    cl_id_t cl_id = fs.ino_map[ino_no];
     std::vector<inode*> inodes;
     int rc = read_inode_group(fs, cl_id, inodes);
     if (rc < 0)
@@ -306,7 +364,13 @@ int lookup_no(fs_context& fs, inode** ino, ino_t ino_no)
         return -ENOENT; // no inodes in the given cluster
 
     for (const auto& inode : inodes)
-        inode_cache_insert(*fs.inode_cache, inode);
+    {
+        // Inodes of the group may be cached already, possibly with
+        //  changes that are not written yet, or a concurrent lookup
+        //  inserted them first. The cached instance always wins.
+        if (inode_cache_insert(*fs.inode_cache, inode) != inode)
+            delete_inode(inode);
+    }
 
     /* the requested inode should now be present inside the inode cache */
     *ino = inode_cache_find(*fs.inode_cache, ino_no);
@@ -318,10 +382,12 @@ int lookup(fs_context& fs, inode** ino, const char* path)
     inode* dir_ino;
     lookup_no(fs, &dir_ino, 1);
 
+    // Lookups may run concurrently; strtok() is not reentrant.
     char* path_mod = strndup(path, FFSP_NAME_MAX + 1);
+    char* saveptr = nullptr;
     for (char* p = path_mod;; p = nullptr)
     {
-        const char* token = strtok(p, "/");
+        const char* token = strtok_r(p, "/", &saveptr);
         if (!token)
             break;
 
@@ -361,7 +427,16 @@ int lookup(fs_context& fs, inode** ino, const char* path)
 
 static bool should_write_inodes(const fs_context& fs)
 {
-    return fs.dirty_ino_cnt >= fs.ninoopen;
+    if (fs.dirty_ino_cnt >= fs.ninoopen)
+        return true;
+
+    // Replaced erase blocks stay allocated until the inodes pointing to
+    //  them are written back, so they must not pile up either.
+    if (fs.replaced_eraseblks.size() >= fs.nerasewrites)
+        return true;
+
+    return (fs.dirty_ino_cnt > 0)
+        && (std::chrono::steady_clock::now() - fs.dirty_since >= fs.commit_interval);
 }
 
 /* Check if a cached inode is makred as being dirty. */
@@ -370,22 +445,16 @@ static bool is_inode_dirty(const fs_context& fs, const inode& ino)
     return test_bit(fs.ino_status_map, get_be32(ino.i_no));
 }
 
-/*
- * Search for dirty inodes inside the inode cache and put a pointer to them
- * into the corresponding output buffer. Return the amount of inodes found.
- */
+/* Return the cached dirty dentry or file inodes in inode number order. */
 static std::vector<inode*> get_dirty_inodes(const fs_context& fs, bool dentries)
 {
-    return inode_cache_get_if(*fs.inode_cache, [&](const inode& ino) {
-        if (is_inode_dirty(fs, ino))
-        {
-            if (dentries && S_ISDIR(get_be32(ino.i_mode)))
-                return true;
-            else if (!dentries && !S_ISDIR(get_be32(ino.i_mode)))
-                return true;
-        }
-        return false;
-    });
+    const std::set<ino_t>& dirty = dentries ? fs.dirty_dentries : fs.dirty_files;
+
+    std::vector<inode*> inodes;
+    inodes.reserve(dirty.size());
+    for (ino_t ino_no : dirty)
+        inodes.push_back(inode_cache_find(*fs.inode_cache, ino_no));
+    return inodes;
 }
 
 int flush_inodes(fs_context& fs, bool force)
@@ -393,9 +462,22 @@ int flush_inodes(fs_context& fs, bool force)
     if (!force && !should_write_inodes(fs))
         return 0;
 
+    /* a committed file size must never cover delayed data that only
+     * exists in memory; place it before the inodes are written */
+    int rc = 0;
+    if (fs.delalloc)
+    {
+        for (const auto& ino : get_dirty_inodes(fs, false))
+        {
+            rc = write_back(fs, *ino);
+            if (rc < 0)
+                return rc;
+        }
+    }
+
     /* process dirty dentry inodes */
     auto inodes = get_dirty_inodes(fs, true);
-    int rc = write_inodes(fs, inodes);
+    rc = write_inodes(fs, inodes);
 
     if (rc == 0)
     {
@@ -404,9 +486,39 @@ int flush_inodes(fs_context& fs, bool force)
         rc = write_inodes(fs, inodes);
     }
 
+    /* the inode map is consistent again; make it durable */
+    if (rc == 0)
+        rc = checkpoint_commit(fs);
+
+    /* no inode on the medium points to replaced erase blocks any more */
+    if (rc == 0)
+    {
+        free_replaced_eraseblks(fs);
+        fs.commit_gen++;
+    }
+
     return rc;
 }
 
+int sync_inode(fs_context& fs, inode& ino, uint64_t commit_gen)
+{
+    /* delayed data has to be placed first; that dirties the inode */
+    int rc = write_back(fs, ino);
+    if (rc < 0)
+        return rc;
+
+    /*
+     * Group commit: a commit that finished while the caller was waiting
+     * for the file system lock wrote back all inodes that were dirty at
+     * that time. If this inode was not changed again since then there is
+     * nothing left to do.
+     */
+    if ((fs.commit_gen != commit_gen) && !is_inode_dirty(fs, ino))
+        return 0;
+
+    return flush_inodes(fs, true);
+}
+
 int release_inodes(fs_context& fs)
 {
     /* write all dirty inodes to disk */
@@ -451,13 +563,16 @@ int create(fs_context& fs, const char* path, mode_t mode, uid_t uid, gid_t gid,
 
     // Handle creation of a directory.
     if (S_ISDIR(mode))
+    {
+        drop_dir_index(fs, ino_no);
         mk_directory(*ino, parent_ino_no);
+    }
 
     // We have to occupy an inode_no inside the inomap. Otherwise it is still
     // marked as 'free' and there's no control over the max supported amount of
     // inodes in the file system. The inomap is updated with the inode's cluster
     // id when the inode is actually written.
-    fs.ino_map[ino_no] = put_be32(FFSP_RESERVED_CL_ID);
+    checkpoint_set_ino_map(fs, ino_no, FFSP_RESERVED_CL_ID);
 
     inode_cache_insert(*fs.inode_cache, ino);
     mark_dirty(fs, *ino);
@@ -553,16 +668,15 @@ int unlink(fs_context& fs, const char* path)
          * It can now be removed from the file system. */
 
         /* decrement the number of valid inodes inside the old inode's
-         * cluster (in case it really had one). */
-        cl_id_t cl_id = get_be32(fs.ino_map[ino_no]);
-        if (cl_id != FFSP_RESERVED_CL_ID)
+         * cluster (in case it really had one). dirty inodes were
+         * already accounted for by mark_dirty(). */
+        cl_id_t cl_id = fs.ino_map[ino_no];
+        if (cl_id != FFSP_RESERVED_CL_ID && !is_inode_dirty(fs, *ino))
         {
-            fs.cl_occupancy[cl_id]--;
-
             /* also decrement the number of valid inode clusters
              * inside the affected erase block in case the cluster
              * does not contain any more valid inodes at all. */
-            if (!fs.cl_occupancy[cl_id])
+            if (!cl_occupancy_dec(*fs.cl_occupancy, cl_id))
             {
                 eb_id_t eb_id = cl_id * fs.clustersize / fs.erasesize;
                 eb_dec_cvalid(fs, eb_id);
@@ -570,15 +684,24 @@ int unlink(fs_context& fs, const char* path)
         }
 
         /* set the old file's inode number to 'free' */
-        fs.ino_map[ino_no] = put_be32(FFSP_FREE_CL_ID);
+        checkpoint_set_ino_map(fs, ino_no, FFSP_FREE_CL_ID);
+
+        /* delayed data of the file never has to reach the medium */
+        if (fs.delalloc)
+            delalloc_take(*fs.delalloc, ino_no);
 
         uint64_t file_size = get_be64(ino->i_size);
         inode_data_type data_type = static_cast<inode_data_type>(get_be32(ino->i_flags) & 0xff);
 
         // Release indirect data if needed.
-        if (data_type != inode_data_type::emb && file_size)
+        if (data_type == inode_data_type::extent)
         {
-            int ind_size;
+            if (extent_release(fs, *ino) < 0)
+                log().error("ffsp_unlink(): Failed to release extents");
+        }
+        else if (data_type != inode_data_type::emb && file_size)
+        {
+            uint64_t ind_size;
             inode_data_type ind_type;
             if (data_type == inode_data_type::clin)
             {
@@ -590,12 +713,17 @@ int unlink(fs_context& fs, const char* path)
                 ind_type = inode_data_type::ebin;
                 ind_size = fs.erasesize;
             }
+            else if (data_type == inode_data_type::dclin)
+            {
+                ind_type = inode_data_type::dclin;
+                ind_size = dclin_ptr_size(fs);
+            }
             else
             {
                 log().error("ffsp_unlink(): Invalid inode flags");
                 return -1;
             }
-            int ind_cnt = ((file_size - 1) / ind_size) + 1;
+            int ind_cnt = static_cast<int>(((file_size - 1) / ind_size) + 1);
             const auto* ind_ptr = static_cast<const be32_t*>(inode_data(*ino));
             invalidate_ind_ptr(fs, ind_ptr, ind_cnt, ind_type);
         }
@@ -632,22 +760,22 @@ int rmdir(fs_context& fs, const char* path)
     rc = remove_dentry(fs, path, ino_no, mode);
     if (rc < 0)
         return rc;
+    drop_dir_index(fs, ino_no);
 
     // From this point on "path" cannot be found inside any directory
     //  but its inode and potential data clusters/erase blocks still occupy
     //  memory on the drive.
 
     /* decrement the number of valid inodes inside the old inode's
-     * cluster (in case it really had one). */
-    cl_id_t cl_id = get_be32(fs.ino_map[ino_no]);
-    if (cl_id != FFSP_RESERVED_CL_ID)
+     * cluster (in case it really had one). dirty inodes were
+     * already accounted for by mark_dirty(). */
+    cl_id_t cl_id = fs.ino_map[ino_no];
+    if (cl_id != FFSP_RESERVED_CL_ID && !is_inode_dirty(fs, *ino))
     {
-        fs.cl_occupancy[cl_id]--;
-
         /* also decrement the number of valid inode clusters
          * inside the affected erase block in case the cluster
          * does not contain any more valid inodes at all. */
-        if (!fs.cl_occupancy[cl_id])
+        if (!cl_occupancy_dec(*fs.cl_occupancy, cl_id))
         {
             eb_id_t eb_id = cl_id * fs.clustersize / fs.erasesize;
             eb_dec_cvalid(fs, eb_id);
@@ -655,15 +783,20 @@ int rmdir(fs_context& fs, const char* path)
     }
 
     /* set the old file's inode number to 'free' */
-    fs.ino_map[ino_no] = put_be32(FFSP_FREE_CL_ID);
+    checkpoint_set_ino_map(fs, ino_no, FFSP_FREE_CL_ID);
 
     uint64_t file_size = get_be64(ino->i_size);
     inode_data_type data_type = static_cast<inode_data_type>(get_be32(ino->i_flags) & 0xff);
 
     // Release indirect data if needed.
-    if (data_type != inode_data_type::emb)
+    if (data_type == inode_data_type::extent)
     {
-        int ind_size;
+        if (extent_release(fs, *ino) < 0)
+            log().error("ffsp_rmdir(): Failed to release extents");
+    }
+    else if (data_type != inode_data_type::emb)
+    {
+        uint64_t ind_size;
         inode_data_type ind_type;
         if (data_type == inode_data_type::clin)
         {
@@ -675,12 +808,17 @@ int rmdir(fs_context& fs, const char* path)
             ind_type = inode_data_type::ebin;
             ind_size = fs.erasesize;
         }
+        else if (data_type == inode_data_type::dclin)
+        {
+            ind_type = inode_data_type::dclin;
+            ind_size = dclin_ptr_size(fs);
+        }
         else
         {
             log().error("ffsp_rmdir(): Invalid inode flags");
             return -1;
         }
-        int ind_cnt = ((file_size - 1) / ind_size) + 1;
+        int ind_cnt = static_cast<int>(((file_size - 1) / ind_size) + 1);
         const auto* ind_ptr = static_cast<const be32_t*>(inode_data(*ino));
         invalidate_ind_ptr(fs, ind_ptr, ind_cnt, ind_type);
     }
@@ -740,21 +878,24 @@ void mark_dirty(fs_context& fs, const inode& ino)
 
     ino_t ino_no = get_be32(ino.i_no);
     set_bit(fs.ino_status_map, ino_no);
-    fs.dirty_ino_cnt++;
+    if (S_ISDIR(get_be32(ino.i_mode)))
+        fs.dirty_dentries.insert(ino_no);
+    else
+        fs.dirty_files.insert(ino_no);
+    if (fs.dirty_ino_cnt++ == 0)
+        fs.dirty_since = std::chrono::steady_clock::now();
 
     log().debug("inode {} marked as dirty - dirty_ino_cnt={}", ino_no, fs.dirty_ino_cnt);
 
     /* decrement the number of valid inodes inside the old inode's
      * cluster (in case it really had one). */
-    cl_id_t cl_id = get_be32(fs.ino_map[ino_no]);
+    cl_id_t cl_id = fs.ino_map[ino_no];
     if (cl_id != FFSP_RESERVED_CL_ID)
     {
-        fs.cl_occupancy[cl_id]--;
-
         /* also decrement the number of valid inode clusters
          * inside the affected erase block in case the cluster does
          * not contain any more valid inodes at all. */
-        if (!fs.cl_occupancy[cl_id])
+        if (!cl_occupancy_dec(*fs.cl_occupancy, cl_id))
         {
             eb_id_t eb_id = cl_id * fs.clustersize / fs.erasesize;
             eb_dec_cvalid(fs, eb_id);
@@ -768,6 +909,10 @@ void reset_dirty(fs_context& fs, const inode& ino)
     {
         ino_t ino_no = get_be32(ino.i_no);
         clear_bit(fs.ino_status_map, ino_no);
+        if (S_ISDIR(get_be32(ino.i_mode)))
+            fs.dirty_dentries.erase(ino_no);
+        else
+            fs.dirty_files.erase(ino_no);
         fs.dirty_ino_cnt--;
         log().debug("inode {} marked as clean - dirty_ino_cnt={}", ino_no, fs.dirty_ino_cnt);
     }
@@ -775,6 +920,9 @@ void reset_dirty(fs_context& fs, const inode& ino)
 
 int read_dir(fs_context& fs, const inode& ino, std::vector<dentry>& dentries)
 {
+    if (fs.dir_index && dir_index_get(*fs.dir_index, get_be32(ino.i_no), dentries))
+        return 0;
+
     // Number of bytes till the end of the last valid dentry.
     uint64_t data_size = get_be64(ino.i_size);
 
@@ -784,6 +932,9 @@ int read_dir(fs_context& fs, const inode& ino, std::vector<dentry>& dentries)
     {
         return static_cast<int>(rc);
     }
+
+    if (fs.dir_index)
+        dir_index_insert(*fs.dir_index, get_be32(ino.i_no), dentries);
     return 0;
 }
 
@@ -803,14 +954,31 @@ void invalidate_ind_ptr(fs_context& fs, const be32_t* ind_ptr, int cnt, inode_da
             cl_id_t cl_id = ind_id;
             eb_id_t eb_id = cl_id * fs.clustersize / fs.erasesize;
             eb_dec_cvalid(fs, eb_id);
-            //	dec_be16(&fs.eb_usage[eb_id].e_cvalid);
+            //	--fs.eb_usage[eb_id].e_cvalid;
         }
         else if (ind_type == inode_data_type::ebin)
         {
             // The erase block type is the only field of importance in this case.
-            // Set the erase blocks usage information to "free" and we are done.
+            // It is set to "free" once the deletion was committed.
             eb_id_t eb_id = ind_id;
-            fs.eb_usage[eb_id].e_type = eraseblock_type::empty;
+            release_replaced_eraseblk(fs, eb_id);
+        }
+        else if (ind_type == inode_data_type::dclin)
+        {
+            // Invalidate the data clusters the pointer cluster points
+            //  to, then the pointer cluster itself.
+            scratch_buf ptr_buf{ fs, fs.clustersize };
+            ssize_t rc = read_raw(*fs.io_ctx, ptr_buf.data(), fs.clustersize, uint64_t{ ind_id } * fs.clustersize);
+            if (rc < 0)
+            {
+                log().error("Failed to read pointer cluster {}", ind_id);
+                continue;
+            }
+            debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+
+            invalidate_ind_ptr(fs, reinterpret_cast<const be32_t*>(ptr_buf.data()),
+                               fs.clustersize / sizeof(be32_t), inode_data_type::clin);
+            invalidate_ind_ptr(fs, &ind_ptr[i], 1, inode_data_type::clin);
         }
     }
 }
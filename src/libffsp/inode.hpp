@@ -38,12 +38,15 @@ inode* allocate_inode(const fs_context& fs);
 void delete_inode(inode* ino);
 void* inode_data(const inode& ino);
 uint64_t get_inode_size(const fs_context& fs, const inode& ino);
+uint64_t dclin_ptr_size(const fs_context& fs);
 bool is_inode_valid(const fs_context& fs, cl_id_t cl_id, const inode& ino);
+uint32_t get_inode_checksum(const fs_context& fs, cl_id_t cl_id, const inode& ino);
 //bool is_inode_data_type(const fs_context& fs, const inode* ino);
 
 int lookup_no(fs_context& fs, inode** ino, ino_t ino_no);
 int lookup(fs_context& fs, inode** ino, const char* path);
 int flush_inodes(fs_context& fs, bool force);
+int sync_inode(fs_context& fs, inode& ino, uint64_t commit_gen);
 int release_inodes(fs_context& fs);
 
 int create(fs_context& fs, const char* path, mode_t mode, uid_t uid, gid_t gid, dev_t device);
@@ -21,6 +21,7 @@
 #include "inode_cache.hpp"
 #include "log.hpp"
 
+#include <atomic>
 #include <vector>
 
 #include <cstddef>
@@ -28,13 +29,15 @@
 namespace ffsp
 {
 
+// Lookups insert into the cache while holding the file system lock in
+//  shared mode only. The slots are atomic to allow this.
 struct inode_cache
 {
     explicit inode_cache(size_t size)
-        : buf{ size, nullptr }
+        : buf(size)
     {
     }
-    std::vector<inode*> buf;
+    std::vector<std::atomic<inode*>> buf;
 };
 
 inode_cache* inode_cache_init(const fs_context& fs)
@@ -47,9 +50,16 @@ void inode_cache_uninit(inode_cache* cache)
     delete cache;
 }
 
-void inode_cache_insert(inode_cache& cache, inode* ino)
+/*
+ * Inserts the inode unless the cache already contains an inode with the same
+ * number. Returns the cached inode.
+ */
+inode* inode_cache_insert(inode_cache& cache, inode* ino)
 {
-    cache.buf[get_be32(ino->i_no)] = ino;
+    inode* cached = nullptr;
+    if (cache.buf[get_be32(ino->i_no)].compare_exchange_strong(cached, ino))
+        return ino;
+    return cached;
 }
 
 void inode_cache_remove(inode_cache& cache, inode* ino)
@@ -34,7 +34,7 @@ struct inode_cache;
 inode_cache* inode_cache_init(const fs_context& fs);
 void inode_cache_uninit(inode_cache* cache);
 
-void inode_cache_insert(inode_cache& cache, inode* ino);
+inode* inode_cache_insert(inode_cache& cache, inode* ino);
 void inode_cache_remove(inode_cache& cache, inode* ino);
 inode* inode_cache_find(const inode_cache& cache, ino_t ino_no);
 std::vector<inode*> inode_cache_get(const inode_cache& cache);
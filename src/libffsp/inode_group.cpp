@@ -19,6 +19,7 @@
  */
 
 #include "inode_group.hpp"
+#include "checkpoint.hpp"
 #include "debug.hpp"
 #include "eraseblk.hpp"
 #include "ffsp.hpp"
@@ -26,6 +27,10 @@
 #include "inode_cache.hpp"
 #include "io_raw.hpp"
 #include "log.hpp"
+#include "occupancy.hpp"
+#include "scratch.hpp"
+
+#include <algorithm>
 
 #include <cstdlib>
 #include <cstring>
@@ -55,9 +60,11 @@ static void group_inodes(const fs_context& fs, const std::vector<inode*>& group,
 }
 
 /*
- * Search for inodes that would fit into one cluster and save a pointer to
- * those in 'group'. The grouped pointer are invalidated in 'inodes'.
- * Return the size of the inode group in bytes.
+ * Search for inodes that would fit into one cluster and move a pointer to
+ * those from 'inodes' into 'group'. The inodes are expected to be sorted
+ * by decreasing size: the large ones are placed first and the remaining
+ * space is filled up with whatever smaller inodes still fit (first fit
+ * decreasing). Return the size of the inode group in bytes.
  */
 static uint64_t get_inode_group(const fs_context& fs, std::vector<inode*>& inodes, std::vector<inode*>& group)
 {
@@ -65,29 +72,65 @@ static uint64_t get_inode_group(const fs_context& fs, std::vector<inode*>& inode
 
     for (auto& inode : inodes)
     {
-        if (!inode)
-            continue;
+        /* not even an inode without any data would fit anymore */
+        if (free_bytes < sizeof(ffsp::inode))
+            break;
 
         auto ino_size = get_inode_size(fs, *inode);
-
         if (ino_size > free_bytes)
-        {
-            /* no more free space inside the cluster for additional inodes */
-            break;
-        }
+            continue;
+
         /* move the current inode into the inode group */
         group.push_back(inode);
         inode = nullptr;
         free_bytes -= ino_size;
     }
+    inodes.erase(std::remove(inodes.begin(), inodes.end(), nullptr), inodes.end());
     return fs.clustersize - free_bytes;
 }
 
+void unpack_inode_group(const fs_context& fs, cl_id_t cl_id, const char* cl_buf, std::vector<inode*>& inodes)
+{
+    // The buffer is exactly one cluster large; never look at an inode
+    //  header that would reach beyond it.
+    const char* ino_buf = cl_buf;
+    while ((ino_buf - cl_buf + (ptrdiff_t)sizeof(inode)) <= (ptrdiff_t)fs.clustersize)
+    {
+        const inode* disk_ino = (const inode*)ino_buf;
+        auto ino_size = get_inode_size(fs, *disk_ino);
+
+        if (is_inode_valid(fs, cl_id, *disk_ino))
+        {
+            inode* ino = allocate_inode(fs);
+            memcpy(ino, ino_buf, ino_size);
+            inodes.push_back(ino);
+        }
+        ino_buf += ino_size;
+    }
+}
+
+void stamp_inode_group(const fs_context& fs, cl_id_t cl_id, char* cl_buf)
+{
+    uint64_t offset = 0;
+    while ((offset + sizeof(inode)) <= fs.clustersize)
+    {
+        auto* ino = reinterpret_cast<inode*>(cl_buf + offset);
+
+        // The unused rest of an inode cluster is zeroed.
+        if (get_be32(ino->i_no) == FFSP_INVALID_INO_NO)
+            break;
+
+        ino->i_csum = put_be32(get_inode_checksum(fs, cl_id, *ino));
+        offset += get_inode_size(fs, *ino);
+    }
+}
+
 int read_inode_group(fs_context& fs, cl_id_t cl_id, std::vector<inode*>& inodes)
 {
     uint64_t cl_offset = cl_id * fs.clustersize;
+    scratch_buf cl_buf{ fs, fs.clustersize };
 
-    ssize_t rc = read_raw(*fs.io_ctx, fs.buf, fs.clustersize, cl_offset);
+    ssize_t rc = read_raw(*fs.io_ctx, cl_buf.data(), fs.clustersize, cl_offset);
     if (rc < 0)
         return static_cast<int>(rc);
     debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
@@ -96,20 +139,7 @@ int read_inode_group(fs_context& fs, cl_id_t cl_id, std::vector<inode*>& inodes)
     // Number of inodes that can fit into one cluster
     inodes.reserve(fs.clustersize / sizeof(inode));
 
-    char* ino_buf = fs.buf;
-    while ((ino_buf - fs.buf) < (ptrdiff_t)fs.clustersize)
-    {
-        inode* ino = (inode*)ino_buf;
-        auto ino_size = get_inode_size(fs, *ino);
-
-        if (is_inode_valid(fs, cl_id, *ino))
-        {
-            ino = allocate_inode(fs);
-            memcpy(ino, ino_buf, ino_size);
-            inodes.push_back(ino);
-        }
-        ino_buf += ino_size;
-    }
+    unpack_inode_group(fs, cl_id, cl_buf.data(), inodes);
     return 0;
 }
 
@@ -123,10 +153,15 @@ int write_inodes(fs_context& fs, const std::vector<inode*>& inodes)
     bool for_dentry = S_ISDIR(get_be32(inodes[0]->i_mode));
 
     std::vector<inode*> inodes_cpy{inodes};
+    std::stable_sort(inodes_cpy.begin(), inodes_cpy.end(), [&](const inode* lhs, const inode* rhs) {
+        return get_inode_size(fs, *lhs) > get_inode_size(fs, *rhs);
+    });
 
     std::vector<inode*> group;
     group.reserve(inodes.size());
 
+    scratch_buf cl_buf{ fs, fs.clustersize };
+
     while (true)
     {
         group.clear();
@@ -147,8 +182,15 @@ int write_inodes(fs_context& fs, const std::vector<inode*>& inodes)
         }
         uint64_t offset = cl_id * fs.clustersize;
 
-        group_inodes(fs, group, fs.buf);
-        ssize_t write_rc = write_raw(*fs.io_ctx, fs.buf, fs.clustersize, offset);
+        /* the write sequence lets mount find inodes that were written
+         * after the last checkpoint in case of a crash */
+        const be64_t wseq = put_be64(++fs.wseq);
+        for (const auto& inode : group)
+            inode->i_wseq = wseq;
+
+        group_inodes(fs, group, cl_buf.data());
+        stamp_inode_group(fs, cl_id, cl_buf.data());
+        ssize_t write_rc = write_raw(*fs.io_ctx, cl_buf.data(), fs.clustersize, offset);
         if (write_rc < 0)
             return static_cast<int>(write_rc);
         debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(write_rc));
@@ -163,8 +205,8 @@ int write_inodes(fs_context& fs, const std::vector<inode*>& inodes)
          * cluster, and unmark the written inodes */
         for (const auto& inode : group)
         {
-            fs.ino_map[get_be32(inode->i_no)] = put_be32(cl_id);
-            fs.cl_occupancy[cl_id]++;
+            checkpoint_set_ino_map(fs, get_be32(inode->i_no), cl_id);
+            cl_occupancy_inc(*fs.cl_occupancy, cl_id);
             reset_dirty(fs, *inode);
         }
     }
@@ -33,6 +33,17 @@ namespace ffsp
  */
 int read_inode_group(fs_context& fs, cl_id_t cl_id, std::vector<inode *>& inodes);
 
+/*
+ * Copy all valid inodes out of the already read cluster 'cl_buf'.
+ */
+void unpack_inode_group(const fs_context& fs, cl_id_t cl_id, const char* cl_buf, std::vector<inode*>& inodes);
+
+/*
+ * Set the checksum of all inodes inside the cluster buffer 'cl_buf' that is
+ * about to be written to the cluster 'cl_id'.
+ */
+void stamp_inode_group(const fs_context& fs, cl_id_t cl_id, char* cl_buf);
+
 /*
  * Group as many inodes as possible into one cluster, write the cluster to disk
  * and update all meta data. Continue until all inodes have been processed, no
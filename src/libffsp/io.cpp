@@ -19,13 +19,18 @@
  */
 
 #include "io.hpp"
+#include "checkpoint.hpp"
 #include "debug.hpp"
+#include "delalloc.hpp"
 #include "eraseblk.hpp"
+#include "extent.hpp"
 #include "ffsp.hpp"
 #include "gc.hpp"
 #include "inode.hpp"
+#include "inode_cache.hpp"
 #include "io_raw.hpp"
 #include "log.hpp"
+#include "scratch.hpp"
 #include "utils.hpp"
 
 #include <algorithm>
@@ -40,6 +45,9 @@
 #include <io.h>
 #define S_ISDIR(mode) (((mode)&S_IFMT) == S_IFDIR)
 #endif
+#ifndef S_ISREG
+#define S_ISREG(mode) (((mode)&S_IFMT) == S_IFREG)
+#endif
 #endif
 
 namespace ffsp
@@ -62,14 +70,6 @@ struct write_context
     const inode_data_type new_type;
 };
 
-static bool is_buf_empty(const char* buf, size_t size)
-{
-    for (size_t i = 0; i < size; ++i)
-        if (buf[i])
-            return false;
-    return true;
-}
-
 static uint64_t max_emb_size(const fs_context& fs)
 {
     return fs.clustersize - sizeof(inode);
@@ -89,6 +89,26 @@ static uint64_t max_ebin_size(const fs_context& fs)
     return (fs.clustersize - sizeof(inode)) / sizeof(be32_t) * fs.erasesize;
 }
 
+static uint64_t max_extent_size(const fs_context& fs)
+{
+    // Logical erase block numbers inside the extents are 32 bit wide.
+    return uint64_t{ UINT32_MAX } * fs.erasesize;
+}
+
+static uint64_t max_dclin_size(const fs_context& fs)
+{
+    // Number of possible pointers to pointer clusters times
+    //  the size of the data a pointer cluster points to.
+    return (fs.clustersize - sizeof(inode)) / sizeof(be32_t) * dclin_ptr_size(fs);
+}
+
+static uint64_t max_file_size(const fs_context& fs)
+{
+    if (fs.flags & FFSP_SUPER_DCLIN)
+        return max_dclin_size(fs);
+    return max_extent_size(fs);
+}
+
 static uint32_t ind_from_offset(uint64_t offset, uint64_t ind_size)
 {
     //	unsigned int cluster = cl_from_offset(fs, offset);
@@ -98,7 +118,9 @@ static uint32_t ind_from_offset(uint64_t offset, uint64_t ind_size)
 
 static uint64_t ind_size_from_size(fs_context& fs, uint64_t size)
 {
-    if (size > max_clin_size(fs))
+    if ((size > max_clin_size(fs)) && (fs.flags & FFSP_SUPER_DCLIN))
+        return fs.clustersize;
+    else if (size > max_clin_size(fs))
         return fs.erasesize;
     else if (size > max_emb_size(fs))
         return fs.clustersize;
@@ -108,7 +130,11 @@ static uint64_t ind_size_from_size(fs_context& fs, uint64_t size)
 
 static inode_data_type data_type_from_size(fs_context& fs, uint64_t size)
 {
-    if (size > max_clin_size(fs))
+    if ((size > max_clin_size(fs)) && (fs.flags & FFSP_SUPER_DCLIN))
+        return inode_data_type::dclin;
+    else if (size > max_ebin_size(fs))
+        return inode_data_type::extent;
+    else if (size > max_clin_size(fs))
         return inode_data_type::ebin;
     else if (size > max_emb_size(fs))
         return inode_data_type::clin;
@@ -116,9 +142,16 @@ static inode_data_type data_type_from_size(fs_context& fs, uint64_t size)
         return inode_data_type::emb;
 }
 
-static ssize_t write_ind(fs_context& fs, write_context& ctx, const char* buf, be32_t* ind_id)
+/*
+ * Write one indirect cluster or erase block. Only the 'data_size' bytes
+ * at 'data_off' inside of 'buf' may be non-zero; the rest of the buffer has
+ * to be zeroed by the caller. This way the check for a file hole does not
+ * have to look at the whole chunk.
+ */
+static ssize_t write_ind(fs_context& fs, write_context& ctx, const char* buf,
+                         uint64_t data_off, uint64_t data_size, be32_t* ind_id)
 {
-    if (is_buf_empty(buf, ctx.new_ind_size))
+    if (is_zero_buf(buf + data_off, data_size))
     {
         // Create a file hole because the current indirect chunk consists of zeros only.
         *ind_id = put_be32(0);
@@ -162,20 +195,19 @@ static ssize_t read_emb(fs_context& fs, const inode& ino, char* buf, uint64_t nb
     return static_cast<ssize_t>(nbyte);
 }
 
-static ssize_t read_ind(fs_context& fs, const inode& ino, char* buf,
-                        uint64_t nbyte, uint64_t offset, uint64_t ind_size)
+/*
+ * Read 'nbyte' bytes at 'offset' from the indirect clusters or erase blocks
+ * 'ind_ptr' points to. The caller makes sure not to read beyond the file.
+ */
+static ssize_t read_ind_ptr(fs_context& fs, const be32_t* ind_ptr, char* buf,
+                            uint64_t nbyte, uint64_t offset, uint64_t ind_size)
 {
-    /* indirect cluster ids containing data */
-    const auto* ind_ptr = static_cast<const be32_t*>(inode_data(ino));
-
     /* current cluster id from the embedded data */
     uint32_t ind_index = static_cast<uint32_t>(offset / ind_size);
 
     /* offset inside the first cluster to read from */
     uint64_t ind_offset = offset % ind_size;
 
-    /* never try to read more than there is available */
-    nbyte = std::min(nbyte, get_be64(ino.i_size) - offset);
     uint64_t bytes_left = nbyte;
 
     while (bytes_left)
@@ -188,6 +220,11 @@ static ssize_t read_ind(fs_context& fs, const inode& ino, char* buf,
             /* we got a file hole */
             memset(buf, 0, ind_left);
         }
+        else if ((ind_size == fs.erasesize) && eb_is_unwritten(fs, get_be32(ind_ptr[ind_index])))
+        {
+            /* preallocated erase blocks read like file holes */
+            memset(buf, 0, ind_left);
+        }
         else
         {
             uint64_t cl_off = get_be32(ind_ptr[ind_index]) * ind_size + ind_offset;
@@ -205,9 +242,20 @@ static ssize_t read_ind(fs_context& fs, const inode& ino, char* buf,
     return static_cast<ssize_t>(nbyte - bytes_left);
 }
 
+static ssize_t read_ind(fs_context& fs, const inode& ino, char* buf,
+                        uint64_t nbyte, uint64_t offset, uint64_t ind_size)
+{
+    /* indirect cluster ids containing data */
+    const auto* ind_ptr = static_cast<const be32_t*>(inode_data(ino));
+
+    /* never try to read more than there is available */
+    nbyte = std::min(nbyte, get_be64(ino.i_size) - offset);
+    return read_ind_ptr(fs, ind_ptr, buf, nbyte, offset, ind_size);
+}
+
 static ssize_t trunc_emb2ind(fs_context& fs, write_context& ctx, const char* ind_buf)
 {
-    ssize_t rc = write_ind(fs, ctx, ind_buf, &ctx.ind_ptr[0]);
+    ssize_t rc = write_ind(fs, ctx, ind_buf, 0, ctx.new_ind_size, &ctx.ind_ptr[0]);
     if (rc < 0)
         return rc;
 
@@ -217,7 +265,7 @@ static ssize_t trunc_emb2ind(fs_context& fs, write_context& ctx, const char* ind
     // Additional indirect blocks to be reserved for the rest of
     //  "ctx.new_size". Start with index 1 because indirect block
     //  0 already contains the old embedded data.
-    for (uint32_t i = 1; i < ind_last; ++i)
+    for (uint32_t i = 1; i <= ind_last; ++i)
         ctx.ind_ptr[i] = put_be32(0);
 
     // clear old data type flag and set the new data type flag
@@ -230,7 +278,9 @@ static ssize_t trunc_emb2ind(fs_context& fs, write_context& ctx, const char* ind
 
 static ssize_t trunc_ind2emb(fs_context& fs, write_context& ctx)
 {
-    ssize_t rc = read_ind(fs, ctx.ino, fs.buf, ctx.new_size, 0, ctx.old_ind_size);
+    scratch_buf emb_buf{ fs, ctx.new_size };
+
+    ssize_t rc = read_ind(fs, ctx.ino, emb_buf.data(), ctx.new_size, 0, ctx.old_ind_size);
     if (rc < 0)
         return rc;
 
@@ -245,7 +295,7 @@ static ssize_t trunc_ind2emb(fs_context& fs, write_context& ctx)
     invalidate_ind_ptr(fs, ctx.ind_ptr, ind_last + 1, ctx.old_type);
 
     // Move the previously indirect data into the inode.
-    memcpy(ctx.ind_ptr, fs.buf, ctx.new_size);
+    memcpy(ctx.ind_ptr, emb_buf.data(), ctx.new_size);
 
     // clear old data type flag and set the new data type flag
     uint32_t flags = get_be32(ctx.ino.i_flags);
@@ -255,33 +305,57 @@ static ssize_t trunc_ind2emb(fs_context& fs, write_context& ctx)
     return 0;
 }
 
+/*
+ * Convert a cluster indirect file into an erase block indirect one. If the
+ * conversion is caused by a write request ('ctx.buf' is set) the part of the
+ * request that overlaps the converted data is merged into the new erase
+ * blocks right away instead of rewriting them afterwards. 'ctx' is advanced
+ * past the merged part.
+ */
 static ssize_t trunc_clin2ebin(fs_context& fs, write_context& ctx)
 {
     // Restore this backup on error.
-    be32_t* old_ptr = (be32_t*)malloc(max_emb_size(fs));
-    if (!old_ptr)
-    {
-        log().critical("malloc(max_emb_size) failed!");
-        abort();
-    }
+    scratch_buf old_ptr_buf{ fs, max_emb_size(fs) };
+    auto* old_ptr = reinterpret_cast<be32_t*>(old_ptr_buf.data());
     memcpy(old_ptr, ctx.ind_ptr, max_emb_size(fs));
     uint32_t old_ptr_cnt = ind_from_offset(ctx.old_size - 1, fs.clustersize) + 1;
 
+    scratch_buf eb_buf{ fs, fs.erasesize };
+
+    // Read the old file content between 'begin' and 'end' (both relative
+    //  to the file) into the current erase block image.
+    const auto read_old = [&fs, &ctx, &eb_buf](uint64_t eb_start, uint64_t begin, uint64_t end) -> ssize_t {
+        end = std::min(end, ctx.old_size);
+        if (begin >= end)
+            return 0;
+        return read_ind(fs, ctx.ino, eb_buf.data() + (begin - eb_start), end - begin, begin, fs.clustersize);
+    };
+
+    const uint64_t req_begin = ctx.offset;
+    const uint64_t req_end = ctx.offset + ctx.bytes_left;
+
     uint64_t written = 0;
     while (written < ctx.old_size)
     {
-        ssize_t rc = read_ind(fs, ctx.ino, fs.buf, fs.erasesize, written, fs.clustersize);
+        const uint64_t eb_end = written + fs.erasesize;
+
+        // Part of the write request that falls into the current erase block
+        const uint64_t merge_begin = std::min(std::max(req_begin, written), eb_end);
+        const uint64_t merge_end = std::max(std::min(req_end, eb_end), merge_begin);
+
+        // Only read the old data that is not going to be overwritten.
+        memset(eb_buf.data(), 0, fs.erasesize);
+        ssize_t rc = read_old(written, written, merge_begin);
+        if (!(rc < 0))
+            rc = read_old(written, merge_end, eb_end);
         if (rc < 0)
-        {
-            free(old_ptr);
             return rc;
-        }
 
-        // We did not read full erase block. Zero out the rest.
-        if (static_cast<uint64_t>(rc) < fs.erasesize)
-            memset(fs.buf + rc, 0, fs.erasesize - static_cast<uint64_t>(rc));
+        if (merge_begin < merge_end)
+            memcpy(eb_buf.data() + (merge_begin - written), ctx.buf + (merge_begin - req_begin), merge_end - merge_begin);
 
-        rc = write_ind(fs, ctx, fs.buf, &ctx.ind_ptr[written / fs.erasesize]);
+        const uint64_t data_size = std::max(std::min(eb_end, ctx.old_size), merge_end) - written;
+        rc = write_ind(fs, ctx, eb_buf.data(), 0, data_size, &ctx.ind_ptr[written / fs.erasesize]);
         if (rc < 0)
         {
             // Reset newly allocated erase block to empty
@@ -289,12 +363,12 @@ static ssize_t trunc_clin2ebin(fs_context& fs, write_context& ctx)
             invalidate_ind_ptr(fs, ctx.ind_ptr, ind_ptr_cnt, ctx.new_type);
             // Reset the inode's old indirect cluster pointers
             memcpy(ctx.ind_ptr, old_ptr, max_emb_size(fs));
-
-            free(old_ptr);
             return rc;
         }
 
-        written += static_cast<uint64_t>(rc);
+        // A file hole is not written at all (rc == 0) but still
+        //  takes up a whole erase block of the file.
+        written += fs.erasesize;
     }
     invalidate_ind_ptr(fs, old_ptr, old_ptr_cnt, ctx.old_type);
 
@@ -304,13 +378,21 @@ static ssize_t trunc_clin2ebin(fs_context& fs, write_context& ctx)
     for (uint32_t i = ind_first + 1; i <= ind_last; ++i)
         ctx.ind_ptr[i] = put_be32(0);
 
-    free(old_ptr);
-
     // clear old data type flag and set the new data type flag
     uint32_t flags = get_be32(ctx.ino.i_flags);
     flags = flags & ~static_cast<uint8_t>(inode_data_type::clin);
     flags = flags | static_cast<uint8_t>(inode_data_type::ebin);
     ctx.ino.i_flags = put_be32(flags);
+
+    // Skip the part of the write request that was merged into the
+    //  converted erase blocks.
+    if (req_begin < written)
+    {
+        const uint64_t merged = std::min(req_end, written) - req_begin;
+        ctx.buf += merged;
+        ctx.offset += merged;
+        ctx.bytes_left -= merged;
+    }
     return 0;
 }
 
@@ -383,8 +465,9 @@ static ssize_t write_emb(fs_context& fs, write_context& ctx)
 
     // Move all the inode embedded data into a temporary buffer because
     //  it will be moved into an indirect cluster or erase block later.
-    memcpy(fs.buf, ctx.ind_ptr, ctx.old_size);
-    memset(fs.buf + ctx.old_size, 0, ctx.new_ind_size - ctx.old_size);
+    scratch_buf ind_buf{ fs, ctx.new_ind_size };
+    memcpy(ind_buf.data(), ctx.ind_ptr, ctx.old_size);
+    memset(ind_buf.data() + ctx.old_size, 0, ctx.new_ind_size - ctx.old_size);
 
     // Calculate in which indirect cluster or erase block the write request
     //  starts (ind_index) and at which offset therein (ind_offset).
@@ -398,7 +481,7 @@ static ssize_t write_emb(fs_context& fs, write_context& ctx)
     {
         // Bytes to be written into the current indirect block.
         uint64_t ind_left = std::min(ctx.bytes_left, ctx.new_ind_size - ind_offset);
-        memcpy(fs.buf + ind_offset, ctx.buf, ind_left);
+        memcpy(ind_buf.data() + ind_offset, ctx.buf, ind_left);
         ctx.buf += ind_left;
         ctx.bytes_left -= ind_left;
         ind_offset = 0;
@@ -408,18 +491,19 @@ static ssize_t write_emb(fs_context& fs, write_context& ctx)
     // Move the data inside the inode (embedded data) into an indirect
     //  cluster or even erase block (based on how big it is going to get
     //  during the whole write request).
-    ssize_t rc = trunc_emb2ind(fs, ctx, fs.buf);
+    ssize_t rc = trunc_emb2ind(fs, ctx, ind_buf.data());
     if (rc < 0)
         return rc;
 
-    memset(fs.buf, 0, ind_offset);
+    memset(ind_buf.data(), 0, ind_offset);
     while (ctx.bytes_left)
     {
         // Bytes to be written into the current indirect block.
         uint64_t ind_left = std::min(ctx.bytes_left, ctx.new_ind_size - ind_offset);
-        memcpy(fs.buf + ind_offset, ctx.buf, ind_left);
+        memcpy(ind_buf.data() + ind_offset, ctx.buf, ind_left);
+        memset(ind_buf.data() + ind_offset + ind_left, 0, ctx.new_ind_size - ind_offset - ind_left);
 
-        rc = write_ind(fs, ctx, fs.buf, &ctx.ind_ptr[ind_index]);
+        rc = write_ind(fs, ctx, ind_buf.data(), ind_offset, ind_left, &ctx.ind_ptr[ind_index]);
         if (rc < 0)
             return rc;
 
@@ -441,6 +525,8 @@ static ssize_t write_clin(fs_context& fs, write_context& ctx)
     // The write-offset inside a cluster
     uint64_t ind_offset = ctx.offset % ctx.new_ind_size;
 
+    scratch_buf cl_buf{ fs, ctx.new_ind_size };
+
     while (ctx.bytes_left)
     {
         // Number of bytes to write into the current indirect cluster
@@ -457,19 +543,23 @@ static ssize_t write_clin(fs_context& fs, write_context& ctx)
             cl_off = get_be32(ctx.ind_ptr[ind_index]) * ctx.new_ind_size;
             overwrite = true;
 
-            ssize_t rc = read_raw(*fs.io_ctx, fs.buf, ctx.new_ind_size, cl_off);
+            ssize_t rc = read_raw(*fs.io_ctx, cl_buf.data(), ctx.new_ind_size, cl_off);
             if (rc < 0)
                 return rc;
             debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
         }
         else
         {
-            memset(fs.buf, 0, ind_offset);
+            memset(cl_buf.data(), 0, ind_offset);
+            memset(cl_buf.data() + ind_offset + ind_left, 0, ctx.new_ind_size - ind_offset - ind_left);
             overwrite = false;
         }
-        memcpy(fs.buf + ind_offset, ctx.buf, ind_left);
+        memcpy(cl_buf.data() + ind_offset, ctx.buf, ind_left);
 
-        ssize_t rc = write_ind(fs, ctx, fs.buf, &ctx.ind_ptr[ind_index]);
+        // Only the new data has to be checked for zeros unless the
+        //  rest of the cluster was read from the medium.
+        ssize_t rc = overwrite ? write_ind(fs, ctx, cl_buf.data(), 0, ctx.new_ind_size, &ctx.ind_ptr[ind_index])
+                               : write_ind(fs, ctx, cl_buf.data(), ind_offset, ind_left, &ctx.ind_ptr[ind_index]);
         if (rc < 0)
             return rc;
 
@@ -487,12 +577,77 @@ static ssize_t write_clin(fs_context& fs, write_context& ctx)
     return static_cast<ssize_t>(nbyte - ctx.bytes_left);
 }
 
-static ssize_t write_ebin(fs_context& fs, write_context& ctx)
+/*
+ * Write 'nbyte' bytes of the request into the existing erase block 'eb_id'
+ * starting at 'eb_offset'. Instead of allocating a fresh erase block the
+ * affected clusters are rewritten in place. All of them are written with
+ * one request; only the clusters the request does not cover completely
+ * have to be read first.
+ */
+static ssize_t write_eb_clusters(fs_context& fs, write_context& ctx, eb_id_t eb_id, uint64_t eb_offset, uint64_t nbyte)
 {
-    /*
-     * TODO: Split this function into smaller functions.
-     */
+    uint32_t cl_first = static_cast<uint32_t>(eb_offset / fs.clustersize);
+    uint32_t cl_last = static_cast<uint32_t>((eb_offset + nbyte - 1) / fs.clustersize);
+    uint64_t head = eb_offset % fs.clustersize;
+    uint64_t tail = (eb_offset + nbyte) % fs.clustersize;
+
+    uint64_t span = uint64_t{ cl_last - cl_first + 1 } * fs.clustersize;
+    uint64_t offset = uint64_t{ eb_id } * fs.erasesize + uint64_t{ cl_first } * fs.clustersize;
+    scratch_buf span_buf{ fs, span };
+
+    /* the write request is not cluster aligned. read the content of
+     * the first and last to-be-written-into cluster to initiate a
+     * cluster aligned write later. */
+    if (head)
+    {
+        ssize_t rc = read_raw(*fs.io_ctx, span_buf.data(), fs.clustersize, offset);
+        if (rc < 0)
+            return rc;
+        debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+    }
+    if (tail && (!head || (cl_last != cl_first)))
+    {
+        uint64_t tail_off = span - fs.clustersize;
+        ssize_t rc = read_raw(*fs.io_ctx, span_buf.data() + tail_off, fs.clustersize, offset + tail_off);
+        if (rc < 0)
+            return rc;
+        debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+    }
+    memcpy(span_buf.data() + head, ctx.buf, nbyte);
+
+    ssize_t rc = write_raw(*fs.io_ctx, span_buf.data(), span, offset);
+    if (rc < 0)
+        return rc;
+    debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
+
+    ctx.buf += nbyte;
+    return static_cast<ssize_t>(nbyte);
+}
+
+/*
+ * Write 'nbyte' bytes of the request into the preallocated erase block
+ * 'eb_id' starting at 'eb_offset'. Its stale content must not become part
+ * of the file, so the whole erase block is written.
+ */
+static ssize_t write_unwritten_eb(fs_context& fs, write_context& ctx, eb_id_t eb_id, uint64_t eb_offset, uint64_t nbyte)
+{
+    scratch_buf eb_buf{ fs, fs.erasesize };
+    memset(eb_buf.data(), 0, eb_offset);
+    memcpy(eb_buf.data() + eb_offset, ctx.buf, nbyte);
+    memset(eb_buf.data() + eb_offset + nbyte, 0, fs.erasesize - eb_offset - nbyte);
 
+    ssize_t rc = write_raw(*fs.io_ctx, eb_buf.data(), fs.erasesize, uint64_t{ eb_id } * fs.erasesize);
+    if (rc < 0)
+        return rc;
+    debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
+
+    eb_set_written(fs, eb_id);
+    ctx.buf += nbyte;
+    return static_cast<ssize_t>(nbyte);
+}
+
+static ssize_t write_ebin(fs_context& fs, write_context& ctx)
+{
     size_t nbyte = ctx.bytes_left;
 
     /* indirect erase block index that is to be written */
@@ -509,88 +664,632 @@ static ssize_t write_ebin(fs_context& fs, write_context& ctx)
         /* indirect erase block id that is to be written */
         eb_id_t eb_id = get_be32(ctx.ind_ptr[eb_index]);
 
-        if ((eb_left < ctx.new_ind_size) && eb_id)
+        if (eb_id && eb_is_unwritten(fs, eb_id))
+        {
+            /* The erase block was preallocated; it is written for
+             * the first time and no other one is needed. */
+            ssize_t rc = write_unwritten_eb(fs, ctx, eb_id, eb_offset, eb_left);
+            if (rc < 0)
+                return rc;
+        }
+        else if ((eb_left < ctx.new_ind_size) && eb_id)
         {
             /* The erase block we want to write into already exists.
              * Do not allocate a fresh erase blocks but write
-             * directly into the existing one. But do it in
-             * cluster-sized chunks. */
+             * directly into the existing one. */
+            ssize_t rc = write_eb_clusters(fs, ctx, eb_id, eb_offset, eb_left);
+            if (rc < 0)
+                return rc;
+        }
+        else
+        {
+            /* the erase block that we want to write to is not yet
+             * allocated or it is allocated but will be completely
+             * overwritten. */
+            scratch_buf eb_buf{ fs, fs.erasesize };
+            memset(eb_buf.data(), 0, eb_offset);
+            memcpy(eb_buf.data() + eb_offset, ctx.buf, eb_left);
+            memset(eb_buf.data() + eb_offset + eb_left, 0, ctx.new_ind_size - eb_offset - eb_left);
+            ssize_t rc = write_ind(fs, ctx, eb_buf.data(), eb_offset, eb_left, &ctx.ind_ptr[eb_index]);
+            if (rc < 0)
+                return rc;
 
-            uint64_t cl_count = eb_left;
-            uint32_t cl_index = static_cast<uint32_t>(eb_offset / fs.clustersize);
-            uint64_t cl_offset = eb_offset % fs.clustersize;
+            /* the completely overwritten erase block is set free
+             * once the inode no longer points to it on the medium. */
+            if (eb_id)
+                release_replaced_eraseblk(fs, eb_id);
 
-            while (cl_count)
-            {
-                uint64_t cl_left = std::min(cl_count, fs.clustersize - cl_offset);
-                uint64_t offset = eb_id * ctx.new_ind_size + cl_index * fs.clustersize;
-                /* offset = ctx.offset / fs.clustersize; */
+            ctx.buf += eb_left;
+        }
+        ctx.bytes_left -= eb_left;
+        ++eb_index;
+        eb_offset = 0;
+    }
+    return static_cast<ssize_t>(nbyte - ctx.bytes_left);
+}
 
-                if (cl_left < fs.clustersize)
-                {
-                    /* the write request is not cluster aligned.
-                     * read the content of the to-be-written-into
-                     * cluster to initiate a cluster aligned
-                     * write later. */
-                    ssize_t rc = read_raw(*fs.io_ctx, fs.buf, fs.clustersize, offset);
-                    if (rc < 0)
-                        return rc;
-                    debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
-                }
-                else
-                {
-                    memset(fs.buf, 0, cl_offset);
-                }
-                memcpy(fs.buf + cl_offset, ctx.buf, cl_left);
+static ssize_t read_extent(fs_context& fs, const inode& ino, char* buf, uint64_t nbyte, uint64_t offset)
+{
+    /* never try to read more than there is available */
+    nbyte = std::min(nbyte, get_be64(ino.i_size) - offset);
+    uint64_t bytes_left = nbyte;
+
+    while (bytes_left)
+    {
+        uint32_t block = static_cast<uint32_t>(offset / fs.erasesize);
+
+        extent_run run;
+        int rc = extent_lookup(fs, ino, block, run);
+        if (rc < 0)
+            return rc;
 
-                ssize_t rc = write_raw(*fs.io_ctx, fs.buf, fs.clustersize, offset);
-                if (rc < 0)
-                    return rc;
-                debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(rc));
+        // The erase blocks of a run are contiguous on the medium;
+        //  read as much of it as possible at once.
+        uint64_t run_end = (uint64_t{ run.block } + run.len) * fs.erasesize;
+        uint64_t run_left = std::min(bytes_left, run_end - offset);
 
-                ctx.buf += cl_left;
-                cl_count -= cl_left;
-                cl_index++;
-                cl_offset = 0;
+        // Preallocated erase blocks inside the run read like file holes;
+        //  stop at the first one that differs from the current one.
+        bool unwritten = run.start && eb_is_unwritten(fs, run.start + (block - run.block));
+        for (uint32_t next = block + 1; run.start && (uint64_t{ next } * fs.erasesize < offset + run_left); ++next)
+        {
+            if (eb_is_unwritten(fs, run.start + (next - run.block)) != unwritten)
+            {
+                run_left = uint64_t{ next } * fs.erasesize - offset;
+                break;
             }
         }
+
+        if (!run.start || unwritten)
+        {
+            /* we got a file hole */
+            memset(buf, 0, run_left);
+        }
         else
         {
-            /* the erase block that we want to write to is not yet
-             * allocated or it is allocated but will be completely
-             * overwritten. */
-            memset(fs.buf, 0, eb_offset);
-            memcpy(fs.buf + eb_offset, ctx.buf, eb_left);
-            ssize_t rc = write_ind(fs, ctx, fs.buf, &ctx.ind_ptr[eb_index]);
+            uint64_t eb_off = (uint64_t{ run.start } + (block - run.block)) * fs.erasesize + offset % fs.erasesize;
+
+            ssize_t read_rc = read_raw(*fs.io_ctx, buf, run_left, eb_off);
+            if (read_rc < 0)
+                return read_rc;
+            debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(read_rc));
+        }
+        buf += run_left;
+        offset += run_left;
+        bytes_left -= run_left;
+    }
+    return static_cast<ssize_t>(nbyte);
+}
+
+/*
+ * Find an empty erase block. The one behind 'prev_eb_id' is preferred
+ * because it keeps the data of a file contiguous on the medium.
+ */
+static eb_id_t find_eraseblk_after(fs_context& fs, eb_id_t prev_eb_id)
+{
+    eb_id_t eb_id = find_empty_eraseblk(fs);
+    if ((eb_id == FFSP_INVALID_EB_ID) || !prev_eb_id)
+        return eb_id;
+
+    eb_id_t next_eb_id = prev_eb_id + 1;
+    if ((next_eb_id < fs.neraseblocks) && eb_is_type(fs, next_eb_id, eraseblock_type::empty))
+        return next_eb_id;
+    return eb_id;
+}
+
+/*
+ * Find an empty erase block for the logical erase block 'block' of an extent
+ * mapped file. The erase block behind the one of the previous logical erase
+ * block is preferred because it extends the existing extent.
+ */
+static eb_id_t find_extent_eraseblk(fs_context& fs, const inode& ino, uint32_t block)
+{
+    extent_run prev;
+    if (!block || (extent_lookup(fs, ino, block - 1, prev) < 0) || !prev.start)
+        return find_empty_eraseblk(fs);
+    return find_eraseblk_after(fs, prev.start + (block - 1 - prev.block));
+}
+
+static ssize_t write_extent(fs_context& fs, write_context& ctx)
+{
+    size_t nbyte = ctx.bytes_left;
+
+    /* logical erase block that is to be written */
+    uint32_t block = static_cast<uint32_t>(ctx.offset / fs.erasesize);
+
+    /* write-offset inside the erase block */
+    uint64_t eb_offset = ctx.offset % fs.erasesize;
+
+    scratch_buf eb_buf{ fs, fs.erasesize };
+
+    while (ctx.bytes_left)
+    {
+        /* number of bytes left to be written into the current erase block */
+        uint64_t eb_left = std::min<uint64_t>(ctx.bytes_left, fs.erasesize - eb_offset);
+
+        extent_run run;
+        int rc = extent_lookup(fs, ctx.ino, block, run);
+        if (rc < 0)
+            return rc;
+        eb_id_t eb_id = run.start ? run.start + (block - run.block) : FFSP_INVALID_EB_ID;
+
+        if (eb_id && eb_is_unwritten(fs, eb_id))
+        {
+            ssize_t write_rc = write_unwritten_eb(fs, ctx, eb_id, eb_offset, eb_left);
+            if (write_rc < 0)
+                return write_rc;
+        }
+        else if ((eb_left < fs.erasesize) && eb_id)
+        {
+            ssize_t write_rc = write_eb_clusters(fs, ctx, eb_id, eb_offset, eb_left);
+            if (write_rc < 0)
+                return write_rc;
+        }
+        else
+        {
+            memset(eb_buf.data(), 0, eb_offset);
+            memcpy(eb_buf.data() + eb_offset, ctx.buf, eb_left);
+            memset(eb_buf.data() + eb_offset + eb_left, 0, fs.erasesize - eb_offset - eb_left);
+
+            if (is_zero_buf(eb_buf.data() + eb_offset, eb_left))
+            {
+                // Create a file hole; only an existing erase block
+                //  has to be removed from the extents.
+                if (eb_id)
+                    rc = extent_map(fs, ctx.ino, block, FFSP_INVALID_EB_ID);
+            }
+            else
+            {
+                bool for_dentry = S_ISDIR(get_be32(ctx.ino.i_mode));
+                eraseblock_type eb_type = get_eraseblk_type(fs, inode_data_type::ebin, for_dentry);
+
+                eb_id_t new_eb_id = find_extent_eraseblk(fs, ctx.ino, block);
+                if (new_eb_id == FFSP_INVALID_EB_ID)
+                {
+                    log().debug("Failed to find empty erase block");
+                    return -ENOSPC;
+                }
+
+                ssize_t write_rc = write_raw(*fs.io_ctx, eb_buf.data(), fs.erasesize, uint64_t{ new_eb_id } * fs.erasesize);
+                if (write_rc < 0)
+                    return write_rc;
+                debug_update(fs, debug_metric::write_raw, static_cast<uint64_t>(write_rc));
+
+                commit_write_operation(fs, eb_type, new_eb_id, ctx.ino.i_no);
+                rc = extent_map(fs, ctx.ino, block, new_eb_id);
+            }
             if (rc < 0)
                 return rc;
 
-            /* FIXME: the current erase block will not be set to
-             * "free" in case it was completely overwritten. */
+            /* like with erase block indirect files the completely
+             * overwritten erase block is set free later. */
+            if (eb_id)
+                release_replaced_eraseblk(fs, eb_id);
 
             ctx.buf += eb_left;
         }
         ctx.bytes_left -= eb_left;
-        ++eb_index;
+        ++block;
         eb_offset = 0;
     }
     return static_cast<ssize_t>(nbyte - ctx.bytes_left);
 }
 
+static void set_data_type(inode& ino, inode_data_type old_type, inode_data_type new_type)
+{
+    // clear old data type flag and set the new data type flag
+    uint32_t flags = get_be32(ino.i_flags);
+    flags = flags & ~static_cast<uint8_t>(old_type);
+    flags = flags | static_cast<uint8_t>(new_type);
+    ino.i_flags = put_be32(flags);
+}
+
+/*
+ * Convert an erase block indirect file of 'size' bytes into an extent
+ * mapped one. Neighbouring erase block pointers that are contiguous on the
+ * medium are combined into one extent.
+ */
+static ssize_t trunc_ebin2extent(fs_context& fs, inode& ino, uint64_t size)
+{
+    auto* ind_ptr = static_cast<be32_t*>(inode_data(ino));
+    uint32_t ptr_cnt = size ? ind_from_offset(size - 1, fs.erasesize) + 1 : 0;
+
+    std::vector<extent_run> runs;
+    for (uint32_t i = 0; i < ptr_cnt; ++i)
+    {
+        eb_id_t eb_id = get_be32(ind_ptr[i]);
+        if (!eb_id)
+            continue; // File hole
+
+        if (!runs.empty() && (runs.back().block + runs.back().len == i) && (runs.back().start + runs.back().len == eb_id))
+            ++runs.back().len;
+        else
+            runs.push_back({ i, 1, eb_id });
+    }
+
+    // Restore this backup on error.
+    scratch_buf old_ptr_buf{ fs, max_emb_size(fs) };
+    memcpy(old_ptr_buf.data(), ind_ptr, max_emb_size(fs));
+
+    int rc = extent_build(fs, ino, runs);
+    if (rc < 0)
+    {
+        memcpy(ind_ptr, old_ptr_buf.data(), max_emb_size(fs));
+        return rc;
+    }
+    set_data_type(ino, inode_data_type::ebin, inode_data_type::extent);
+    return 0;
+}
+
+/* Convert a file of any smaller data type into an extent mapped one. */
+static ssize_t trunc_to_extent(fs_context& fs, inode& ino, inode_data_type old_type, uint64_t old_size)
+{
+    if (old_type == inode_data_type::ebin)
+        return trunc_ebin2extent(fs, ino, old_size);
+
+    // Grow the file into the largest possible erase block indirect
+    //  file first. The extents are then created from its pointers.
+    const uint64_t ebin_size = max_ebin_size(fs);
+    write_context ctx {
+        nullptr, 0, ebin_size,
+        ino, static_cast<be32_t*>(inode_data(ino)),
+        old_size,
+        ebin_size,
+        ind_size_from_size(fs, old_size),
+        fs.erasesize,
+        old_type,
+        inode_data_type::ebin
+    };
+
+    ssize_t rc;
+    if (old_type == inode_data_type::emb)
+        rc = write_emb(fs, ctx);
+    else
+        rc = trunc_clin2ebin(fs, ctx);
+    if (rc < 0)
+        return rc;
+    return trunc_ebin2extent(fs, ino, ebin_size);
+}
+
+/*
+ * Convert an extent mapped file back into an erase block indirect one of
+ * the largest possible size. Erase blocks beyond that size are released.
+ */
+static ssize_t trunc_extent2ebin(fs_context& fs, inode& ino)
+{
+    const uint32_t ptr_cnt = static_cast<uint32_t>(max_emb_size(fs) / sizeof(be32_t));
+
+    std::vector<extent_run> runs;
+    std::vector<cl_id_t> nodes;
+    int rc = extent_collect(fs, ino, runs, &nodes);
+    if (rc < 0)
+        return rc;
+
+    auto* ind_ptr = static_cast<be32_t*>(inode_data(ino));
+    memset(ind_ptr, 0, max_emb_size(fs));
+
+    std::vector<extent_run> dropped;
+    for (const auto& run : runs)
+    {
+        uint32_t i = 0;
+        for (; (i < run.len) && (run.block + i < ptr_cnt); ++i)
+            ind_ptr[run.block + i] = put_be32(run.start + i);
+        if (i < run.len)
+            dropped.push_back({ run.block + i, run.len - i, run.start + i });
+    }
+    extent_release_nodes(fs, nodes);
+    extent_release_runs(fs, dropped);
+
+    set_data_type(ino, inode_data_type::extent, inode_data_type::ebin);
+    return 0;
+}
+
+static ssize_t trunc_extent(fs_context& fs, write_context& ctx)
+{
+    // Growing an extent mapped file only adds a file hole.
+    if (ctx.new_size >= ctx.old_size)
+        return 0;
+
+    uint32_t block_cnt = ind_from_offset(ctx.new_size - 1, fs.erasesize) + 1;
+    return extent_truncate(fs, ctx.ino, block_cnt);
+}
+
+static ssize_t read_ptr_cluster(fs_context& fs, cl_id_t cl_id, char* buf)
+{
+    if (!cl_id)
+    {
+        // Pointer cluster hole
+        memset(buf, 0, fs.clustersize);
+        return 0;
+    }
+    ssize_t rc = read_raw(*fs.io_ctx, buf, fs.clustersize, uint64_t{ cl_id } * fs.clustersize);
+    if (!(rc < 0))
+        debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+    return rc;
+}
+
+/*
+ * Context to write into the data clusters a pointer cluster points to. The
+ * pointer cluster takes the place of the inode's data section of a cluster
+ * indirect file.
+ */
+static write_context ptr_cluster_context(fs_context& fs, write_context& ctx, be32_t* ptrs,
+                                         uint64_t offset, size_t nbyte)
+{
+    return write_context {
+        ctx.buf, nbyte, offset,
+        ctx.ino, ptrs,
+        ctx.old_size,
+        ctx.new_size,
+        fs.clustersize,
+        fs.clustersize,
+        inode_data_type::clin,
+        inode_data_type::clin
+    };
+}
+
+static ssize_t read_dclin(fs_context& fs, const inode& ino, char* buf, uint64_t nbyte, uint64_t offset)
+{
+    const auto* ind_ptr = static_cast<const be32_t*>(inode_data(ino));
+    const uint64_t ptr_size = dclin_ptr_size(fs);
+
+    /* never try to read more than there is available */
+    nbyte = std::min(nbyte, get_be64(ino.i_size) - offset);
+    uint64_t bytes_left = nbyte;
+
+    scratch_buf ptr_buf{ fs, fs.clustersize };
+    const auto* ptrs = reinterpret_cast<const be32_t*>(ptr_buf.data());
+
+    while (bytes_left)
+    {
+        uint32_t ind_index = ind_from_offset(offset, ptr_size);
+        uint64_t ptr_offset = offset % ptr_size;
+        uint64_t ptr_left = std::min(bytes_left, ptr_size - ptr_offset);
+
+        ssize_t rc = read_ptr_cluster(fs, get_be32(ind_ptr[ind_index]), ptr_buf.data());
+        if (!(rc < 0))
+            rc = read_ind_ptr(fs, ptrs, buf, ptr_left, ptr_offset, fs.clustersize);
+        if (rc < 0)
+            return rc;
+
+        buf += ptr_left;
+        offset += ptr_left;
+        bytes_left -= ptr_left;
+    }
+    return static_cast<ssize_t>(nbyte);
+}
+
+static ssize_t write_dclin(fs_context& fs, write_context& ctx)
+{
+    size_t nbyte = ctx.bytes_left;
+    const uint64_t ptr_size = dclin_ptr_size(fs);
+
+    scratch_buf ptr_buf{ fs, fs.clustersize };
+    auto* ptrs = reinterpret_cast<be32_t*>(ptr_buf.data());
+
+    while (ctx.bytes_left)
+    {
+        uint32_t ind_index = ind_from_offset(ctx.offset, ptr_size);
+        uint64_t ptr_offset = ctx.offset % ptr_size;
+        size_t ptr_left = std::min<uint64_t>(ctx.bytes_left, ptr_size - ptr_offset);
+
+        be32_t old_ptr_cl = ctx.ind_ptr[ind_index];
+        ssize_t rc = read_ptr_cluster(fs, get_be32(old_ptr_cl), ptr_buf.data());
+        if (rc < 0)
+            return rc;
+
+        // Write the data clusters the same way as those of a cluster
+        //  indirect file, then the changed pointer cluster.
+        write_context ptr_ctx = ptr_cluster_context(fs, ctx, ptrs, ptr_offset, ptr_left);
+        rc = write_clin(fs, ptr_ctx);
+        if (!(rc < 0))
+            rc = write_ind(fs, ptr_ctx, ptr_buf.data(), 0, fs.clustersize, &ctx.ind_ptr[ind_index]);
+        if (rc < 0)
+            return rc;
+
+        invalidate_ind_ptr(fs, &old_ptr_cl, 1, inode_data_type::clin);
+
+        ctx.buf += ptr_left;
+        ctx.offset += ptr_left;
+        ctx.bytes_left -= ptr_left;
+    }
+    return static_cast<ssize_t>(nbyte - ctx.bytes_left);
+}
+
+/*
+ * Convert a cluster indirect file into a double cluster indirect one. The
+ * inode's cluster pointers fit into the first pointer cluster, so none of
+ * the data has to be moved.
+ */
+static ssize_t trunc_clin2dclin(fs_context& fs, inode& ino, uint64_t old_size)
+{
+    auto* ind_ptr = static_cast<be32_t*>(inode_data(ino));
+    uint32_t ptr_cnt = old_size ? ind_from_offset(old_size - 1, fs.clustersize) + 1 : 0;
+
+    scratch_buf ptr_buf{ fs, fs.clustersize };
+    memcpy(ptr_buf.data(), ind_ptr, ptr_cnt * sizeof(be32_t));
+    memset(ptr_buf.data() + ptr_cnt * sizeof(be32_t), 0, fs.clustersize - ptr_cnt * sizeof(be32_t));
+
+    write_context ctx {
+        nullptr, 0, 0,
+        ino, ind_ptr,
+        old_size,
+        old_size,
+        fs.clustersize,
+        fs.clustersize,
+        inode_data_type::clin,
+        inode_data_type::clin
+    };
+    be32_t ptr_cl_id;
+    ssize_t rc = write_ind(fs, ctx, ptr_buf.data(), 0, fs.clustersize, &ptr_cl_id);
+    if (rc < 0)
+        return rc;
+
+    memset(ind_ptr, 0, max_emb_size(fs));
+    ind_ptr[0] = ptr_cl_id;
+    set_data_type(ino, inode_data_type::clin, inode_data_type::dclin);
+    return 0;
+}
+
+/* Convert a file of any smaller data type into a double cluster indirect one. */
+static ssize_t trunc_to_dclin(fs_context& fs, inode& ino, inode_data_type old_type, uint64_t old_size)
+{
+    if (old_type == inode_data_type::clin)
+        return trunc_clin2dclin(fs, ino, old_size);
+
+    if (old_type != inode_data_type::emb)
+    {
+        log().error("ffsp::trunc_to_dclin(): unexpected inode type {}", old_type);
+        return -EPERM;
+    }
+
+    // Move the embedded data into the largest possible cluster
+    //  indirect file first.
+    const uint64_t clin_size = max_clin_size(fs);
+    write_context ctx {
+        nullptr, 0, clin_size,
+        ino, static_cast<be32_t*>(inode_data(ino)),
+        old_size,
+        clin_size,
+        0,
+        fs.clustersize,
+        old_type,
+        inode_data_type::clin
+    };
+    ssize_t rc = write_emb(fs, ctx);
+    if (rc < 0)
+        return rc;
+    return trunc_clin2dclin(fs, ino, clin_size);
+}
+
+/*
+ * Convert a double cluster indirect file back into a cluster indirect one
+ * of the largest possible size. Clusters beyond that size are released.
+ */
+static ssize_t trunc_dclin2clin(fs_context& fs, inode& ino, uint64_t old_size)
+{
+    auto* ind_ptr = static_cast<be32_t*>(inode_data(ino));
+    const uint32_t ptr_cnt = static_cast<uint32_t>(max_emb_size(fs) / sizeof(be32_t));
+    const uint32_t cl_ptr_cnt = fs.clustersize / sizeof(be32_t);
+    uint32_t ind_cnt = ind_from_offset(old_size - 1, dclin_ptr_size(fs)) + 1;
+
+    scratch_buf ptr_buf{ fs, fs.clustersize };
+    auto* ptrs = reinterpret_cast<be32_t*>(ptr_buf.data());
+    ssize_t rc = read_ptr_cluster(fs, get_be32(ind_ptr[0]), ptr_buf.data());
+    if (rc < 0)
+        return rc;
+
+    invalidate_ind_ptr(fs, ind_ptr + 1, ind_cnt - 1, inode_data_type::dclin);
+    invalidate_ind_ptr(fs, ptrs + ptr_cnt, cl_ptr_cnt - ptr_cnt, inode_data_type::clin);
+    invalidate_ind_ptr(fs, ind_ptr, 1, inode_data_type::clin);
+
+    memcpy(ind_ptr, ptrs, ptr_cnt * sizeof(be32_t));
+    set_data_type(ino, inode_data_type::dclin, inode_data_type::clin);
+    return 0;
+}
+
+static ssize_t trunc_dclin(fs_context& fs, write_context& ctx)
+{
+    const uint64_t ptr_size = dclin_ptr_size(fs);
+    const uint32_t cl_ptr_cnt = fs.clustersize / sizeof(be32_t);
+    uint32_t old_cnt = ind_from_offset(ctx.old_size - 1, ptr_size) + 1;
+    uint32_t new_cnt = ind_from_offset(ctx.new_size - 1, ptr_size) + 1;
+
+    if (ctx.new_size > ctx.old_size)
+    {
+        // Handle file extension
+        for (uint32_t i = old_cnt; i < new_cnt; ++i)
+            ctx.ind_ptr[i] = put_be32(0);
+        return 0;
+    }
+
+    // Handle file reduction
+    invalidate_ind_ptr(fs, ctx.ind_ptr + new_cnt, old_cnt - new_cnt, inode_data_type::dclin);
+
+    // Drop the clusters behind the new end from the last pointer cluster.
+    be32_t old_ptr_cl = ctx.ind_ptr[new_cnt - 1];
+    if (!get_be32(old_ptr_cl))
+        return 0;
+
+    scratch_buf ptr_buf{ fs, fs.clustersize };
+    auto* ptrs = reinterpret_cast<be32_t*>(ptr_buf.data());
+    ssize_t rc = read_ptr_cluster(fs, get_be32(old_ptr_cl), ptr_buf.data());
+    if (rc < 0)
+        return rc;
+
+    uint32_t keep = ind_from_offset(ctx.new_size - 1 - uint64_t{ new_cnt - 1 } * ptr_size, fs.clustersize) + 1;
+    if (is_zero_buf(ptrs + keep, (cl_ptr_cnt - keep) * sizeof(be32_t)))
+        return 0;
+
+    invalidate_ind_ptr(fs, ptrs + keep, cl_ptr_cnt - keep, inode_data_type::clin);
+    memset(ptrs + keep, 0, (cl_ptr_cnt - keep) * sizeof(be32_t));
+
+    write_context ptr_ctx = ptr_cluster_context(fs, ctx, ptrs, 0, 0);
+    rc = write_ind(fs, ptr_ctx, ptr_buf.data(), 0, fs.clustersize, &ctx.ind_ptr[new_cnt - 1]);
+    if (rc < 0)
+        return rc;
+    invalidate_ind_ptr(fs, &old_ptr_cl, 1, inode_data_type::clin);
+    return 0;
+}
+
 int truncate(fs_context& fs, inode& ino, uint64_t length)
 {
     auto old_size = get_be64(ino.i_size);
     auto new_size = length;
 
-    if (new_size > max_ebin_size(fs))
+    if (new_size > max_file_size(fs))
         return -EFBIG;
 
     if (new_size == old_size)
         return 0;
 
+    if (fs.delalloc && (new_size < old_size))
+    {
+        // Shrinking the file may move the remaining data into another
+        //  data type. Place the delayed data on the medium first.
+        delalloc_truncate(*fs.delalloc, get_be32(ino.i_no), new_size);
+        int wb_rc = write_back(fs, ino);
+        if (wb_rc < 0)
+            return wb_rc;
+    }
+
     auto old_type = static_cast<inode_data_type>(get_be32(ino.i_flags) & 0xff);
     auto new_type = data_type_from_size(fs, new_size);
 
+    ssize_t rc;
+    if ((new_type == inode_data_type::extent) && (old_type != inode_data_type::extent))
+    {
+        rc = trunc_to_extent(fs, ino, old_type, old_size);
+        if (rc < 0)
+            return static_cast<int>(rc);
+        old_type = inode_data_type::extent;
+    }
+    else if ((old_type == inode_data_type::extent) && (new_type != inode_data_type::extent))
+    {
+        // Shrink the file down to an erase block indirect one first.
+        rc = trunc_extent2ebin(fs, ino);
+        if (rc < 0)
+            return static_cast<int>(rc);
+        old_type = inode_data_type::ebin;
+        old_size = max_ebin_size(fs);
+    }
+    else if ((new_type == inode_data_type::dclin) && (old_type != inode_data_type::dclin))
+    {
+        rc = trunc_to_dclin(fs, ino, old_type, old_size);
+        if (rc < 0)
+            return static_cast<int>(rc);
+        old_type = inode_data_type::dclin;
+    }
+    else if ((old_type == inode_data_type::dclin) && (new_type != inode_data_type::dclin))
+    {
+        // Shrink the file down to a cluster indirect one first.
+        rc = trunc_dclin2clin(fs, ino, old_size);
+        if (rc < 0)
+            return static_cast<int>(rc);
+        old_type = inode_data_type::clin;
+        old_size = max_clin_size(fs);
+    }
+
     write_context ctx {
         nullptr, 0, new_size,
         ino, static_cast<be32_t*>(inode_data(ino)),
@@ -602,13 +1301,16 @@ int truncate(fs_context& fs, inode& ino, uint64_t length)
         new_type
     };
 
-    ssize_t rc;
     if (old_type == inode_data_type::emb)
         rc = write_emb(fs, ctx);
     else if (old_type == inode_data_type::clin)
         rc = trunc_clin(fs, ctx);
     else if (old_type == inode_data_type::ebin)
         rc = trunc_ebin(fs, ctx);
+    else if (old_type == inode_data_type::extent)
+        rc = trunc_extent(fs, ctx);
+    else if (old_type == inode_data_type::dclin)
+        rc = trunc_dclin(fs, ctx);
     else
     {
         log().error("ffsp::truncate(): unknown inode type");
@@ -650,12 +1352,20 @@ ssize_t read(fs_context& fs, const inode& ino, char* buf, uint64_t nbyte, uint64
         rc = read_ind(fs, ino, buf, nbyte, offset, fs.clustersize);
     else if (data_type == inode_data_type::ebin)
         rc = read_ind(fs, ino, buf, nbyte, offset, fs.erasesize);
+    else if (data_type == inode_data_type::extent)
+        rc = read_extent(fs, ino, buf, nbyte, offset);
+    else if (data_type == inode_data_type::dclin)
+        rc = read_dclin(fs, ino, buf, nbyte, offset);
     else
     {
         log().error("ffsp::read(): unknown inode type");
         return -EPERM;
     }
 
+    // Data that was not written back yet is newer than the medium.
+    if (fs.delalloc && (rc > 0))
+        delalloc_read(*fs.delalloc, get_be32(ino.i_no), buf, static_cast<uint64_t>(rc), offset);
+
     //    TODO: Decide what to do with this.
     //    if (!(fs.flags & FFSP_SUPER_NOATIME))
     //        ffsp_update_atime(cl->ino);
@@ -663,12 +1373,17 @@ ssize_t read(fs_context& fs, const inode& ino, char* buf, uint64_t nbyte, uint64
     return rc;
 }
 
-ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint64_t offset)
+/*
+ * Place the data on the medium and update the inode. Unlike write_through()
+ * this never writes back the dirty inodes, so no commit can happen before
+ * the caller is done.
+ */
+static ssize_t write_data(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint64_t offset)
 {
     auto old_size = get_be64(ino.i_size);
     auto new_size = std::max(get_be64(ino.i_size), offset + nbyte);
 
-    if (new_size > max_ebin_size(fs))
+    if (new_size > max_file_size(fs))
         return -EFBIG;
 
     if (nbyte == 0)
@@ -677,6 +1392,26 @@ ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint6
     auto old_type = static_cast<inode_data_type>(get_be32(ino.i_flags) & 0xff);
     auto new_type = data_type_from_size(fs, new_size);
 
+    ssize_t rc;
+    if ((new_type == inode_data_type::extent) && (old_type != inode_data_type::extent))
+    {
+        // Handle file type growth before writing; the extents do not
+        //  depend on the file size.
+        rc = trunc_to_extent(fs, ino, old_type, old_size);
+        if (rc < 0)
+            return rc;
+        old_type = inode_data_type::extent;
+    }
+    else if ((new_type == inode_data_type::dclin) && (old_type != inode_data_type::dclin))
+    {
+        // The pointers of the cluster indirect file are moved into
+        //  the first pointer cluster; the data stays where it is.
+        rc = trunc_to_dclin(fs, ino, old_type, old_size);
+        if (rc < 0)
+            return rc;
+        old_type = inode_data_type::dclin;
+    }
+
     write_context ctx {
         buf, nbyte, offset,
         ino, static_cast<be32_t*>(inode_data(ino)),
@@ -688,7 +1423,6 @@ ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint6
         new_type
     };
 
-    ssize_t rc;
     if (old_type == inode_data_type::emb)
     {
         rc = write_emb(fs, ctx);
@@ -697,14 +1431,15 @@ ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint6
     {
         if (ctx.new_type == inode_data_type::ebin)
         {
-            // Handle file type growth while writing.
-
-            // TODO: This is not optimal -
-            //  clusters might be written twice
+            // Handle file type growth while writing. The conversion
+            //  already writes the part of the request that overlaps
+            //  the old file content, write_ebin() writes the rest.
             rc = trunc_clin2ebin(fs, ctx);
             if (rc < 0)
                 return rc;
             rc = write_ebin(fs, ctx);
+            if (!(rc < 0))
+                rc = static_cast<ssize_t>(nbyte - ctx.bytes_left);
         }
         else
         {
@@ -724,6 +1459,20 @@ ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint6
         }
         rc = write_ebin(fs, ctx);
     }
+    else if (old_type == inode_data_type::extent)
+    {
+        rc = write_extent(fs, ctx);
+    }
+    else if (old_type == inode_data_type::dclin)
+    {
+        if (ctx.new_size > ctx.old_size)
+        {
+            rc = trunc_dclin(fs, ctx);
+            if (rc < 0)
+                return rc;
+        }
+        rc = write_dclin(fs, ctx);
+    }
     else
     {
         log().error("ffsp::write(): unknown inode type");
@@ -735,6 +1484,15 @@ ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint6
         ino.i_size = put_be64(ctx.new_size);
         update_time(ino.i_mtime);
         mark_dirty(fs, ino);
+    }
+    return rc;
+}
+
+static ssize_t write_through(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint64_t offset)
+{
+    ssize_t rc = write_data(fs, ino, buf, nbyte, offset);
+    if (!(rc < 0))
+    {
         flush_inodes(fs, false);
 
         // The recent call to mark the current inode dirty might have
@@ -745,4 +1503,195 @@ ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint6
     return rc;
 }
 
+/*
+ * Keep the data in memory instead of placing it on the medium right away.
+ * Only the file size (and with it the data type) is updated; the new part
+ * of the file is a hole on the medium until the data is written back.
+ * flush_inodes() writes the delayed data back before the inode, so a
+ * committed file size never covers data that only existed in memory.
+ */
+static ssize_t write_delayed(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint64_t offset)
+{
+    if (offset + nbyte > max_file_size(fs))
+        return -EFBIG;
+
+    if (nbyte == 0)
+        return 0;
+
+    // Growing the file may write back the dirty inodes; the new data has
+    //  to be part of the delayed data by then.
+    const ino_t ino_no = get_be32(ino.i_no);
+    delalloc_add(*fs.delalloc, ino_no, buf, nbyte, offset);
+
+    if (offset + nbyte > get_be64(ino.i_size))
+    {
+        int rc = truncate(fs, ino, offset + nbyte);
+        if (rc < 0)
+        {
+            delalloc_truncate(*fs.delalloc, ino_no, get_be64(ino.i_size));
+            return rc;
+        }
+    }
+
+    update_time(ino.i_mtime);
+    mark_dirty(fs, ino);
+
+    if (delalloc_full(*fs.delalloc))
+    {
+        int rc = write_back_all(fs);
+        if (rc < 0)
+            return rc;
+    }
+    flush_inodes(fs, false);
+    gc(fs);
+    return static_cast<ssize_t>(nbyte);
+}
+
+ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t nbyte, uint64_t offset)
+{
+    // Directories and symbolic links are always written through.
+    if (fs.delalloc && S_ISREG(get_be32(ino.i_mode)))
+        return write_delayed(fs, ino, buf, nbyte, offset);
+    return write_through(fs, ino, buf, nbyte, offset);
+}
+
+int write_back(fs_context& fs, inode& ino)
+{
+    if (!fs.delalloc || !delalloc_pending(*fs.delalloc, get_be32(ino.i_no)))
+        return 0;
+
+    // The file already has its final size, so the data is written in
+    //  order into the final data type without any further conversion.
+    //  The inode is not written back in between; it would cover the
+    //  ranges that are not placed yet.
+    delalloc_ranges ranges = delalloc_take(*fs.delalloc, get_be32(ino.i_no));
+    for (auto it = ranges.begin(); it != ranges.end(); ++it)
+    {
+        ssize_t rc = write_data(fs, ino, it->second.data(), it->second.size(), it->first);
+        if (rc < 0)
+        {
+            log().error("ffsp::write_back(): writing inode {} failed", get_be32(ino.i_no));
+
+            // Keep what was not written yet to retry later.
+            for (; it != ranges.end(); ++it)
+                delalloc_add(*fs.delalloc, get_be32(ino.i_no), it->second.data(), it->second.size(), it->first);
+            return static_cast<int>(rc);
+        }
+    }
+    return 0;
+}
+
+int write_back_all(fs_context& fs)
+{
+    if (!fs.delalloc)
+        return 0;
+
+    for (ino_t ino_no : delalloc_inodes(*fs.delalloc))
+    {
+        inode* ino = inode_cache_find(*fs.inode_cache, ino_no);
+        if (!ino)
+        {
+            log().error("ffsp::write_back_all(): inode {} not cached", ino_no);
+            delalloc_take(*fs.delalloc, ino_no);
+            continue;
+        }
+        int rc = write_back(fs, *ino);
+        if (rc < 0)
+            return rc;
+    }
+    return 0;
+}
+
+int fallocate(fs_context& fs, inode& ino, uint64_t offset, uint64_t length)
+{
+    if (length == 0)
+        return -EINVAL;
+
+    uint64_t end = offset + length;
+    if ((end < offset) || (end > max_file_size(fs)))
+        return -EFBIG;
+
+    if (end > get_be64(ino.i_size))
+    {
+        // Grow the file into its final data type at once instead of
+        //  converting it step by step while it is being written.
+        int rc = truncate(fs, ino, end);
+        if (rc < 0)
+            return rc;
+    }
+
+    // Only erase blocks are reserved. Indirect clusters are written
+    //  copy-on-write anyway, so reserving them would not help.
+    auto data_type = static_cast<inode_data_type>(get_be32(ino.i_flags) & 0xff);
+    uint32_t first = ind_from_offset(offset, fs.erasesize);
+    uint32_t last = ind_from_offset(end - 1, fs.erasesize);
+    bool reserved = false;
+    int rc = 0;
+
+    if (data_type == inode_data_type::ebin)
+    {
+        auto* ind_ptr = static_cast<be32_t*>(inode_data(ino));
+        eb_id_t prev_eb_id = first ? get_be32(ind_ptr[first - 1]) : FFSP_INVALID_EB_ID;
+
+        for (uint32_t i = first; i <= last; ++i)
+        {
+            eb_id_t eb_id = get_be32(ind_ptr[i]);
+            if (!eb_id)
+            {
+                eb_id = find_eraseblk_after(fs, prev_eb_id);
+                if (eb_id == FFSP_INVALID_EB_ID)
+                {
+                    rc = -ENOSPC;
+                    break;
+                }
+                eb_reserve(fs, eb_id);
+                ind_ptr[i] = put_be32(eb_id);
+                reserved = true;
+            }
+            prev_eb_id = eb_id;
+        }
+    }
+    else if (data_type == inode_data_type::extent)
+    {
+        for (uint32_t block = first; block <= last; ++block)
+        {
+            extent_run run;
+            rc = extent_lookup(fs, ino, block, run);
+            if (rc < 0)
+                break;
+            if (run.start)
+                continue;
+
+            eb_id_t eb_id = find_extent_eraseblk(fs, ino, block);
+            if (eb_id == FFSP_INVALID_EB_ID)
+            {
+                rc = -ENOSPC;
+                break;
+            }
+            eb_reserve(fs, eb_id);
+            rc = extent_map(fs, ino, block, eb_id);
+            if (rc < 0)
+            {
+                fs.eb_usage[eb_id].e_type = eraseblock_type::empty;
+                break;
+            }
+            reserved = true;
+        }
+    }
+
+    if (reserved)
+    {
+        // Make the reserved erase blocks durable before the inode that
+        //  points to them. A crash in between leaves them reserved but
+        //  unused instead of exposing their stale content.
+        mark_dirty(fs, ino);
+        int commit_rc = checkpoint_commit(fs);
+        if (!(commit_rc < 0))
+            commit_rc = flush_inodes(fs, true);
+        if (!(rc < 0))
+            rc = commit_rc;
+    }
+    return rc;
+}
+
 } // namespace ffsp
@@ -37,6 +37,15 @@ int truncate(fs_context& fs, inode& ino, uint64_t length);
 ssize_t read(fs_context& fs, const inode& ino, char* buf, uint64_t count, uint64_t offset);
 ssize_t write(fs_context& fs, inode& ino, const char* buf, uint64_t count, uint64_t offset);
 
+// Place the delayed data of the inode or of all inodes on the medium.
+int write_back(fs_context& fs, inode& ino);
+int write_back_all(fs_context& fs);
+
+// Reserve the erase blocks of the range ['offset', 'offset' + 'length') of
+//  an erase block indirect or extent mapped file and grow the file if the
+//  range ends behind it. Reserved erase blocks read as zeros.
+int fallocate(fs_context& fs, inode& ino, uint64_t offset, uint64_t length);
+
 } // namespace ffsp
 
 #endif /* IO_HPP */
@@ -133,6 +133,10 @@ struct fmt::formatter<ffsp::eraseblock_type> : fmt::formatter<std::string>
             return fmt::format_to(ctx.out(), "ebin");
         case ffsp::eraseblock_type::empty:
             return fmt::format_to(ctx.out(), "empty");
+        case ffsp::eraseblock_type::dentry_inode_cold:
+            return fmt::format_to(ctx.out(), "dentry_inode_cold");
+        case ffsp::eraseblock_type::file_inode_cold:
+            return fmt::format_to(ctx.out(), "file_inode_cold");
         case ffsp::eraseblock_type::invalid:
             return fmt::format_to(ctx.out(), "invalid");
         }
@@ -141,17 +145,18 @@ struct fmt::formatter<ffsp::eraseblock_type> : fmt::formatter<std::string>
 };
 
 template<>
-struct fmt::formatter<ffsp::eraseblock> : fmt::formatter<std::string>
+struct fmt::formatter<ffsp::eraseblock_usage> : fmt::formatter<std::string>
 {
-    auto format(const ffsp::eraseblock& eb, format_context& ctx) const -> decltype(ctx.out())
+    auto format(const ffsp::eraseblock_usage& eb, format_context& ctx) const -> decltype(ctx.out())
     {
         return fmt::format_to(ctx.out(), "{{"
-            "type={}, lastwrite={}, cvalid={}, writeops={}"
+            "type={}, flags={:#x}, lastwrite={}, cvalid={}, writeops={}"
             "}}",
             eb.e_type,
-            get_be16(eb.e_lastwrite),
-            get_be16(eb.e_cvalid),
-            get_be16(eb.e_writeops)
+            eb.e_flags,
+            eb.e_lastwrite,
+            eb.e_cvalid,
+            eb.e_writeops
         );
     }
 };
@@ -183,6 +188,10 @@ struct fmt::formatter<ffsp::inode_data_type> : fmt::formatter<std::string>
             return fmt::format_to(ctx.out(), "clin");
         case ffsp::inode_data_type::ebin:
             return fmt::format_to(ctx.out(), "ebin");
+        case ffsp::inode_data_type::extent:
+            return fmt::format_to(ctx.out(), "extent");
+        case ffsp::inode_data_type::dclin:
+            return fmt::format_to(ctx.out(), "dclin");
         }
         return fmt::format_to(ctx.out(), "unknown");
     }
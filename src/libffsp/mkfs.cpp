@@ -23,6 +23,7 @@
 #include "io_raw.hpp"
 #include "utils.hpp"
 
+#include <random>
 #include <vector>
 
 #include <cerrno>
@@ -58,7 +59,8 @@ static uint32_t get_inode_cnt(uint32_t eb_size, uint32_t cl_size, uint32_t eb_cn
     // Note that the first inode number is always invalid.
     return (eb_size                          // Only look at the first erase block
             - cl_size                        // super block aligned to clustersize
-            - (eb_cnt * sizeof(eraseblock))) // eb usage
+            - (eb_cnt * sizeof(eraseblock))  // eb usage
+            - (eb_cnt * sizeof(be32_t)))     // eb erase counts
            / sizeof(uint32_t);               // inodes are 4 bytes in size
 
     // TODO: FFSP_RESERVED_INODE_ID is not taken care of.
@@ -79,7 +81,7 @@ static bool create_super_eb(io_backend& ctx, const mkfs_options& options)
 
     superblock sb = {};
     sb.s_fsid = put_be32(FFSP_FILE_SYSTEM_ID);
-    sb.s_flags = put_be32(0);
+    sb.s_flags = put_be32(options.flags);
     sb.s_neraseblocks = put_be32(eb_cnt);
     sb.s_nino = put_be32(ino_cnt);
     sb.s_blocksize = put_be32(options.clustersize);
@@ -89,6 +91,13 @@ static bool create_super_eb(io_backend& ctx, const mkfs_options& options)
     sb.s_neraseopen = put_be32(options.neraseopen);
     sb.s_nerasereserve = put_be32(options.nerasereserve);
     sb.s_nerasewrites = put_be32(options.nerasewrites);
+    sb.s_journaleb = put_be32(2);
+    sb.s_cpgen = put_be32(1);
+    sb.s_state = put_be32(FFSP_STATE_CLEAN);
+    sb.s_wseq = put_be64(0);
+    // Inode clusters are told apart from file data that looks like them
+    //  by this value; it differs between file systems.
+    sb.s_seed = put_be32(std::random_device{}());
     memcpy(eb_buf.data(), &sb, sizeof(sb));
     eb_buf_written = sizeof(sb);
 
@@ -114,7 +123,16 @@ static bool create_super_eb(io_backend& ctx, const mkfs_options& options)
     memcpy(eb_buf.data() + eb_buf_written, &eb2, sizeof(eb2));
     eb_buf_written += sizeof(eb2);
 
-    for (uint32_t i = 2; i < eb_cnt; ++i)
+    // The third EB is for the meta data journal
+    eraseblock eb3 = {};
+    eb3.e_type = eraseblock_type::super;
+    eb3.e_lastwrite = put_be16(0);
+    eb3.e_cvalid = put_be16(0);
+    eb3.e_writeops = put_be16(0);
+    memcpy(eb_buf.data() + eb_buf_written, &eb3, sizeof(eb3));
+    eb_buf_written += sizeof(eb3);
+
+    for (uint32_t i = 3; i < eb_cnt; ++i)
     {
         // The remaining erase blocks are empty
         eraseblock eb = {};
@@ -126,6 +144,10 @@ static bool create_super_eb(io_backend& ctx, const mkfs_options& options)
         eb_buf_written += sizeof(eb);
     }
 
+    // None of the erase blocks was erased by the file system yet
+    memset(eb_buf.data() + eb_buf_written, 0, eb_cnt * sizeof(be32_t));
+    eb_buf_written += eb_cnt * sizeof(be32_t);
+
     // inode id 0 is defined to be invalid
     be32_t cl_0 = put_be32(FFSP_RESERVED_CL_ID); // Value does not matter
     memcpy(eb_buf.data() + eb_buf_written, &cl_0, sizeof(cl_0));
@@ -197,6 +219,20 @@ static bool create_inode_eb(io_backend& ctx, const mkfs_options& options)
     return true;
 }
 
+static bool create_journal_eb(io_backend& ctx, const mkfs_options& options)
+{
+    // An empty first cluster marks the end of the journal.
+    std::vector<char> cl_buf(options.clustersize, 0);
+
+    ssize_t rc = write_raw(ctx, cl_buf.data(), options.clustersize, uint64_t{ options.erasesize } * 2);
+    if (rc < 0)
+    {
+        perror("create_journal_eb");
+        return false;
+    }
+    return true;
+}
+
 bool mkfs(io_backend& ctx, const mkfs_options& options)
 {
     // Setup the first eraseblock with super, usage and inodemap
@@ -210,6 +246,12 @@ bool mkfs(io_backend& ctx, const mkfs_options& options)
     {
         return false;
     }
+
+    // Start with an empty meta data journal
+    if (!create_journal_eb(ctx, options))
+    {
+        return false;
+    }
     return true;
 }
 
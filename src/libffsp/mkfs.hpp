@@ -36,13 +36,16 @@ struct mkfs_options
     uint32_t neraseopen{ 0 };
     uint32_t nerasereserve{ 0 };
     uint32_t nerasewrites{ 0 };
+    uint32_t flags{ 0 };
 
     constexpr mkfs_options(uint32_t c, uint32_t e,
                            uint32_t i, uint32_t o,
-                           uint32_t r, uint32_t w)
+                           uint32_t r, uint32_t w,
+                           uint32_t f = 0)
         : clustersize{ c }, erasesize{ e },
           ninoopen{ i }, neraseopen{ o },
-          nerasereserve{ r }, nerasewrites{ w }
+          nerasereserve{ r }, nerasewrites{ w },
+          flags{ f }
     {}
 };
 
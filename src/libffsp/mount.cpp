@@ -19,20 +19,31 @@
  */
 
 #include "mount.hpp"
+#include "checkpoint.hpp"
+#include "committer.hpp"
 #include "debug.hpp"
+#include "delalloc.hpp"
+#include "dir_index.hpp"
 #include "eraseblk.hpp"
 #include "ffsp.hpp"
 #include "gc.hpp"
 #include "inode.hpp"
 #include "inode_cache.hpp"
+#include "inode_group.hpp"
+#include "io.hpp"
 #include "io_backend.hpp"
 #include "io_raw.hpp"
 #include "log.hpp"
 #include "mkfs.hpp"
+#include "occupancy.hpp"
+#include "recovery.hpp"
+#include "scratch.hpp"
 #include "summary.hpp"
 
 #include <algorithm>
+#include <chrono>
 #include <memory>
+#include <thread>
 
 #include <cstdlib>
 #include <cstring>
@@ -41,6 +52,9 @@
 
 #ifdef _WIN32
 #include <io.h>
+#ifndef S_ISDIR
+#define S_ISDIR(mode) (((mode)&S_IFMT) == S_IFDIR)
+#endif
 #else
 #include <unistd.h>
 #endif
@@ -72,66 +86,182 @@ static bool read_super(fs_context& fs)
     fs.neraseopen = get_be32(sb.s_neraseopen);
     fs.nerasereserve = get_be32(sb.s_nerasereserve);
     fs.nerasewrites = get_be32(sb.s_nerasewrites);
+    fs.seed = get_be32(sb.s_seed);
     return true;
 }
 
 static bool read_eb_usage(fs_context& fs)
 {
-    fs.eb_usage.resize(fs.neraseblocks);
+    std::vector<eraseblock> disk_usage(fs.neraseblocks);
 
     // size of all erase block meta information in bytes
     uint64_t size = fs.neraseblocks * sizeof(eraseblock);
     uint64_t offset = fs.clustersize;
 
-    ssize_t rc = read_raw(*fs.io_ctx, fs.eb_usage.data(), size, offset);
+    ssize_t rc = read_raw(*fs.io_ctx, disk_usage.data(), size, offset);
     if (rc < 0)
     {
         log().critical("reading erase block info failed");
         return false;
     }
     debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+
+    fs.eb_usage.resize(fs.neraseblocks);
+    for (eb_id_t eb_id = 0; eb_id < fs.neraseblocks; ++eb_id)
+    {
+        const eraseblock& disk_eb = disk_usage[eb_id];
+        eraseblock_usage& eb = fs.eb_usage[eb_id];
+        eb.e_type = disk_eb.e_type;
+        eb.e_flags = disk_eb.e_flags;
+        eb.e_lastwrite = get_be16(disk_eb.e_lastwrite);
+        eb.e_cvalid = get_be16(disk_eb.e_cvalid);
+        eb.e_writeops = get_be16(disk_eb.e_writeops);
+    }
+    return true;
+}
+
+static bool read_eb_erase_cnt(fs_context& fs)
+{
+    std::vector<be32_t> disk_erase_cnt(fs.neraseblocks);
+
+    // the erase counts are located right behind the erase block usage
+    uint64_t size = fs.neraseblocks * sizeof(be32_t);
+    uint64_t offset = fs.clustersize + fs.neraseblocks * sizeof(eraseblock);
+
+    ssize_t rc = read_raw(*fs.io_ctx, disk_erase_cnt.data(), size, offset);
+    if (rc < 0)
+    {
+        log().critical("reading erase block erase counts failed");
+        return false;
+    }
+    debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+
+    fs.eb_erase_cnt.resize(fs.neraseblocks);
+    be32_to_cpu_array(fs.eb_erase_cnt.data(), disk_erase_cnt.data(), disk_erase_cnt.size());
     return true;
 }
 
 static bool read_ino_map(fs_context& fs)
 {
-    fs.ino_map.resize(fs.nino);
+    std::vector<be32_t> disk_ino_map(fs.nino);
 
     // size of the array holding the cluster ids in bytes
-    uint64_t size = fs.nino * sizeof(uint32_t);
+    uint64_t size = fs.nino * sizeof(be32_t);
     uint64_t offset = fs.erasesize - size;
 
-    ssize_t rc = read_raw(*fs.io_ctx, fs.ino_map.data(), size, offset);
+    ssize_t rc = read_raw(*fs.io_ctx, disk_ino_map.data(), size, offset);
     if (rc < 0)
     {
         log().critical("reading cluster ids failed");
         return false;
     }
     debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+
+    fs.ino_map.resize(fs.nino);
+    be32_to_cpu_array(fs.ino_map.data(), disk_ino_map.data(), disk_ino_map.size());
     return true;
 }
 
-static bool read_cl_occupancy(fs_context& fs)
+// Inode map entries counted by one thread before another one is started.
+static const unsigned int OCCUPANCY_INO_PER_THREAD{ 64 * 1024 };
+
+static void count_cl_occupancy(const fs_context& fs, unsigned int first, unsigned int last,
+                               cl_occupancy& occupancy)
 {
-    off_t size = io_backend_size(*fs.io_ctx);
-    if (size == -1)
+    // Most of the inode map is usually unused; skip the free entries.
+    const cl_id_t* ino_map = fs.ino_map.data();
+    const uint64_t cl_cnt = uint64_t{ fs.neraseblocks } * (fs.erasesize / fs.clustersize);
+    for (unsigned int i = first; i < last; i++)
     {
-        log().critical("retrieving file size from device failed");
-        return false;
+        i += static_cast<unsigned int>(find_not_u32(ino_map + i, last - i, FFSP_FREE_CL_ID));
+        if (i == last)
+            break;
+        if (ino_map[i] >= cl_cnt)
+        {
+            log().error("ffsp::mount(): inode {} has invalid cluster id {}", i, ino_map[i]);
+            continue;
+        }
+        cl_occupancy_inc(occupancy, ino_map[i]);
     }
+}
 
-    fs.cl_occupancy.resize(size / fs.clustersize);
-    std::fill(fs.cl_occupancy.begin(), fs.cl_occupancy.end(), 0);
+static void read_cl_occupancy(fs_context& fs)
+{
+    fs.cl_occupancy = cl_occupancy_init(fs);
 
-    // Initialize the cluster occupancy array. Check how many inodes
+    // Initialize the cluster occupancy. Check how many inodes
     // are valid in each cluster.
-    for (unsigned int i = 1; i < fs.nino; i++)
+    unsigned int thread_cnt = std::max(1u, std::thread::hardware_concurrency());
+    thread_cnt = std::max(1u, std::min(thread_cnt, fs.nino / OCCUPANCY_INO_PER_THREAD));
+    if (thread_cnt == 1)
     {
-        cl_id_t cl_id = get_be32(fs.ino_map[i]);
-        if (cl_id)
-            fs.cl_occupancy[cl_id]++;
+        count_cl_occupancy(fs, 1, fs.nino, *fs.cl_occupancy);
+        return;
     }
-    return true;
+
+    // Every thread builds a histogram over its part of the inode map. The
+    //  partial counts are merged afterwards, split up by erase block ids.
+    std::vector<std::unique_ptr<cl_occupancy, void (*)(cl_occupancy*)>> partial;
+    for (unsigned int t = 1; t < thread_cnt; ++t)
+        partial.emplace_back(cl_occupancy_init(fs), cl_occupancy_uninit);
+    std::vector<std::thread> threads;
+
+    const unsigned int ino_per_thread = fs.nino / thread_cnt;
+    for (unsigned int t = 0; t < thread_cnt; ++t)
+    {
+        unsigned int first = std::max(1u, t * ino_per_thread);
+        unsigned int last = (t == thread_cnt - 1) ? fs.nino : (t + 1) * ino_per_thread;
+        auto& occupancy = t ? *partial[t - 1] : *fs.cl_occupancy;
+        threads.emplace_back(count_cl_occupancy, std::cref(fs), first, last, std::ref(occupancy));
+    }
+    for (auto& thread : threads)
+        thread.join();
+    threads.clear();
+
+    const eb_id_t eb_per_thread = fs.neraseblocks / thread_cnt;
+    for (unsigned int t = 0; t < thread_cnt; ++t)
+    {
+        eb_id_t first = t * eb_per_thread;
+        eb_id_t last = (t == thread_cnt - 1) ? fs.neraseblocks : (t + 1) * eb_per_thread;
+        threads.emplace_back([&fs, &partial, first, last]() {
+            for (const auto& occupancy : partial)
+                cl_occupancy_merge(*fs.cl_occupancy, *occupancy, first, last);
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+}
+
+/*
+ * The erase block usage, the erase counts and the inode map are independent
+ * areas of the first erase block and are read concurrently.
+ */
+static bool read_super_eraseblk(fs_context& fs)
+{
+    if (!read_super(fs))
+        return false;
+
+#ifdef _WIN32
+    // pread() is emulated by seeking the shared file descriptor.
+    return read_eb_usage(fs) && read_eb_erase_cnt(fs) && read_ino_map(fs);
+#else
+    bool eb_usage_ok = false;
+    bool eb_erase_cnt_ok = false;
+    std::thread eb_usage_thread{ [&fs, &eb_usage_ok]() { eb_usage_ok = read_eb_usage(fs); } };
+    std::thread eb_erase_cnt_thread{ [&fs, &eb_erase_cnt_ok]() { eb_erase_cnt_ok = read_eb_erase_cnt(fs); } };
+    bool ino_map_ok = read_ino_map(fs);
+    eb_usage_thread.join();
+    eb_erase_cnt_thread.join();
+    return eb_usage_ok && eb_erase_cnt_ok && ino_map_ok;
+#endif
+}
+
+static uint64_t elapsed_ms(std::chrono::steady_clock::time_point& start)
+{
+    const auto now = std::chrono::steady_clock::now();
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - start);
+    start = now;
+    return static_cast<uint64_t>(elapsed.count());
 }
 
 fs_context* mount(io_backend* ctx)
@@ -145,17 +275,48 @@ fs_context* mount(io_backend* ctx)
     auto fs = std::make_unique<fs_context>();
     fs->io_ctx = ctx;
 
-    if (   !read_super(*fs)
-        || !read_eb_usage(*fs)
-        || !read_ino_map(*fs))
+    const auto mount_start = std::chrono::steady_clock::now();
+    auto phase_start = mount_start;
+
+    if (!read_super_eraseblk(*fs))
     {
         log().critical("ffsp::mount(): failed to read data from super erase block");
         return nullptr;
     }
+    const uint64_t read_ms = elapsed_ms(phase_start);
+
+    fs->checkpoint = checkpoint_init(*fs);
+    if (!fs->checkpoint || (checkpoint_replay(*fs) < 0))
+    {
+        log().critical("ffsp::mount(): failed to replay meta data journal");
+        checkpoint_uninit(fs->checkpoint);
+        return nullptr;
+    }
+    const uint64_t replay_ms = elapsed_ms(phase_start);
+
+    // Inode clusters written after the last commit are only found by
+    //  scanning the erase blocks if the file system was not unmounted.
+    if (!checkpoint_is_clean(*fs))
+    {
+        log().info("ffsp::mount(): file system was not unmounted cleanly");
+        if (recover(*fs) < 0)
+        {
+            log().critical("ffsp::mount(): failed to recover inodes");
+            checkpoint_uninit(fs->checkpoint);
+            return nullptr;
+        }
+    }
+    close_orphaned_eraseblks(*fs);
+    const uint64_t recover_ms = elapsed_ms(phase_start);
+
+    read_cl_occupancy(*fs);
+    const uint64_t occupancy_ms = elapsed_ms(phase_start);
 
-    if (!read_cl_occupancy(*fs))
+    if (checkpoint_set_clean(*fs, false) < 0)
     {
-        log().critical("ffsp::mount(): failed to read cluster occupancy data");
+        log().critical("ffsp::mount(): failed to mark file system as mounted");
+        cl_occupancy_uninit(fs->cl_occupancy);
+        checkpoint_uninit(fs->checkpoint);
         return nullptr;
     }
 
@@ -167,27 +328,135 @@ fs_context* mount(io_backend* ctx)
     fs->ino_status_map = new uint32_t[ino_bitmask_size / sizeof(uint32_t)];
     memset(fs->ino_status_map, 0, ino_bitmask_size);
 
-    fs->buf = new char[fs->erasesize];
+    fs->scratch = scratch_init(*fs);
 
+    auto total_start = mount_start;
+    log().info("ffsp::mount(): read meta data {} ms, replay {} ms, recovery {} ms, occupancy {} ms, total {} ms",
+               read_ms, replay_ms, recover_ms, occupancy_ms, elapsed_ms(total_start));
     return fs.release();
 }
 
-io_backend* unmount(fs_context* fs)
+static io_backend* release_fs(fs_context* fs)
 {
-    release_inodes(*fs);
-    close_eraseblks(*fs);
-    write_meta_data(*fs);
-
     inode_cache_uninit(fs->inode_cache);
     summary_cache_uninit(fs->summary_cache);
     gcinfo_uninit(fs->gcinfo);
+    checkpoint_uninit(fs->checkpoint);
+    cl_occupancy_uninit(fs->cl_occupancy);
 
     delete[] fs->ino_status_map;
-    delete[] fs->buf;
+    scratch_uninit(fs->scratch);
+    dir_index_uninit(fs->dir_index);
+    delalloc_uninit(fs->delalloc);
 
     io_backend* io_ctx = fs->io_ctx;
     delete fs;
     return io_ctx;
 }
 
+io_backend* unmount(fs_context* fs)
+{
+    committer_uninit(fs->committer);
+    fs->committer = nullptr;
+
+    if (write_back_all(*fs) < 0)
+        log().error("ffsp::unmount(): writing back delayed data failed");
+    release_inodes(*fs);
+    close_eraseblks(*fs);
+    if (checkpoint_write(*fs) == 0)
+        checkpoint_set_clean(*fs, true);
+
+    return release_fs(fs);
+}
+
+io_backend* abandon(fs_context* fs)
+{
+    committer_uninit(fs->committer);
+    fs->committer = nullptr;
+
+    // Drop the cached inodes without writing back the dirty ones.
+    for (const auto& ino : inode_cache_get(*fs->inode_cache))
+    {
+        inode_cache_remove(*fs->inode_cache, ino);
+        delete_inode(ino);
+    }
+    return release_fs(fs);
+}
+
+int preload_inodes(fs_context& fs)
+{
+    auto start = std::chrono::steady_clock::now();
+    const unsigned int cl_per_eb = fs.erasesize / fs.clustersize;
+
+    if (!fs.dir_index)
+        fs.dir_index = dir_index_init(fs);
+
+    // Inode erase blocks are written from their first cluster on, so
+    //  every one of them is read in a single request up to its last
+    //  written cluster.
+    scratch_buf eb_buf{ fs, fs.erasesize };
+    std::vector<inode*> inodes;
+    uint64_t eb_cnt = 0;
+    uint64_t ino_cnt = 0;
+
+    for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; ++eb_id)
+    {
+        const eraseblock_usage& eb = fs.eb_usage[eb_id];
+        if (!is_inode_eraseblk_type(eb.e_type) || !eb.e_cvalid)
+            continue;
+
+        const unsigned int cl_cnt = std::min<unsigned int>(eb.e_writeops, cl_per_eb);
+        ssize_t rc = read_raw(*fs.io_ctx, eb_buf.data(), uint64_t{ cl_cnt } * fs.clustersize,
+                              uint64_t{ eb_id } * fs.erasesize);
+        if (rc < 0)
+        {
+            log().error("ffsp::preload_inodes(): reading erase block {} failed", eb_id);
+            return static_cast<int>(rc);
+        }
+        debug_update(fs, debug_metric::read_raw, static_cast<uint64_t>(rc));
+        ++eb_cnt;
+
+        for (unsigned int i = 0; i < cl_cnt; ++i)
+        {
+            const cl_id_t cl_id = eb_id * cl_per_eb + i;
+            if (!cl_occupancy_get(*fs.cl_occupancy, cl_id))
+                continue;
+
+            inodes.clear();
+            unpack_inode_group(fs, cl_id, eb_buf.data() + uint64_t{ i } * fs.clustersize, inodes);
+            for (const auto& ino : inodes)
+            {
+                if (inode_cache_insert(*fs.inode_cache, ino) != ino)
+                    delete_inode(ino);
+                else
+                    ++ino_cnt;
+            }
+        }
+    }
+
+    // Directories with indirect data still need to read their dentries.
+    const auto dirs = inode_cache_get_if(*fs.inode_cache, [](const inode& ino) {
+        return S_ISDIR(get_be32(ino.i_mode));
+    });
+    std::vector<dentry> dentries;
+    for (const auto& dir : dirs)
+    {
+        int rc = read_dir(fs, *dir, dentries);
+        if (rc < 0)
+        {
+            log().error("ffsp::preload_inodes(): reading directory {} failed", get_be32(dir->i_no));
+            return rc;
+        }
+    }
+
+    uint64_t dir_cnt;
+    uint64_t dentry_bytes;
+    dir_index_usage(*fs.dir_index, dir_cnt, dentry_bytes);
+    log().info("ffsp::preload_inodes(): {} inodes from {} erase blocks and {} directories in {} ms, "
+               "using {} KiB for inodes and {} KiB for dentries",
+               ino_cnt, eb_cnt, dir_cnt, elapsed_ms(start),
+               ino_cnt * fs.clustersize / 1024, dentry_bytes / 1024);
+    return 0;
+}
+
 } // namespace ffsp
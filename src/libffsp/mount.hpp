@@ -31,6 +31,20 @@ struct io_backend;
 fs_context* mount(io_backend* ctx);
 io_backend* unmount(fs_context* fs);
 
+/*
+ * Release the file system context without writing anything back to the
+ * medium. Delayed data, dirty inodes and uncommitted meta data are lost
+ * just as if the system crashed. Used to test crash recovery.
+ */
+io_backend* abandon(fs_context* fs);
+
+/*
+ * Read all inodes of the file system into the inode cache and keep the
+ * dentries of all directories in memory, so that looking up paths does not
+ * have to access the device anymore.
+ */
+int preload_inodes(fs_context& fs);
+
 } // namespace ffsp
 
 #endif /* MOUNT_HPP */
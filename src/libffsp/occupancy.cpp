@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "occupancy.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <vector>
+
+#include <cassert>
+
+namespace ffsp
+{
+
+/*
+ * Up to clustersize / sizeof(inode) inodes fit into one cluster, so 16 bit
+ * counters are enough for clusters of up to 8 MiB. Most erase blocks never
+ * contain inodes; their counters are only allocated on the first increment
+ * and released again when the last valid inode inside the erase block is
+ * gone.
+ */
+using occupancy_t = uint16_t;
+
+struct cl_occupancy
+{
+    explicit cl_occupancy(const fs_context& fs)
+        : cl_per_eb{ fs.erasesize / fs.clustersize }
+        , ebs(fs.neraseblocks)
+    {
+        assert(fs.clustersize / sizeof(inode) <= std::numeric_limits<occupancy_t>::max());
+    }
+
+    const uint32_t cl_per_eb;
+    std::vector<std::unique_ptr<occupancy_t[]>> ebs;
+};
+
+static bool is_valid_cl_id(const cl_occupancy& occ, cl_id_t cl_id)
+{
+    return (cl_id / occ.cl_per_eb) < occ.ebs.size();
+}
+
+cl_occupancy* cl_occupancy_init(const fs_context& fs)
+{
+    return new cl_occupancy{ fs };
+}
+
+void cl_occupancy_uninit(cl_occupancy* occ)
+{
+    delete occ;
+}
+
+static occupancy_t* get_counters(cl_occupancy& occ, eb_id_t eb_id)
+{
+    auto& counters = occ.ebs[eb_id];
+    if (!counters)
+        counters.reset(new occupancy_t[occ.cl_per_eb]());
+    return counters.get();
+}
+
+static void release_if_unused(cl_occupancy& occ, eb_id_t eb_id)
+{
+    auto& counters = occ.ebs[eb_id];
+    if (std::all_of(counters.get(), counters.get() + occ.cl_per_eb,
+                    [](occupancy_t cnt) { return cnt == 0; }))
+        counters.reset();
+}
+
+unsigned int cl_occupancy_get(const cl_occupancy& occ, cl_id_t cl_id)
+{
+    if (!is_valid_cl_id(occ, cl_id))
+        return 0;
+
+    const auto& counters = occ.ebs[cl_id / occ.cl_per_eb];
+    return counters ? counters[cl_id % occ.cl_per_eb] : 0;
+}
+
+void cl_occupancy_inc(cl_occupancy& occ, cl_id_t cl_id)
+{
+    if (!is_valid_cl_id(occ, cl_id))
+        return;
+
+    get_counters(occ, cl_id / occ.cl_per_eb)[cl_id % occ.cl_per_eb]++;
+}
+
+unsigned int cl_occupancy_dec(cl_occupancy& occ, cl_id_t cl_id)
+{
+    const eb_id_t eb_id = cl_id / occ.cl_per_eb;
+    assert(occ.ebs[eb_id] && occ.ebs[eb_id][cl_id % occ.cl_per_eb]);
+
+    unsigned int cnt = --occ.ebs[eb_id][cl_id % occ.cl_per_eb];
+    if (!cnt)
+        release_if_unused(occ, eb_id);
+    return cnt;
+}
+
+void cl_occupancy_move(cl_occupancy& occ, cl_id_t src_cl_id, cl_id_t dest_cl_id)
+{
+    const eb_id_t src_eb_id = src_cl_id / occ.cl_per_eb;
+    unsigned int cnt = cl_occupancy_get(occ, src_cl_id);
+    if (!cnt)
+        return;
+
+    get_counters(occ, dest_cl_id / occ.cl_per_eb)[dest_cl_id % occ.cl_per_eb] += cnt;
+    occ.ebs[src_eb_id][src_cl_id % occ.cl_per_eb] = 0;
+    release_if_unused(occ, src_eb_id);
+}
+
+void cl_occupancy_merge(cl_occupancy& dest, const cl_occupancy& src, eb_id_t first, eb_id_t last)
+{
+    for (eb_id_t eb_id = first; eb_id < last; ++eb_id)
+    {
+        const auto& src_counters = src.ebs[eb_id];
+        if (!src_counters)
+            continue;
+
+        occupancy_t* dest_counters = get_counters(dest, eb_id);
+        for (uint32_t i = 0; i < dest.cl_per_eb; ++i)
+            dest_counters[i] += src_counters[i];
+    }
+}
+
+} // namespace ffsp
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef OCCUPANCY_HPP
+#define OCCUPANCY_HPP
+
+#include "ffsp.hpp"
+
+namespace ffsp
+{
+
+// Number of valid inodes inside every cluster of the file system.
+// Only erase blocks that actually contain clusters with valid inodes
+//  have counters allocated.
+struct cl_occupancy;
+
+cl_occupancy* cl_occupancy_init(const fs_context& fs);
+void cl_occupancy_uninit(cl_occupancy* occ);
+
+unsigned int cl_occupancy_get(const cl_occupancy& occ, cl_id_t cl_id);
+void cl_occupancy_inc(cl_occupancy& occ, cl_id_t cl_id);
+// Returns the number of valid inodes that are left inside the cluster.
+unsigned int cl_occupancy_dec(cl_occupancy& occ, cl_id_t cl_id);
+void cl_occupancy_move(cl_occupancy& occ, cl_id_t src_cl_id, cl_id_t dest_cl_id);
+
+// Add the counters of the erase blocks [first, last) of 'src' to 'dest'.
+void cl_occupancy_merge(cl_occupancy& dest, const cl_occupancy& src, eb_id_t first, eb_id_t last);
+
+} // namespace ffsp
+
+#endif /* OCCUPANCY_HPP */
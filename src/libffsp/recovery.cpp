@@ -0,0 +1,478 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "recovery.hpp"
+#include "checkpoint.hpp"
+#include "debug.hpp"
+#include "eraseblk.hpp"
+#include "extent.hpp"
+#include "inode.hpp"
+#include "io_raw.hpp"
+#include "log.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <map>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#ifndef S_ISDIR
+#include <io.h>
+#define S_ISDIR(mode) (((mode)&S_IFMT) == S_IFDIR)
+#endif
+#endif
+
+namespace ffsp
+{
+
+/*
+ * If the file system was not unmounted cleanly, the inode clusters written
+ * after the last commit of the meta data are not referenced by the inode map.
+ * Every inode carries the write sequence number of the cluster it was
+ * written with, so those clusters can be told apart from stale ones by
+ * comparing against the durable sequence number:
+ *  - All erase blocks that held inodes or were empty in the durable state
+ *    are scanned in parallel, each one up to its first cluster that does
+ *    not contain newer inodes. Every inode carries a checksum seeded with
+ *    the file system's random seed and its cluster id, so file data that
+ *    looks like inodes is never taken for them.
+ *  - The found clusters are applied in write order, making the inode map
+ *    point to the latest version of every inode.
+ *  - Indirect clusters and erase blocks referenced by the recovered inodes
+ *    are marked as used, and the valid cluster counts of the inode erase
+ *    blocks are recalculated.
+ */
+
+struct scan_eraseblk
+{
+    eb_id_t eb_id;
+    unsigned int first_cl; // cluster index inside the erase block
+};
+
+struct recovered_cluster
+{
+    cl_id_t cl_id;
+    uint64_t wseq;
+    std::vector<char> data;
+};
+
+struct scan_worker
+{
+    std::vector<recovered_cluster> found;
+    uint64_t read_bytes{ 0 };
+    int rc{ 0 };
+};
+
+static bool is_inode_data_type(inode_data_type type)
+{
+    return    (type == inode_data_type::emb)
+           || (type == inode_data_type::clin)
+           || (type == inode_data_type::ebin)
+           || (type == inode_data_type::extent)
+           || (type == inode_data_type::dclin);
+}
+
+/*
+ * Return the write sequence number of the inodes inside the given cluster
+ * if they were written after 'durable_wseq' or zero otherwise.
+ */
+static uint64_t get_cluster_wseq(const fs_context& fs, cl_id_t cl_id, const char* cl_buf, uint64_t durable_wseq)
+{
+    uint64_t wseq = 0;
+    uint64_t offset = 0;
+
+    while ((offset + sizeof(inode)) <= fs.clustersize)
+    {
+        const auto* ino = reinterpret_cast<const inode*>(cl_buf + offset);
+        ino_t ino_no = get_be32(ino->i_no);
+
+        // The unused rest of an inode cluster is zeroed.
+        if (ino_no == FFSP_INVALID_INO_NO)
+            break;
+
+        auto data_type = static_cast<inode_data_type>(get_be32(ino->i_flags) & 0xff);
+        if ((ino_no >= fs.nino) || !is_inode_data_type(data_type))
+            return 0;
+
+        uint64_t ino_size = get_inode_size(fs, *ino);
+        if (ino_size > (fs.clustersize - offset))
+            return 0;
+
+        if (get_be32(ino->i_csum) != get_inode_checksum(fs, cl_id, *ino))
+            return 0;
+
+        // All inodes of a cluster were written with the same sequence number.
+        uint64_t ino_wseq = get_be64(ino->i_wseq);
+        if ((ino_wseq <= durable_wseq) || (wseq && (ino_wseq != wseq)))
+            return 0;
+
+        wseq = ino_wseq;
+        offset += ino_size;
+    }
+    return wseq;
+}
+
+static void scan_eraseblks(const fs_context& fs, const std::vector<scan_eraseblk>& ebs,
+                           std::atomic<size_t>& next, uint64_t durable_wseq, scan_worker& worker)
+{
+    const unsigned int cl_per_eb = fs.erasesize / fs.clustersize;
+    std::vector<char> buf(fs.erasesize);
+
+    for (size_t i = next++; i < ebs.size(); i = next++)
+    {
+        const unsigned int first_cl = ebs[i].first_cl;
+        const cl_id_t first_cl_id = ebs[i].eb_id * cl_per_eb + first_cl;
+
+        // Most erase blocks do not contain any newer inodes; only their
+        //  first cluster is read. If it does, the rest of the erase
+        //  block is read at once.
+        for (unsigned int cl = first_cl, read_cl = first_cl; cl < cl_per_eb; ++cl)
+        {
+            if (cl == read_cl)
+            {
+                const unsigned int read_cnt = (cl == first_cl) ? 1 : (cl_per_eb - cl);
+                ssize_t rc = read_raw(*fs.io_ctx, buf.data() + uint64_t{ cl - first_cl } * fs.clustersize,
+                                      uint64_t{ read_cnt } * fs.clustersize,
+                                      uint64_t{ first_cl_id + (cl - first_cl) } * fs.clustersize);
+                if (rc < 0)
+                {
+                    worker.rc = static_cast<int>(rc);
+                    return;
+                }
+                worker.read_bytes += static_cast<uint64_t>(rc);
+                read_cl += read_cnt;
+            }
+
+            const char* cl_buf = buf.data() + uint64_t{ cl - first_cl } * fs.clustersize;
+            const cl_id_t cl_id = first_cl_id + (cl - first_cl);
+
+            // Inode clusters are written sequentially; the first one that
+            //  is not newer than the durable state ends the erase block.
+            uint64_t wseq = get_cluster_wseq(fs, cl_id, cl_buf, durable_wseq);
+            if (!wseq)
+                break;
+            worker.found.push_back({ cl_id, wseq, std::vector<char>(cl_buf, cl_buf + fs.clustersize) });
+        }
+    }
+}
+
+static std::vector<scan_eraseblk> get_scan_eraseblks(const fs_context& fs)
+{
+    const unsigned int max_writeops = fs.erasesize / fs.clustersize;
+    std::vector<scan_eraseblk> ebs;
+
+    // erase block id "0" is reserved for the super erase block
+    for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; ++eb_id)
+    {
+        const eraseblock_usage& eb = fs.eb_usage[eb_id];
+
+        // Inodes are only written into inode erase blocks or into empty
+        //  ones that are opened as such. Erase blocks holding file data
+        //  or the meta data journal in the durable state are skipped;
+        //  if one was freed and reused for inodes after the last commit,
+        //  those inodes are lost like any other uncommitted change.
+        if (!is_inode_eraseblk_type(eb.e_type) && (eb.e_type != eraseblock_type::empty))
+            continue;
+
+        // Open inode erase blocks were continued behind their last durable
+        //  write operation. Every other erase block might have been freed
+        //  and reused since, which is checked by its first cluster.
+        unsigned int writeops = eb.e_writeops;
+        if (is_inode_eraseblk_type(eb.e_type) && (writeops < max_writeops))
+            ebs.push_back({ eb_id, writeops });
+        else
+            ebs.push_back({ eb_id, 0 });
+    }
+    return ebs;
+}
+
+static void eb_reopen(fs_context& fs, eb_id_t eb_id, eraseblock_type eb_type)
+{
+    eraseblock_usage& eb = fs.eb_usage[eb_id];
+
+    // The erase block had to be erased before it was written again.
+    fs.eb_erase_cnt[eb_id] = eb_get_erase_cnt(fs, eb_id) + 1;
+
+    eb.e_type = eb_type;
+    eb.e_lastwrite = 0;
+    eb.e_cvalid = 0;
+    eb.e_writeops = 0;
+}
+
+static void recover_clin_cluster(fs_context& fs, const std::vector<eraseblock_usage>& durable_usage,
+                                 eraseblock_type clin_type, cl_id_t cl_id)
+{
+    const unsigned int cl_per_eb = fs.erasesize / fs.clustersize;
+    eb_id_t eb_id = cl_id / cl_per_eb;
+    unsigned int cl_idx = cl_id % cl_per_eb;
+
+    if (!cl_id || (eb_id >= fs.neraseblocks))
+        return; // File hole or garbage
+
+    // Clusters below the durable write operations count are already
+    //  accounted for in the erase block's valid cluster count.
+    const eraseblock_usage& durable = durable_usage[eb_id];
+    if ((durable.e_type == clin_type) && (cl_idx < durable.e_writeops))
+        return;
+
+    if (fs.eb_usage[eb_id].e_type != clin_type)
+        eb_reopen(fs, eb_id, clin_type);
+
+    // The summary of the erase block got lost; it must not be
+    //  continued and is closed right away.
+    eb_inc_cvalid(fs, eb_id);
+    fs.eb_usage[eb_id].e_writeops = cl_per_eb;
+}
+
+static void recover_clin(fs_context& fs, const std::vector<eraseblock_usage>& durable_usage, const inode& ino)
+{
+    const bool dentry = S_ISDIR(get_be32(ino.i_mode));
+    const eraseblock_type clin_type = get_eraseblk_type(fs, inode_data_type::clin, dentry);
+
+    uint64_t i_size = get_be64(ino.i_size);
+    uint64_t ptr_cnt = i_size ? ((i_size - 1) / fs.clustersize + 1) : 0;
+    const auto* ind_ptr = static_cast<const be32_t*>(inode_data(ino));
+
+    for (uint64_t i = 0; i < ptr_cnt; ++i)
+        recover_clin_cluster(fs, durable_usage, clin_type, get_be32(ind_ptr[i]));
+}
+
+static void recover_dclin(fs_context& fs, const std::vector<eraseblock_usage>& durable_usage, const inode& ino)
+{
+    const bool dentry = S_ISDIR(get_be32(ino.i_mode));
+    const eraseblock_type clin_type = get_eraseblk_type(fs, inode_data_type::clin, dentry);
+
+    uint64_t i_size = get_be64(ino.i_size);
+    uint64_t ptr_cnt = i_size ? ((i_size - 1) / dclin_ptr_size(fs) + 1) : 0;
+    const auto* ind_ptr = static_cast<const be32_t*>(inode_data(ino));
+
+    std::vector<char> ptr_buf(fs.clustersize);
+    const auto* ptrs = reinterpret_cast<const be32_t*>(ptr_buf.data());
+
+    for (uint64_t i = 0; i < ptr_cnt; ++i)
+    {
+        cl_id_t ptr_cl_id = get_be32(ind_ptr[i]);
+        if (!ptr_cl_id || (ptr_cl_id / (fs.erasesize / fs.clustersize) >= fs.neraseblocks))
+            continue; // File hole or garbage
+
+        // Pointer clusters and data clusters are both stored like
+        //  cluster indirect data.
+        recover_clin_cluster(fs, durable_usage, clin_type, ptr_cl_id);
+
+        if (read_raw(*fs.io_ctx, ptr_buf.data(), fs.clustersize, uint64_t{ ptr_cl_id } * fs.clustersize) < 0)
+        {
+            log().error("Failed to read pointer cluster {} of inode {}", ptr_cl_id, get_be32(ino.i_no));
+            continue;
+        }
+        for (uint32_t j = 0; j < fs.clustersize / sizeof(be32_t); ++j)
+            recover_clin_cluster(fs, durable_usage, clin_type, get_be32(ptrs[j]));
+    }
+}
+
+static void recover_ebin(fs_context& fs, const inode& ino)
+{
+    uint64_t i_size = get_be64(ino.i_size);
+    uint64_t ptr_cnt = i_size ? ((i_size - 1) / fs.erasesize + 1) : 0;
+    const auto* ind_ptr = static_cast<const be32_t*>(inode_data(ino));
+
+    for (uint64_t i = 0; i < ptr_cnt; ++i)
+    {
+        eb_id_t eb_id = get_be32(ind_ptr[i]);
+
+        if (!eb_id || (eb_id >= fs.neraseblocks))
+            continue; // File hole or garbage
+
+        if (fs.eb_usage[eb_id].e_type != eraseblock_type::ebin)
+            eb_reopen(fs, eb_id, eraseblock_type::ebin);
+    }
+}
+
+static void recover_extent(fs_context& fs, const std::vector<eraseblock_usage>& durable_usage, const inode& ino)
+{
+    std::vector<extent_run> runs;
+    std::vector<cl_id_t> nodes;
+    if (extent_collect(fs, ino, runs, &nodes) < 0)
+    {
+        log().error("Failed to read the extents of inode {}", get_be32(ino.i_no));
+        return;
+    }
+
+    // The tree nodes are stored like cluster indirect data...
+    const bool dentry = S_ISDIR(get_be32(ino.i_mode));
+    const eraseblock_type clin_type = get_eraseblk_type(fs, inode_data_type::clin, dentry);
+    for (cl_id_t cl_id : nodes)
+        recover_clin_cluster(fs, durable_usage, clin_type, cl_id);
+
+    // ...and the data like erase block indirect data.
+    for (const auto& run : runs)
+    {
+        for (uint32_t i = 0; i < run.len; ++i)
+        {
+            eb_id_t eb_id = run.start + i;
+            if (!eb_id || (eb_id >= fs.neraseblocks))
+                continue; // Garbage
+
+            if (fs.eb_usage[eb_id].e_type != eraseblock_type::ebin)
+                eb_reopen(fs, eb_id, eraseblock_type::ebin);
+        }
+    }
+}
+
+static void apply_clusters(fs_context& fs, std::vector<recovered_cluster>& found)
+{
+    const unsigned int cl_per_eb = fs.erasesize / fs.clustersize;
+    const std::vector<eraseblock_usage> durable_usage{ fs.eb_usage };
+
+    std::sort(found.begin(), found.end(), [](const recovered_cluster& lhs, const recovered_cluster& rhs) {
+        return lhs.wseq < rhs.wseq;
+    });
+
+    // Latest recovered version of every inode
+    std::map<ino_t, const inode*> latest;
+
+    for (const auto& rc : found)
+    {
+        eb_id_t eb_id = rc.cl_id / cl_per_eb;
+        unsigned int cl_idx = rc.cl_id % cl_per_eb;
+        const auto* first = reinterpret_cast<const inode*>(rc.data.data());
+
+        // An erase block written from its start was empty or got freed
+        //  and reused after the last commit.
+        if (cl_idx == 0)
+        {
+            bool dentry = S_ISDIR(get_be32(first->i_mode));
+            eb_reopen(fs, eb_id, get_eraseblk_type(fs, inode_data_type::emb, dentry));
+        }
+        fs.eb_usage[eb_id].e_writeops = cl_idx + 1;
+
+        uint64_t offset = 0;
+        while ((offset + sizeof(inode)) <= fs.clustersize)
+        {
+            const auto* ino = reinterpret_cast<const inode*>(rc.data.data() + offset);
+            ino_t ino_no = get_be32(ino->i_no);
+            if (ino_no == FFSP_INVALID_INO_NO)
+                break;
+
+            checkpoint_set_ino_map(fs, ino_no, rc.cl_id);
+            latest[ino_no] = ino;
+            offset += get_inode_size(fs, *ino);
+        }
+        fs.wseq = std::max(fs.wseq, rc.wseq);
+    }
+
+    for (const auto& entry : latest)
+    {
+        const inode& ino = *entry.second;
+        auto data_type = static_cast<inode_data_type>(get_be32(ino.i_flags) & 0xff);
+
+        if (data_type == inode_data_type::clin)
+            recover_clin(fs, durable_usage, ino);
+        else if (data_type == inode_data_type::ebin)
+            recover_ebin(fs, ino);
+        else if (data_type == inode_data_type::extent)
+            recover_extent(fs, durable_usage, ino);
+        else if (data_type == inode_data_type::dclin)
+            recover_dclin(fs, durable_usage, ino);
+    }
+}
+
+static void recount_inode_cvalid(fs_context& fs)
+{
+    const unsigned int cl_per_eb = fs.erasesize / fs.clustersize;
+    std::vector<bool> cl_used(static_cast<size_t>(fs.neraseblocks) * cl_per_eb, false);
+
+    for (ino_t ino_no = 1; ino_no < fs.nino; ++ino_no)
+    {
+        cl_id_t cl_id = fs.ino_map[ino_no];
+        if (cl_id && (cl_id < cl_used.size()))
+            cl_used[cl_id] = true;
+    }
+
+    for (eb_id_t eb_id = 1; eb_id < fs.neraseblocks; ++eb_id)
+    {
+        if (!is_inode_eraseblk_type(fs.eb_usage[eb_id].e_type))
+            continue;
+
+        auto first = cl_used.begin() + eb_id * cl_per_eb;
+        auto cvalid = std::count(first, first + cl_per_eb, true);
+        fs.eb_usage[eb_id].e_cvalid = static_cast<uint16_t>(cvalid);
+    }
+}
+
+int recover(fs_context& fs)
+{
+    const auto start = std::chrono::steady_clock::now();
+    const uint64_t durable_wseq = fs.wseq;
+    const std::vector<scan_eraseblk> ebs = get_scan_eraseblks(fs);
+
+#ifdef _WIN32
+    // pread() is emulated by seeking the shared file descriptor.
+    unsigned int thread_cnt = 1;
+#else
+    unsigned int thread_cnt = std::max(1u, std::thread::hardware_concurrency());
+#endif
+    thread_cnt = std::max(1u, std::min(thread_cnt, static_cast<unsigned int>(ebs.size())));
+
+    std::vector<scan_worker> workers(thread_cnt);
+    std::vector<std::thread> threads;
+    std::atomic<size_t> next{ 0 };
+
+    for (unsigned int i = 1; i < thread_cnt; ++i)
+        threads.emplace_back(scan_eraseblks, std::cref(fs), std::cref(ebs), std::ref(next),
+                             durable_wseq, std::ref(workers[i]));
+    scan_eraseblks(fs, ebs, next, durable_wseq, workers[0]);
+    for (auto& thread : threads)
+        thread.join();
+
+    std::vector<recovered_cluster> found;
+    for (auto& worker : workers)
+    {
+        debug_update(fs, debug_metric::read_raw, worker.read_bytes);
+        if (worker.rc < 0)
+        {
+            log().critical("ffsp::recover(): scanning erase blocks failed");
+            return worker.rc;
+        }
+        std::move(worker.found.begin(), worker.found.end(), std::back_inserter(found));
+    }
+
+    if (!found.empty())
+    {
+        apply_clusters(fs, found);
+        recount_inode_cvalid(fs);
+
+        int rc = checkpoint_commit(fs);
+        if (rc < 0)
+            return rc;
+    }
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    log().info("ffsp::recover(): {} inode clusters recovered from {} erase blocks using {} threads in {} ms",
+               found.size(), ebs.size(), thread_cnt, elapsed.count());
+    return 0;
+}
+
+} // namespace ffsp
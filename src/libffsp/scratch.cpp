@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "scratch.hpp"
+
+#include <mutex>
+#include <vector>
+
+#include <cassert>
+
+namespace ffsp
+{
+
+struct scratch_pool
+{
+    explicit scratch_pool(const fs_context& fs)
+        : clustersize{ fs.clustersize }
+        , erasesize{ fs.erasesize }
+    {
+    }
+
+    ~scratch_pool()
+    {
+        for (const auto& buf : free_cl)
+            delete[] buf;
+        for (const auto& buf : free_eb)
+            delete[] buf;
+    }
+
+    const uint64_t clustersize;
+    const uint64_t erasesize;
+
+    // Buffers of returned leases, ready to be handed out again.
+    std::mutex lock;
+    std::vector<char*> free_cl;
+    std::vector<char*> free_eb;
+};
+
+scratch_pool* scratch_init(const fs_context& fs)
+{
+    return new scratch_pool{ fs };
+}
+
+void scratch_uninit(scratch_pool* pool)
+{
+    delete pool;
+}
+
+scratch_buf::scratch_buf(const fs_context& fs, uint64_t size)
+    : pool{ *fs.scratch }
+    , eraseblk_sized{ size > fs.clustersize }
+    , buf{ nullptr }
+{
+    assert(size <= fs.erasesize);
+
+    {
+        std::lock_guard<std::mutex> guard{ pool.lock };
+        auto& free_bufs = eraseblk_sized ? pool.free_eb : pool.free_cl;
+        if (!free_bufs.empty())
+        {
+            buf = free_bufs.back();
+            free_bufs.pop_back();
+        }
+    }
+
+    if (!buf)
+        buf = new char[eraseblk_sized ? pool.erasesize : pool.clustersize];
+}
+
+scratch_buf::~scratch_buf()
+{
+    std::lock_guard<std::mutex> guard{ pool.lock };
+    auto& free_bufs = eraseblk_sized ? pool.free_eb : pool.free_cl;
+    free_bufs.push_back(buf);
+}
+
+} // namespace ffsp
@@ -0,0 +1,56 @@
+/*
+ * Copyright (C) 2011-2012 IBM Corporation
+ *
+ * Author: Volker Schneider <volker.schneider@gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef SCRATCH_HPP
+#define SCRATCH_HPP
+
+#include "ffsp.hpp"
+
+namespace ffsp
+{
+
+struct scratch_pool;
+
+scratch_pool* scratch_init(const fs_context& fs);
+void scratch_uninit(scratch_pool* pool);
+
+// Lease of a temporary buffer from the file system's scratch pool. Buffers
+//  are either one cluster or one erase block large, depending on the
+//  requested size, and go back into the pool when the lease ends.
+// Every operation leases its own buffers, so nested and concurrent
+//  operations never share a buffer.
+struct scratch_buf
+{
+    scratch_buf(const fs_context& fs, uint64_t size);
+    ~scratch_buf();
+
+    scratch_buf(const scratch_buf&) = delete;
+    scratch_buf& operator=(const scratch_buf&) = delete;
+
+    char* data() const { return buf; }
+
+    scratch_pool& pool;
+    bool eraseblk_sized;
+    char* buf;
+};
+
+} // namespace ffsp
+
+#endif /* SCRATCH_HPP */
@@ -36,4 +36,16 @@ bool update_time(timespec& dest)
     return true;
 }
 
+uint32_t checksum(const void* buf, size_t size, uint32_t hash)
+{
+    // FNV-1a
+    const auto* bytes = static_cast<const unsigned char*>(buf);
+    for (size_t i = 0; i < size; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
 } // namespace ffsp
@@ -28,6 +28,10 @@ namespace ffsp
 
 bool update_time(timespec& dest);
 
+// FNV-1a hash of the buffer. Pass the result of a previous call as 'hash'
+//  to continue hashing across several buffers.
+uint32_t checksum(const void* buf, size_t size, uint32_t hash = 2166136261u);
+
 } // namespace ffsp
 
 #endif /* UTILS_HPP */
@@ -41,6 +41,7 @@ struct ffsp_mkfs_arguments
     uint32_t neraseopen{ 0 };
     uint32_t nerasereserve{ 0 };
     uint32_t nerasewrites{ 0 };
+    uint32_t flags{ 0 };
 };
 
 // std::ostream& operator<<(std::ostream& os, const ffsp_mkfs_arguments& args)
@@ -59,8 +60,8 @@ struct ffsp_mkfs_arguments
 template <>
 struct fmt::formatter<ffsp_mkfs_arguments> : fmt::formatter<std::string> {
     auto format(const ffsp_mkfs_arguments& args, format_context &ctx) const -> decltype(ctx.out()) {
-        return fmt::format_to(ctx.out(), "{{device={}, clustersize={}, erasesize={}, ninoopen={}, neraseopen={}, nerasereserve={}, nerasewrites={}}}",
-            args.device, args.clustersize, args.erasesize, args.ninoopen, args.neraseopen, args.nerasereserve, args.nerasewrites);
+        return fmt::format_to(ctx.out(), "{{device={}, clustersize={}, erasesize={}, ninoopen={}, neraseopen={}, nerasereserve={}, nerasewrites={}, flags={}}}",
+            args.device, args.clustersize, args.erasesize, args.ninoopen, args.neraseopen, args.nerasereserve, args.nerasewrites, args.flags);
     }
 };
 
@@ -72,8 +73,10 @@ static void show_usage(const char* progname)
            "  -e, --erasesize=N       Use a eraseblock size of N bytes (default:4MiB)\n\n"
            "  -i, --open-ino=N        Support caching of N dirty inodes at a time (default:128)\n"
            "  -o, --open-eb=N         Support N open erase blocks at a time (default:5)\n"
+           "                          (6: cold inode stream for GC, 7: cold dentry/file inode streams)\n"
            "  -r, --reserve-eb=N      Reserve N erase blocks for internal use (default:3)\n"
            "  -w, --write-eb=N        Perform garbage collection after N erase blocks have been written (default:5)\n"
+           "  -d, --double-indirect   Store large files in double indirect clusters instead of whole erase blocks\n"
            "\n"
            "  -h, --help              Display this help message and exit\n",
            progname);
@@ -89,6 +92,7 @@ static bool parse_arguments(int argc, char** argv, ffsp_mkfs_arguments& args)
           { "open-eb", required_argument, nullptr, 'o' },
           { "reserve-eb", required_argument, nullptr, 'r' },
           { "write-eb", required_argument, nullptr, 'w' },
+          { "double-indirect", no_argument, nullptr, 'd' },
           { "help", no_argument, nullptr, 'h' },
           { 0, 0, 0, 0 },
         };
@@ -109,7 +113,7 @@ static bool parse_arguments(int argc, char** argv, ffsp_mkfs_arguments& args)
     while (true)
     {
         int opt_idx;
-        int c = getopt_long(argc, argv, "c:e:i:o:r:w:h", long_options, &opt_idx);
+        int c = getopt_long(argc, argv, "c:e:i:o:r:w:dh", long_options, &opt_idx);
         if (c == -1)
             break;
 
@@ -133,6 +137,9 @@ static bool parse_arguments(int argc, char** argv, ffsp_mkfs_arguments& args)
             case 'w':
                 args.nerasewrites = static_cast<uint32_t>(std::stoul(optarg));
                 break;
+            case 'd':
+                args.flags |= ffsp::FFSP_SUPER_DCLIN;
+                break;
             case 'h':
                 show_usage(argv[0]);
                 exit(EXIT_SUCCESS);
@@ -165,7 +172,7 @@ int main(int argc, char* argv[])
 
     auto ret = EXIT_SUCCESS;
     auto* io_ctx = ffsp::io_backend_init(args.device);
-    if (!io_ctx || !ffsp::mkfs(*io_ctx, { args.clustersize, args.erasesize, args.ninoopen, args.neraseopen, args.nerasereserve, args.nerasewrites }))
+    if (!io_ctx || !ffsp::mkfs(*io_ctx, { args.clustersize, args.erasesize, args.ninoopen, args.neraseopen, args.nerasereserve, args.nerasewrites, args.flags }))
     {
         perror("failed to setup file system");
         ret = EXIT_FAILURE;
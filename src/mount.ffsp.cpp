@@ -25,7 +25,9 @@
 #include "libffsp-fuse/fuse_ffsp_log.hpp"
 
 #include <atomic>
+#include <chrono>
 #include <string>
+#include <type_traits>
 
 #include <cstddef>
 
@@ -327,7 +329,16 @@ struct fuse_ffsp_operations
         ops_.write_buf = nullptr;
         ops_.read_buf = nullptr;
         ops_.flock = nullptr;
-        ops_.fallocate = nullptr;
+        ops_.fallocate = [](const char* path, int mode, FUSE_OFF_T offset,
+                            FUSE_OFF_T length, fuse_file_info* fi) {
+            auto id = ++op_id_;
+            auto& log = get_log();
+            auto& fs = get_fs(fuse_get_context());
+            log.trace("> {} fallocate(path={}, mode={:#x}, offset={}, length={}, fi={})", id, path, mode, offset, length, log_ptr(fi));
+            int rc = ffsp::fuse::fallocate(fs, path, mode, offset, length, fi);
+            log.trace("< {} fallocate(rc={})", id, rc);
+            return rc;
+        };
 #endif
 
 #ifdef _WIN32
@@ -367,6 +378,9 @@ static void show_usage(const char* progname)
 {
     printf("Usage: %s DEVICE MOUNTPOINT\n"
            "      --logfile=FILE    Log file\n"
+           "      --preload-inodes  Read all inodes and dentries into memory at mount time\n"
+           "      --delalloc        Keep written file data in memory until the file is released\n"
+           "      --commit=N        Write back changed inodes after at most N seconds (default:5, 0:no background commits)\n"
            "\n"
            "      --memonly         Utilize memory buffer as device\n"
            "      --memsize         Size of the memory buffer in bytes\n"
@@ -376,6 +390,7 @@ static void show_usage(const char* progname)
            "  -e, --erasesize=N     Use a eraseblock size of N bytes (default:4MiB)\n"
            "  -i, --open-ino=N      Support caching of N dirty inodes at a time (default:128)\n"
            "  -o, --open-eb=N       Support N open erase blocks at a time (default:5)\n"
+           "                        (6: cold inode stream for GC, 7: cold dentry/file inode streams)\n"
            "  -r, --reserve-eb=N    Reserve N erase blocks for internal use (default:3)\n"
            "  -w, --write-eb=N      Perform garbage collection after N erase blocks have been written (default:5)\n"
            "\n"
@@ -396,17 +411,22 @@ static void show_version(const char* progname)
            ffsp::FFSP_VERSION_PATCH);
 }
 
+// fuse_opt_parse() stores the value of flag options through an int
+//  pointer; all flags parsed through ffsp_opt must be declared as int.
 struct ffsp_mount_arguments
 {
     int verbosity{ 0 };
     char* logfile{ nullptr };
+    int preload_inodes{ 0 };
+    int delalloc{ 0 };
+    uint32_t commit_interval{ static_cast<uint32_t>(ffsp::FFSP_COMMIT_INTERVAL.count()) };
 
     std::string device;
 
-    bool in_memory{ false };
+    int in_memory{ 0 };
     size_t memsize{ 0 };
 
-    bool format{ false };
+    int format{ 0 };
     uint32_t clustersize{ 1024 * 32 };
     uint32_t erasesize{ 1024 * 1024 * 4 };
     uint32_t ninoopen{ 128 };
@@ -433,21 +453,36 @@ enum
         t, offsetof(ffsp_mount_arguments, p), v \
     }
 
+// Flag options must refer to int fields; anything smaller is overwritten
+//  together with its neighbours.
+template <typename T>
+constexpr int flag_value(int v)
+{
+    static_assert(std::is_same<T, int>::value, "fuse_opt flags are stored as int");
+    return v;
+}
+
+#define FFSP_MOUNT_FLAG(t, p, v) \
+    FFSP_MOUNT_OPT(t, p, flag_value<decltype(ffsp_mount_arguments::p)>(v))
+
 static fuse_opt ffsp_opt[] = {
-    FFSP_MOUNT_OPT("-v", verbosity, 1),
-    FFSP_MOUNT_OPT("-vv", verbosity, 2),
-    FFSP_MOUNT_OPT("-vvv", verbosity, 3),
-    FFSP_MOUNT_OPT("-vvvv", verbosity, 4),
+    FFSP_MOUNT_FLAG("-v", verbosity, 1),
+    FFSP_MOUNT_FLAG("-vv", verbosity, 2),
+    FFSP_MOUNT_FLAG("-vvv", verbosity, 3),
+    FFSP_MOUNT_FLAG("-vvvv", verbosity, 4),
     FFSP_MOUNT_OPT("--logfile=%s", logfile, 0),
+    FFSP_MOUNT_FLAG("--preload-inodes", preload_inodes, 1),
+    FFSP_MOUNT_FLAG("--delalloc", delalloc, 1),
+    FFSP_MOUNT_OPT("--commit=%u", commit_interval, 0),
 
-    FFSP_MOUNT_OPT("--memonly", in_memory, 1),
+    FFSP_MOUNT_FLAG("--memonly", in_memory, 1),
 #ifdef _WIN32
     FFSP_MOUNT_OPT("--memsize=%Iu", memsize, 0),
 #else
     FFSP_MOUNT_OPT("--memsize=%zd", memsize, 0),
 #endif
 
-    FFSP_MOUNT_OPT("--format", format, 1),
+    FFSP_MOUNT_FLAG("--format", format, 1),
     FFSP_MOUNT_OPT("--clustersize=%u", clustersize, 0),
     FFSP_MOUNT_OPT("--erasesize=%u", erasesize, 0),
     FFSP_MOUNT_OPT("--open-ino=%u", ninoopen, 0),
@@ -556,6 +591,10 @@ int main(int argc, char* argv[])
                                           mntargs.nerasereserve, mntargs.nerasewrites });
     }
 
+    ffsp::fuse::set_preload_inodes(mntargs.preload_inodes);
+    ffsp::fuse::set_delalloc(mntargs.delalloc);
+    ffsp::fuse::set_commit_interval(std::chrono::seconds{ mntargs.commit_interval });
+
     if (fuse_opt_add_arg(&args, "-odefault_permissions") == -1)
     {
         fprintf(stderr, "fuse_opt_add_arg(-odefault_permissions) failed!\n");
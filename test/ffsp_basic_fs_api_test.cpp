@@ -1,6 +1,11 @@
 #include "gtest/gtest.h"
 
+#include "libffsp/checkpoint.hpp"
 #include "libffsp/debug.hpp"
+#include "libffsp/delalloc.hpp"
+#include "libffsp/eraseblk.hpp"
+#include "libffsp/gc.hpp"
+#include "libffsp/inode.hpp"
 #include "libffsp/io_backend.hpp"
 #include "libffsp/io_raw.hpp"
 #include "libffsp/log.hpp"
@@ -10,8 +15,13 @@
 
 #include "ffsp_test_utils.hpp"
 
+#include <algorithm>
+#include <chrono>
 #include <cmath>
 #include <cstring>
+#include <set>
+#include <shared_mutex>
+#include <thread>
 
 class SingleMountFileSystemOperationsApiTest : public testing::Test
 {
@@ -86,6 +96,66 @@ TEST_F(SingleMountFileSystemOperationsApiTest, GrowFile)
     ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
 }
 
+TEST_F(SingleMountFileSystemOperationsApiTest, ExtendFileWithZeros)
+{
+    fuse_file_info fi = {};
+    const auto path = "/file_extended";
+
+    const uint64_t cl_size = 32 * 1024;
+    const uint64_t tail_size = 100;
+    const auto& data = ffsp::test::file_content(4 * cl_size);
+    const std::vector<char> zeros(cl_size);
+    std::vector<char> read_buf(2 * cl_size);
+
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(4 * cl_size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), 4 * cl_size, 0, &fi));
+
+    // A zero-filled cluster becomes a file hole, a partially written
+    //  cluster must not carry over stale data behind the end of the file.
+    ASSERT_EQ(int(tail_size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), tail_size, 5 * cl_size, &fi));
+    ASSERT_EQ(int(cl_size), ffsp::fuse::write(*fs_, path, zeros.data(), cl_size, 4 * cl_size, &fi));
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, 6 * cl_size));
+
+    ASSERT_EQ(int(2 * cl_size), ffsp::fuse::read(*fs_, path, read_buf.data(), 2 * cl_size, 4 * cl_size, &fi));
+    ASSERT_EQ(0, std::memcmp(zeros.data(), read_buf.data(), cl_size));
+    ASSERT_EQ(0, std::memcmp(data.data(), read_buf.data() + cl_size, tail_size));
+    ASSERT_EQ(0, std::memcmp(zeros.data(), read_buf.data() + cl_size + tail_size, cl_size - tail_size));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+}
+
+TEST_F(SingleMountFileSystemOperationsApiTest, ConcurrentFilesReadWrite)
+{
+    const auto thread_cnt = 4;
+    const auto file_cnt = 32;
+
+    const auto read_write_files = [this](int thread_no) {
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const uint64_t size = i * 1024;
+            const auto path = "/file_" + std::to_string(thread_no) + "_" + std::to_string(i);
+
+            fuse_file_info fi = {};
+            const auto& write_buf = ffsp::test::file_content(size);
+            std::vector<char> read_buf(size);
+
+            EXPECT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+            EXPECT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+            EXPECT_EQ(int(size), ffsp::fuse::write(*fs_, path.c_str(), (const char*)write_buf.data(), size, 0, &fi));
+            EXPECT_EQ(int(size), ffsp::fuse::read(*fs_, path.c_str(), read_buf.data(), size, 0, &fi));
+            EXPECT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+
+            EXPECT_EQ(0, std::memcmp(write_buf.data(), read_buf.data(), size));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < thread_cnt; i++)
+        threads.emplace_back(read_write_files, i);
+    for (auto& thread : threads)
+        thread.join();
+}
+
 class MultiMountFileSystemOperationsApiTest : public testing::Test
 {
 protected:
@@ -146,3 +216,1324 @@ TEST_F(MultiMountFileSystemOperationsApiTest, FilesReadWrite)
     }
     ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
 }
+
+TEST_F(MultiMountFileSystemOperationsApiTest, ConcurrentReaders)
+{
+    const auto thread_cnt = 4;
+    const auto file_cnt = 64;
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < file_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        const auto& write_buf = ffsp::test::file_content(i * 1024);
+        fuse_file_info fi = {};
+
+        ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+        ASSERT_EQ(int(write_buf.size()), ffsp::fuse::write(*fs_, path.c_str(), (const char*)write_buf.data(), write_buf.size(), 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    // All threads look up the same inodes on a cold inode cache.
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    const auto read_files = [this]() {
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const auto path = "/file_" + std::to_string(i);
+            const auto& expected_buf = ffsp::test::file_content(i * 1024);
+            std::vector<char> read_buf(expected_buf.size());
+            struct ::stat stbuf;
+
+            EXPECT_EQ(0, ffsp::fuse::getattr(*fs_, path.c_str(), &stbuf));
+            EXPECT_EQ(off_t(expected_buf.size()), stbuf.st_size);
+            EXPECT_EQ(int(read_buf.size()), ffsp::fuse::read(*fs_, path.c_str(), read_buf.data(), read_buf.size(), 0, nullptr));
+            EXPECT_EQ(0, std::memcmp(expected_buf.data(), read_buf.data(), read_buf.size()));
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (auto i = 0; i < thread_cnt; i++)
+        threads.emplace_back(read_files);
+    for (auto& thread : threads)
+        thread.join();
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, PreloadInodes)
+{
+    const auto dir_cnt = 4;
+    const auto file_cnt = 64;
+
+    const auto count_dentries = [this](const char* path) {
+        int cnt = 0;
+        fuse_fill_dir_t filler = [](void* buf, const char*, const struct stat*, FUSE_OFF_T) {
+            ++*static_cast<int*>(buf);
+            return 0;
+        };
+        EXPECT_EQ(0, ffsp::fuse::readdir(*fs_, path, &cnt, filler, 0, nullptr));
+        return cnt;
+    };
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto d = 0; d < dir_cnt; d++)
+    {
+        const auto dir = "/dir_" + std::to_string(d);
+        ASSERT_EQ(0, ffsp::fuse::mkdir(*fs_, dir.c_str(), S_IFDIR));
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const auto path = dir + "/file_" + std::to_string(i);
+            ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+        }
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::preload_inodes(*fs_));
+
+    // Looking up preloaded paths must not access the device anymore.
+    const auto read_raw_before = ffsp::test::read_metric(*fs_, "read_raw");
+    for (auto d = 0; d < dir_cnt; d++)
+    {
+        const auto dir = "/dir_" + std::to_string(d);
+        ASSERT_EQ(file_cnt + 2, count_dentries(dir.c_str()));
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const auto path = dir + "/file_" + std::to_string(i);
+            struct ::stat stbuf;
+            ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, path.c_str(), &stbuf));
+        }
+        struct ::stat stbuf;
+        ASSERT_EQ(-ENOENT, ffsp::fuse::getattr(*fs_, (dir + "/missing").c_str(), &stbuf));
+    }
+    ASSERT_EQ(read_raw_before, ffsp::test::read_metric(*fs_, "read_raw"));
+
+    // Changed directories are not served from stale dentries.
+    struct ::stat stbuf;
+    ASSERT_EQ(0, ffsp::fuse::unlink(*fs_, "/dir_0/file_0"));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/dir_1/file_new", S_IFREG, 0));
+    ASSERT_EQ(-ENOENT, ffsp::fuse::getattr(*fs_, "/dir_0/file_0", &stbuf));
+    ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, "/dir_1/file_new", &stbuf));
+    ASSERT_EQ(file_cnt + 1, count_dentries("/dir_0"));
+    ASSERT_EQ(file_cnt + 3, count_dentries("/dir_1"));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, GrowClinFileIntoEbin)
+{
+    // Small clusters let cluster indirect files grow into erase block
+    //  indirect ones at about 4 MiB.
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_clin2ebin";
+    const uint64_t old_size = 1024 * 1024 * 7 / 2;
+    const uint64_t offset = 1024 * 1024 * 3;
+    const uint64_t nbyte = 1024 * 1024 * 2;
+    const uint64_t eb_cnt = 5;
+
+
+    fuse_file_info fi = {};
+    const auto& data = ffsp::test::file_content(offset + nbyte);
+    std::vector<char> expected(data.begin(), data.begin() + old_size);
+    expected.resize(offset + nbyte);
+    std::copy(data.begin(), data.begin() + nbyte, expected.begin() + offset);
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(old_size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), old_size, 0, &fi));
+
+    // The part of the request that overlaps the old content is written
+    //  during the conversion and not a second time afterwards.
+    const auto write_raw_before = ffsp::test::read_metric(*fs_, "write_raw");
+    ASSERT_EQ(int(nbyte), ffsp::fuse::write(*fs_, path, (const char*)data.data(), nbyte, offset, &fi));
+    ASSERT_GT(write_raw_before + eb_cnt * opts.erasesize + opts.erasesize / 4, ffsp::test::read_metric(*fs_, "write_raw"));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    std::vector<char> read_buf(expected.size());
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(read_buf.size()), ffsp::fuse::read(*fs_, path, read_buf.data(), read_buf.size(), 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+    ASSERT_EQ(0, std::memcmp(expected.data(), read_buf.data(), expected.size()));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, RewriteEbinFile)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    // Rewriting the file writes twice the size of the file system. That
+    //  only works if the replaced erase blocks are set free again.
+    const auto path = "/file_rewrite";
+    const uint64_t size = 1024 * 1024 * 8;
+    const int rewrites = 32;
+
+    fuse_file_info fi = {};
+    const auto& data = ffsp::test::file_content(size);
+    std::vector<char> read_buf(size);
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    for (int i = 0; i < rewrites; ++i)
+        ASSERT_EQ(int(size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), size, 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(size), ffsp::fuse::read(*fs_, path, read_buf.data(), size, 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_EQ(0, std::memcmp(data.data(), read_buf.data(), size));
+
+    struct ::statvfs sfs;
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs));
+    ASSERT_LE(ffsp::test::default_fs_size / 2 / opts.clustersize, sfs.f_bfree);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, OverwriteEbinFileClusters)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_overwrite";
+    const uint64_t size = 1024 * 1024 * 6;
+    const auto& data = ffsp::test::file_content(size);
+    std::vector<char> expected(data.begin(), data.end());
+
+    fuse_file_info fi = {};
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), size, 0, &fi));
+    ffsp::inode* ino = nullptr;
+    ASSERT_EQ(0, ffsp::lookup(*fs_, &ino, path));
+    ASSERT_TRUE(get_be32(ino->i_flags) & static_cast<uint32_t>(ffsp::inode_data_type::ebin));
+
+    // Only the clusters covered by the request are rewritten inside the
+    //  existing erase block, with a single write. The partially covered
+    //  clusters at the head and the tail are read first.
+    const auto overwrite = [&](uint64_t offset, uint64_t len, uint64_t partial_cl_cnt) {
+        const uint64_t cl_first = offset / opts.clustersize;
+        const uint64_t cl_last = (offset + len - 1) / opts.clustersize;
+        const auto read_raw_before = ffsp::test::read_metric(*fs_, "read_raw");
+        const auto write_raw_before = ffsp::test::read_metric(*fs_, "write_raw");
+
+        ASSERT_EQ(int(len), ffsp::fuse::write(*fs_, path, (const char*)data.data(), len, offset, &fi));
+        std::copy(data.begin(), data.begin() + len, expected.begin() + offset);
+
+        ASSERT_EQ(read_raw_before + partial_cl_cnt * opts.clustersize, ffsp::test::read_metric(*fs_, "read_raw"));
+        ASSERT_EQ(write_raw_before + (cl_last - cl_first + 1) * opts.clustersize, ffsp::test::read_metric(*fs_, "write_raw"));
+    };
+    overwrite(opts.erasesize + 2 * opts.clustersize, 5 * opts.clustersize + 1234, 1);
+    overwrite(2 * opts.erasesize + 1000, 5 * opts.clustersize + 1234, 2);
+    overwrite(3 * opts.erasesize + 1000, 1234, 1);
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, PreallocateEbinFile)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_fallocate";
+    const uint64_t size = 1024 * 1024 * 8;
+    const uint64_t offset = 1024 * 1024 * 3 + 77;
+    const uint64_t nbyte = 1024 * 1024 + 1000;
+
+    const auto& data = ffsp::test::file_content(nbyte);
+    std::vector<char> expected(size);
+    std::copy(data.begin(), data.end(), expected.begin() + offset);
+    std::vector<char> read_buf(size);
+
+    fuse_file_info fi = {};
+    struct ::statvfs sfs_empty;
+    struct ::statvfs sfs_reserved;
+    struct ::statvfs sfs_written;
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(-EOPNOTSUPP, ffsp::fuse::fallocate(*fs_, path, 1, 0, size, &fi));
+
+    // The erase blocks are taken right away but read as zeros.
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs_empty));
+    ASSERT_EQ(0, ffsp::fuse::fallocate(*fs_, path, 0, 0, size, &fi));
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs_reserved));
+    ASSERT_LE(sfs_reserved.f_bfree + size / opts.clustersize, sfs_empty.f_bfree);
+    ASSERT_EQ(int(size), ffsp::fuse::read(*fs_, path, read_buf.data(), size, 0, &fi));
+    ASSERT_TRUE(std::all_of(read_buf.begin(), read_buf.end(), [](char c) { return c == 0; }));
+
+    // Writing into them does not take any further erase blocks.
+    ASSERT_EQ(int(nbyte), ffsp::fuse::write(*fs_, path, (const char*)data.data(), nbyte, offset, &fi));
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs_written));
+    ASSERT_LE(sfs_reserved.f_bfree, sfs_written.f_bfree + 4);
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(size), ffsp::fuse::read(*fs_, path, read_buf.data(), size, 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_EQ(0, std::memcmp(expected.data(), read_buf.data(), size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, DelayedAllocation)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_delalloc";
+    const auto tmp_path = "/file_delalloc_tmp";
+    const uint64_t size = 1024 * 1024 * 6;
+    const uint64_t chunk = 1000;
+
+    const auto write_chunked = [this, chunk](const char* p, const std::vector<unsigned char>& d, fuse_file_info* fi) {
+        for (uint64_t off = 0; off < d.size(); off += chunk)
+        {
+            const uint64_t n = std::min(chunk, d.size() - off);
+            if (ffsp::fuse::write(*fs_, p, (const char*)d.data() + off, n, off, fi) != int(n))
+                return false;
+        }
+        return true;
+    };
+
+    fuse_file_info fi = {};
+    const auto& data = ffsp::test::file_content(size);
+    std::vector<char> read_buf(size);
+
+    ffsp::fuse::set_delalloc(true);
+    const bool mounted = ffsp::test::fuse_mount_fs(io_, &fs_);
+    ffsp::fuse::set_delalloc(false);
+    ASSERT_TRUE(mounted);
+    ASSERT_NE(nullptr, fs_->delalloc);
+
+    // Small sequential writes stay in memory and are readable right away.
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    auto write_raw_before = ffsp::test::read_metric(*fs_, "write_raw");
+    ASSERT_TRUE(write_chunked(path, data, &fi));
+    ASSERT_GT(write_raw_before + opts.erasesize, ffsp::test::read_metric(*fs_, "write_raw"));
+    ASSERT_EQ(int(size), ffsp::fuse::read(*fs_, path, read_buf.data(), size, 0, &fi));
+    ASSERT_EQ(0, std::memcmp(data.data(), read_buf.data(), size));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_LE(write_raw_before + size, ffsp::test::read_metric(*fs_, "write_raw"));
+
+    // The data of a file that is removed before it is written back never
+    //  reaches the medium. (unlink() drops the inode of the open file.)
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, tmp_path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, tmp_path, &fi));
+    write_raw_before = ffsp::test::read_metric(*fs_, "write_raw");
+    ASSERT_TRUE(write_chunked(tmp_path, data, &fi));
+    ASSERT_EQ(0, ffsp::fuse::unlink(*fs_, tmp_path));
+    ASSERT_GT(write_raw_before + opts.erasesize, ffsp::test::read_metric(*fs_, "write_raw"));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(size), ffsp::fuse::read(*fs_, path, read_buf.data(), size, 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_EQ(0, std::memcmp(data.data(), read_buf.data(), size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, CommitDelayedFileSize)
+{
+    ASSERT_TRUE(ffsp::test::make_fs(io_, ffsp::test::small_mkfs_options));
+
+    const auto path = "/file_delalloc";
+    const uint64_t size = 1024 * 64;
+    const auto& data = ffsp::test::file_content(size);
+    const std::vector<char> expected(data.begin(), data.end());
+    fuse_file_info fi = {};
+
+    ffsp::fuse::set_delalloc(true);
+    const bool mounted = ffsp::test::fuse_mount_fs(io_, &fs_);
+    ffsp::fuse::set_delalloc(false);
+    ASSERT_TRUE(mounted);
+
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(size), ffsp::fuse::write(*fs_, path, expected.data(), size, 0, &fi));
+    ffsp::inode* ino;
+    ASSERT_EQ(0, ffsp::lookup(*fs_, &ino, path));
+    const ffsp::ino_t ino_no = get_be32(ino->i_no);
+    ASSERT_TRUE(ffsp::delalloc_pending(*fs_->delalloc, ino_no));
+
+    // Committing the grown file places its delayed data first.
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    ASSERT_FALSE(ffsp::delalloc_pending(*fs_->delalloc, ino_no));
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, GrowEbinFileIntoExtents)
+{
+    // Small clusters limit erase block indirect files to 14 MiB.
+    const ffsp::mkfs_options opts{ 1024, 1024 * 64, 128, 5, 3, 5 };
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_extent";
+    const uint64_t size = 1024 * 1024 * 20;
+    const uint64_t eb_size = opts.erasesize;
+
+    // Only every other erase block contains data so the file needs more
+    //  extents than fit into the inode.
+    const auto& data = ffsp::test::file_content(size);
+    std::vector<char> expected(size);
+    for (uint64_t offset = 0; offset < size; offset += 2 * eb_size)
+        std::copy(data.begin() + offset, data.begin() + offset + eb_size, expected.begin() + offset);
+    const uint64_t partial_off = size - eb_size * 3 / 2 - 1000;
+    const uint64_t partial_len = size - partial_off;
+    std::copy(data.begin(), data.begin() + partial_len, expected.begin() + partial_off);
+
+    fuse_file_info fi = {};
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    for (uint64_t offset = 0; offset < size; offset += 2 * eb_size)
+        ASSERT_EQ(int(eb_size), ffsp::fuse::write(*fs_, path, expected.data() + offset, eb_size, offset, &fi));
+    ASSERT_EQ(int(partial_len), ffsp::fuse::write(*fs_, path, (const char*)data.data(), partial_len, partial_off, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+
+    // Shrink the extents, then back into an erase block indirect file
+    //  and grow it into extents again.
+    const uint64_t extent_size = size - eb_size * 40 - 123;
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, extent_size));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, extent_size));
+    const uint64_t ebin_size = 1024 * 1024 * 5;
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, ebin_size));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, ebin_size));
+    std::fill(expected.begin() + ebin_size, expected.end(), 0);
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+
+    struct ::statvfs sfs_before;
+    struct ::statvfs sfs_after;
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs_before));
+    ASSERT_EQ(0, ffsp::fuse::unlink(*fs_, path));
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs_after));
+    ASSERT_LE(sfs_before.f_bfree + ebin_size / 2 / opts.clustersize, sfs_after.f_bfree);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, KeepInodeOfDirtyFileUntilCommit)
+{
+    const ffsp::mkfs_options opts{ 1024, 1024 * 64, 128, 5, 3, 5 };
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file";
+    const auto& data = ffsp::test::file_content(opts.clustersize * 2);
+    const std::vector<char> expected(data.begin(), data.end());
+
+    fuse_file_info fi = {};
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(expected.size()), ffsp::fuse::write(*fs_, path, expected.data(), expected.size(), 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    // Make erase blocks that are freed from now on the least worn ones.
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (ffsp::eb_id_t eb_id = 1; eb_id < fs_->neraseblocks; eb_id++)
+    {
+        if (fs_->eb_usage[eb_id].e_type == ffsp::eraseblock_type::empty)
+            fs_->eb_erase_cnt[eb_id] = 100;
+    }
+
+    // The dirty inode is not written yet; the committed inode map still
+    //  points to its old cluster. Its erase block must not be reused.
+    ASSERT_EQ(0, ffsp::fuse::chmod(*fs_, path, S_IFREG | 0644));
+    const std::vector<char> other(opts.erasesize, 'x');
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file_other", S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, "/file_other", &fi));
+    for (uint64_t offset = 0; offset < opts.erasesize * 3; offset += opts.erasesize)
+        ASSERT_EQ(int(other.size()), ffsp::fuse::write(*fs_, "/file_other", other.data(), other.size(), offset, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, "/file_other", &fi));
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, expected.size()));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, ReuseTruncatedExtentsAfterCommit)
+{
+    const ffsp::mkfs_options opts{ 1024, 1024 * 64, 128, 5, 3, 5 };
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_extent";
+    const uint64_t size = 1024 * 1024 * 20;
+    // Too few erase blocks are dropped to force a commit on their own.
+    const uint64_t trunc_size = size - opts.erasesize * (opts.nerasewrites - 2);
+    const auto& data = ffsp::test::file_content(size);
+    std::vector<char> expected(data.begin(), data.end());
+
+    fuse_file_info fi = {};
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), size, 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    // The committed inode still maps the truncated erase blocks. Data
+    //  written before the next commit must not end up in them.
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, trunc_size));
+    // Make the dropped erase blocks the least worn ones.
+    for (ffsp::eb_id_t eb_id = 1; eb_id < fs_->neraseblocks; eb_id++)
+    {
+        if (fs_->eb_usage[eb_id].e_type == ffsp::eraseblock_type::empty)
+            fs_->eb_erase_cnt[eb_id] = 100;
+    }
+    const std::vector<char> other(size - trunc_size, 'x');
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file_other", S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, "/file_other", &fi));
+    ASSERT_EQ(int(other.size()), ffsp::fuse::write(*fs_, "/file_other", other.data(), other.size(), 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, "/file_other", &fi));
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, GrowClinFileIntoDoubleIndirect)
+{
+    // Cluster indirect files end at 224 KiB with these small clusters.
+    //  Double indirection lifts that limit to 56 MiB.
+    const ffsp::mkfs_options opts{ 1024, 1024 * 64, 128, 5, 3, 5, ffsp::FFSP_SUPER_DCLIN };
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_dclin";
+    const uint64_t clin_size = 1024 * 100;
+    const uint64_t size = 1024 * 1024 * 3;
+    const uint64_t patch_off = 1024 * 1024 * 2 + 4321;
+    const uint64_t patch_len = 100;
+
+
+    const auto& data = ffsp::test::file_content(size);
+    std::vector<char> expected(data.begin(), data.end());
+    std::copy(data.begin(), data.begin() + patch_len, expected.begin() + patch_off);
+
+    fuse_file_info fi = {};
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(clin_size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), clin_size, 0, &fi));
+    ASSERT_EQ(int(size - clin_size), ffsp::fuse::write(*fs_, path, (const char*)data.data() + clin_size, size - clin_size, clin_size, &fi));
+
+    // A small rewrite only replaces a data cluster and its pointer
+    //  cluster instead of a whole erase block.
+    const auto write_raw_before = ffsp::test::read_metric(*fs_, "write_raw");
+    ASSERT_EQ(int(patch_len), ffsp::fuse::write(*fs_, path, (const char*)data.data(), patch_len, patch_off, &fi));
+    ASSERT_GT(write_raw_before + opts.erasesize / 4, ffsp::test::read_metric(*fs_, "write_raw"));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+
+    // Shrink the file, then back into a cluster indirect one and grow it
+    //  into a double indirect one again.
+    const uint64_t dclin_size = 1024 * 1024 * 3 / 2 + 123;
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, dclin_size));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, dclin_size));
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, clin_size));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, clin_size));
+    std::fill(expected.begin() + clin_size, expected.end(), 0);
+    ASSERT_EQ(0, ffsp::fuse::truncate(*fs_, path, size));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, size));
+
+    struct ::statvfs sfs_before;
+    struct ::statvfs sfs_after;
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs_before));
+    ASSERT_EQ(0, ffsp::fuse::unlink(*fs_, path));
+    ASSERT_EQ(0, ffsp::fuse::statfs(*fs_, "/", &sfs_after));
+    ASSERT_LE(sfs_before.f_bfree + clin_size / opts.clustersize, sfs_after.f_bfree);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, ManyInodes)
+{
+    // Enough inodes to span multiple clusters of the inode map, with
+    //  directories small enough to keep their dentries embedded.
+    const auto dir_cnt = 70;
+    const auto file_cnt = 120;
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto d = 0; d < dir_cnt; d++)
+    {
+        const auto dir = "/dir_" + std::to_string(d);
+        ASSERT_EQ(0, ffsp::fuse::mkdir(*fs_, dir.c_str(), S_IFDIR));
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const auto path = dir + "/file_" + std::to_string(i);
+            ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+        }
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto d = 0; d < dir_cnt; d++)
+    {
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const auto path = "/dir_" + std::to_string(d) + "/file_" + std::to_string(i);
+            struct ::stat stbuf;
+            ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, path.c_str(), &stbuf));
+        }
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, TrackDirtyInodes)
+{
+    const auto dir_cnt = 2;
+    const auto file_cnt = 3;
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    std::set<ffsp::ino_t> dirs{ 1 }; // the root directory
+    std::set<ffsp::ino_t> files;
+    for (auto d = 0; d < dir_cnt; d++)
+    {
+        const auto dir = "/dir_" + std::to_string(d);
+        struct ::stat stbuf;
+        ASSERT_EQ(0, ffsp::fuse::mkdir(*fs_, dir.c_str(), S_IFDIR));
+        ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, dir.c_str(), &stbuf));
+        dirs.insert(stbuf.st_ino);
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const auto path = dir + "/file_" + std::to_string(i);
+            ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+            ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, path.c_str(), &stbuf));
+            files.insert(stbuf.st_ino);
+        }
+    }
+    ASSERT_EQ(dirs, fs_->dirty_dentries);
+    ASSERT_EQ(files, fs_->dirty_files);
+    ASSERT_EQ(dirs.size() + files.size(), fs_->dirty_ino_cnt);
+
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    ASSERT_TRUE(fs_->dirty_dentries.empty());
+    ASSERT_TRUE(fs_->dirty_files.empty());
+    ASSERT_EQ(0u, fs_->dirty_ino_cnt);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, CommitIdleFileSystem)
+{
+    // Mount through the FUSE entry point which starts the committer.
+    ffsp::fuse::set_options(ffsp::test::default_fs_size, ffsp::test::default_mkfs_options);
+    ffsp::fuse::set_commit_interval(std::chrono::milliseconds{ 200 });
+    fs_ = static_cast<ffsp::fs_context*>(ffsp::fuse::init(nullptr));
+    ffsp::fuse::set_commit_interval(ffsp::FFSP_COMMIT_INTERVAL);
+    ASSERT_NE(nullptr, fs_);
+
+    // No further operation comes along after the change, the dirty inodes
+    //  are still written back once the interval expired.
+    const auto commit_gen = fs_->commit_gen.load();
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file", S_IFREG, 0));
+    for (auto i = 0; (i < 100) && (fs_->commit_gen == commit_gen); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+    ASSERT_LT(commit_gen, fs_->commit_gen);
+    {
+        std::shared_lock<std::shared_mutex> lock{ fs_->lock };
+        ASSERT_EQ(0u, fs_->dirty_ino_cnt);
+    }
+    ffsp::fuse::destroy(fs_);
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, CommitWithDelayedAllocation)
+{
+    // Each mount option is applied on its own; delayed allocation does not
+    //  affect the committer.
+    const std::chrono::milliseconds interval{ 7000 };
+    ffsp::fuse::set_options(ffsp::test::default_fs_size, ffsp::test::default_mkfs_options);
+    ffsp::fuse::set_preload_inodes(true);
+    ffsp::fuse::set_delalloc(true);
+    ffsp::fuse::set_commit_interval(interval);
+    fs_ = static_cast<ffsp::fs_context*>(ffsp::fuse::init(nullptr));
+    ffsp::fuse::set_preload_inodes(false);
+    ffsp::fuse::set_delalloc(false);
+    ffsp::fuse::set_commit_interval(ffsp::FFSP_COMMIT_INTERVAL);
+    ASSERT_NE(nullptr, fs_);
+
+    ASSERT_NE(nullptr, fs_->dir_index);
+    ASSERT_NE(nullptr, fs_->delalloc);
+    ASSERT_NE(nullptr, fs_->committer);
+    ASSERT_EQ(interval, fs_->commit_interval);
+    ffsp::fuse::destroy(fs_);
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, RetryFailedCommitAfterInterval)
+{
+    const std::chrono::milliseconds interval{ 100 };
+    ffsp::fuse::set_options(ffsp::test::default_fs_size, ffsp::test::default_mkfs_options);
+    ffsp::fuse::set_commit_interval(interval);
+    fs_ = static_cast<ffsp::fs_context*>(ffsp::fuse::init(nullptr));
+    ffsp::fuse::set_commit_interval(ffsp::FFSP_COMMIT_INTERVAL);
+    ASSERT_NE(nullptr, fs_);
+
+    // Without empty erase blocks there is no room for the new file inode
+    //  and every commit fails.
+    std::vector<ffsp::eb_id_t> hidden;
+    {
+        std::unique_lock<std::shared_mutex> lock{ fs_->lock };
+        for (ffsp::eb_id_t eb_id = 1; eb_id < fs_->neraseblocks; eb_id++)
+        {
+            if (fs_->eb_usage[eb_id].e_type != ffsp::eraseblock_type::empty)
+                continue;
+            fs_->eb_usage[eb_id].e_type = ffsp::eraseblock_type::ebin;
+            hidden.push_back(eb_id);
+        }
+    }
+    const auto commit_errors = ffsp::test::read_metric(*fs_, "commit_errors");
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file", S_IFREG, 0));
+
+    // The failed commit is retried once per interval, not continuously.
+    std::this_thread::sleep_for(interval * 6);
+    const auto errors = ffsp::test::read_metric(*fs_, "commit_errors") - commit_errors;
+    ASSERT_LE(2u, errors);
+    ASSERT_GE(7u, errors);
+
+    const auto commit_gen = fs_->commit_gen.load();
+    {
+        std::unique_lock<std::shared_mutex> lock{ fs_->lock };
+        for (const auto eb_id : hidden)
+            fs_->eb_usage[eb_id].e_type = ffsp::eraseblock_type::empty;
+    }
+    for (auto i = 0; (i < 100) && (fs_->commit_gen == commit_gen); i++)
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 50 });
+    ASSERT_LT(commit_gen, fs_->commit_gen);
+    ffsp::fuse::destroy(fs_);
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, PackInodeClusters)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    // No two of the large inodes fit into the same cluster. The empty
+    //  files created after them fill the remaining space of those clusters
+    //  instead of taking up clusters of their own.
+    const auto large_cnt = 8;
+    const auto empty_cnt = 16;
+    const auto& data = ffsp::test::file_content(opts.clustersize / 2 + 1);
+
+    std::vector<std::string> paths;
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < large_cnt + empty_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+        if (i < large_cnt)
+        {
+            fuse_file_info fi = {};
+            ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+            ASSERT_EQ(int(data.size()), ffsp::fuse::write(*fs_, path.c_str(), (const char*)data.data(), data.size(), 0, &fi));
+            ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+        }
+        paths.push_back(path);
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    std::set<ffsp::cl_id_t> clusters;
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (const auto& path : paths)
+    {
+        struct ::stat stbuf;
+        ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, path.c_str(), &stbuf));
+        clusters.insert(fs_->ino_map[stbuf.st_ino]);
+    }
+    ASSERT_EQ(size_t(large_cnt), clusters.size());
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, GarbageCollectColdInodes)
+{
+    // small erase blocks and an early gc trigger so that rewriting a few
+    //  small files keeps the garbage collector busy relocating inodes
+    const ffsp::mkfs_options opts{ 1024 * 4,  // cluster
+                                   1024 * 64, // eraseblock
+                                   8,         // open inodes
+                                   7,         // open eraseblocks
+                                   3,         // reserved eraseblocks
+                                   2 };       // gc trigger
+    const auto file_cnt = 64;
+    const auto rewrite_cnt = 32;
+
+    ffsp::io_backend_uninit(io_);
+    io_ = ffsp::io_backend_init(1024 * 1024 * 16);
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto round = 0; round < rewrite_cnt; round++)
+    {
+        for (auto i = 0; i < file_cnt; i++)
+        {
+            const auto path = "/file_" + std::to_string(i);
+            const auto& write_buf = ffsp::test::file_content(i + round);
+            fuse_file_info fi = {};
+
+            if (round == 0)
+            {
+                ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+            }
+
+            ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+            ASSERT_EQ(int(write_buf.size()), ffsp::fuse::write(*fs_, path.c_str(), (const char*)write_buf.data(), write_buf.size(), 0, &fi));
+            ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+        }
+    }
+
+    auto cold_eb_cnt = 0;
+    for (const auto& eb : fs_->eb_usage)
+    {
+        if (eb.e_type == ffsp::eraseblock_type::dentry_inode_cold ||
+            eb.e_type == ffsp::eraseblock_type::file_inode_cold)
+            cold_eb_cnt++;
+    }
+    ASSERT_LT(0, cold_eb_cnt);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < file_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        const auto& expected_buf = ffsp::test::file_content(i + rewrite_cnt - 1);
+        std::vector<char> read_buf(expected_buf.size());
+        fuse_file_info fi = {};
+
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+        ASSERT_EQ(int(read_buf.size()), ffsp::fuse::read(*fs_, path.c_str(), read_buf.data(), read_buf.size(), 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+
+        ASSERT_EQ(0, std::memcmp(expected_buf.data(), read_buf.data(), read_buf.size()));
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, KeepEraseCountsAcrossRemount)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    // Every rewrite of the ebin file replaces its erase blocks, so the
+    //  erase blocks of the device are erased more than once.
+    const auto path = "/file_ebin";
+    const uint64_t size = 4 * opts.erasesize;
+    const auto& data = ffsp::test::file_content(size);
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    const auto rewrite_cnt = fs_->neraseblocks / 2;
+    for (auto round = 0u; round < rewrite_cnt; round++)
+    {
+        fuse_file_info fi = {};
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+        ASSERT_EQ(int(size), ffsp::fuse::write(*fs_, path, (const char*)data.data(), size, 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    }
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+
+    const auto erase_cnt = fs_->eb_erase_cnt;
+    ASSERT_LT(1u, *std::max_element(erase_cnt.begin(), erase_cnt.end()));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    // The journal erase block is erased by the checkpoint at unmount.
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (ffsp::eb_id_t eb_id = 1; eb_id < fs_->neraseblocks; eb_id++)
+    {
+        if (fs_->eb_usage[eb_id].e_type == ffsp::eraseblock_type::super)
+            continue;
+        ASSERT_EQ(erase_cnt[eb_id], fs_->eb_erase_cnt[eb_id]);
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, OpenLeastErasedEraseblock)
+{
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+
+    ffsp::eb_id_t expected_eb_id = ffsp::FFSP_INVALID_EB_ID;
+    for (ffsp::eb_id_t eb_id = 1; eb_id < fs_->neraseblocks; eb_id++)
+    {
+        if (fs_->eb_usage[eb_id].e_type != ffsp::eraseblock_type::empty)
+            continue;
+        fs_->eb_erase_cnt[eb_id] = 10;
+        expected_eb_id = eb_id;
+    }
+    ASSERT_NE(ffsp::FFSP_INVALID_EB_ID, expected_eb_id);
+    fs_->eb_erase_cnt[expected_eb_id] = 3;
+    ASSERT_EQ(expected_eb_id, ffsp::find_empty_eraseblk(*fs_));
+
+    // The next erase block that is opened for new data is the least erased.
+    const auto path = "/file";
+    const auto& data = ffsp::test::file_content(ffsp::test::default_mkfs_options.erasesize);
+    fuse_file_info fi = {};
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(data.size()), ffsp::fuse::write(*fs_, path, (const char*)data.data(), data.size(), 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, path, &fi));
+    ASSERT_NE(ffsp::eraseblock_type::empty, fs_->eb_usage[expected_eb_id].e_type);
+    ASSERT_EQ(4u, fs_->eb_erase_cnt[expected_eb_id]);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, LevelWearOfStaticInodes)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    // Every inode takes up a cluster of its own so that the inodes fill
+    //  at least one erase block that is never written again.
+    const auto file_cnt = 300;
+    const auto& data = ffsp::test::file_content(3000);
+    const std::vector<char> expected(data.begin(), data.end());
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < file_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        fuse_file_info fi = {};
+        ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+        ASSERT_EQ(int(data.size()), ffsp::fuse::write(*fs_, path.c_str(), (const char*)data.data(), data.size(), 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+    }
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+
+    const uint32_t max_writeops = opts.erasesize / opts.clustersize;
+    ffsp::eb_id_t victim_eb_id = ffsp::FFSP_INVALID_EB_ID;
+    ffsp::eb_id_t empty_eb_id = ffsp::FFSP_INVALID_EB_ID;
+    for (ffsp::eb_id_t eb_id = 1; eb_id < fs_->neraseblocks; eb_id++)
+    {
+        const auto& eb = fs_->eb_usage[eb_id];
+        if ((eb.e_type == ffsp::eraseblock_type::file_inode) && (eb.e_writeops == max_writeops))
+            victim_eb_id = eb_id;
+        else if (eb.e_type == ffsp::eraseblock_type::empty)
+            empty_eb_id = eb_id;
+    }
+    ASSERT_NE(ffsp::FFSP_INVALID_EB_ID, victim_eb_id);
+    ASSERT_NE(ffsp::FFSP_INVALID_EB_ID, empty_eb_id);
+
+    // The erase counts drifted apart, but wear leveling waits for the
+    //  end of the period.
+    fs_->eb_erase_cnt[empty_eb_id] = fs_->eb_erase_cnt[victim_eb_id] + ffsp::FFSP_WEAR_LEVEL_THRESHOLD + 1;
+    fs_->leveling_erase_cnt = ffsp::FFSP_WEAR_LEVEL_PERIOD - 1;
+    auto gc_write_before = ffsp::test::read_metric(*fs_, "gc_write");
+    ffsp::gc(*fs_);
+    ASSERT_EQ(ffsp::eraseblock_type::file_inode, fs_->eb_usage[victim_eb_id].e_type);
+    ASSERT_EQ(gc_write_before, ffsp::test::read_metric(*fs_, "gc_write"));
+
+    // Every relocated cluster is read exactly once and the relocation
+    //  is committed once.
+    fs_->leveling_erase_cnt = ffsp::FFSP_WEAR_LEVEL_PERIOD;
+    const auto read_raw_before = ffsp::test::read_metric(*fs_, "read_raw");
+    const uint64_t commit_gen_before = fs_->commit_gen;
+    ffsp::gc(*fs_);
+    ASSERT_EQ(commit_gen_before + 1, fs_->commit_gen);
+    ASSERT_EQ(ffsp::eraseblock_type::empty, fs_->eb_usage[victim_eb_id].e_type);
+    ASSERT_LT(gc_write_before, ffsp::test::read_metric(*fs_, "gc_write"));
+    ASSERT_EQ(ffsp::test::read_metric(*fs_, "read_raw") - read_raw_before,
+              ffsp::test::read_metric(*fs_, "gc_write") - gc_write_before);
+
+    // At most one erase block is relocated per period.
+    gc_write_before = ffsp::test::read_metric(*fs_, "gc_write");
+    ffsp::gc(*fs_);
+    ASSERT_EQ(gc_write_before, ffsp::test::read_metric(*fs_, "gc_write"));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < file_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        ASSERT_TRUE(ffsp::test::verify_file(*fs_, path.c_str(), expected, expected.size()));
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, ReplayJournalAfterCrash)
+{
+    const auto file_cnt = 256;
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < file_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        const auto& write_buf = ffsp::test::file_content(i);
+        fuse_file_info fi = {};
+
+        ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+        ASSERT_EQ(int(write_buf.size()), ffsp::fuse::write(*fs_, path.c_str(), (const char*)write_buf.data(), write_buf.size(), 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+    }
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+
+    // Simulate a crash: the file system is mounted again without
+    //  unmounting it first. Only the journal knows about the new files.
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < file_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        const auto& expected_buf = ffsp::test::file_content(i);
+        std::vector<char> read_buf(expected_buf.size());
+        fuse_file_info fi = {};
+
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+        ASSERT_EQ(int(read_buf.size()), ffsp::fuse::read(*fs_, path.c_str(), read_buf.data(), read_buf.size(), 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+
+        ASSERT_EQ(0, std::memcmp(expected_buf.data(), read_buf.data(), read_buf.size()));
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, SplitCommitLargerThanJournal)
+{
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file", S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    ffsp::inode* ino;
+    ASSERT_EQ(0, ffsp::lookup(*fs_, &ino, "/file"));
+    const ffsp::cl_id_t cl_id = fs_->ino_map[get_be32(ino->i_no)];
+
+    // Change more inode map entries than the empty journal has records.
+    const uint32_t rec_per_cl = (fs_->clustersize - sizeof(ffsp::journal_header)) / sizeof(ffsp::journal_record);
+    const uint32_t max_recs = fs_->erasesize / fs_->clustersize * rec_per_cl;
+    const ffsp::ino_t first_ino = fs_->nino - max_recs - 100;
+    ASSERT_LT(get_be32(ino->i_no), first_ino);
+    for (ffsp::ino_t ino_no = first_ino; ino_no < fs_->nino; ino_no++)
+        ffsp::checkpoint_set_ino_map(*fs_, ino_no, cl_id);
+    ASSERT_EQ(0, ffsp::checkpoint_commit(*fs_));
+
+    // Only the leading part was checkpointed; the rest fills the journal.
+    ffsp::superblock sb;
+    ASSERT_EQ(ssize_t(sizeof(sb)), ffsp::read_raw(*io_, &sb, sizeof(sb), 0));
+    const uint64_t journal_offset = uint64_t{ get_be32(sb.s_journaleb) } * fs_->erasesize;
+    ffsp::journal_header first_hdr;
+    ffsp::journal_header last_hdr;
+    ASSERT_EQ(ssize_t(sizeof(first_hdr)), ffsp::read_raw(*io_, &first_hdr, sizeof(first_hdr), journal_offset));
+    ASSERT_EQ(ssize_t(sizeof(last_hdr)), ffsp::read_raw(*io_, &last_hdr, sizeof(last_hdr),
+                                                         journal_offset + fs_->erasesize - fs_->clustersize));
+    ASSERT_EQ(get_be32(sb.s_cpgen), get_be32(first_hdr.j_cpgen));
+    ASSERT_EQ(get_be32(sb.s_cpgen), get_be32(last_hdr.j_cpgen));
+    ASSERT_TRUE(get_be32(last_hdr.j_flags) & ffsp::FFSP_JOURNAL_COMMIT);
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (ffsp::ino_t ino_no = first_ino; ino_no < fs_->nino; ino_no++)
+        ASSERT_EQ(cl_id, fs_->ino_map[ino_no]);
+    struct ::stat stbuf;
+    ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, "/file", &stbuf));
+    for (ffsp::ino_t ino_no = first_ino; ino_no < fs_->nino; ino_no++)
+        ffsp::checkpoint_set_ino_map(*fs_, ino_no, ffsp::FFSP_FREE_CL_ID);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (ffsp::ino_t ino_no = first_ino; ino_no < fs_->nino; ino_no++)
+        ASSERT_EQ(ffsp::FFSP_FREE_CL_ID, fs_->ino_map[ino_no]);
+    ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, "/file", &stbuf));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, CommitUnwrittenInodeBeforeCrash)
+{
+    // The inode of the new file is not written yet when the meta data is
+    //  committed. It must not be durable; neither is its dentry.
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file_new", S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::checkpoint_commit(*fs_));
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+
+    struct ::stat stbuf;
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(-ENOENT, ffsp::fuse::getattr(*fs_, "/file_new", &stbuf));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file_new", S_IFREG, 0));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, "/file_new", &stbuf));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, PreallocateBeforeCrash)
+{
+    const auto& opts = ffsp::test::small_mkfs_options;
+    ASSERT_TRUE(ffsp::test::make_fs(io_, opts));
+
+    const auto path = "/file_fallocate";
+    const uint64_t size = 1024 * 1024 * 8;
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+
+    // The new inode is still unwritten when fallocate() commits the
+    //  reserved erase blocks.
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, "/file_new", S_IFREG, 0));
+
+    ffsp::superblock sb;
+    ASSERT_EQ(ssize_t(sizeof(sb)), ffsp::read_raw(*io_, &sb, sizeof(sb), 0));
+    const ffsp::eb_id_t journal_eb_id = get_be32(sb.s_journaleb);
+    std::vector<char> before(ffsp::io_backend_size(*io_));
+    ASSERT_EQ(ssize_t(before.size()), ffsp::read_raw(*io_, before.data(), before.size(), 0));
+
+    fuse_file_info fi = {};
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(0, ffsp::fuse::fallocate(*fs_, path, 0, 0, size, &fi));
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+
+    // Simulate a crash right after the commit of the reservation: keep
+    //  only the first commit fallocate() appended to the journal and drop
+    //  the inode clusters written afterwards.
+    std::vector<char> after(before.size());
+    ASSERT_EQ(ssize_t(after.size()), ffsp::read_raw(*io_, after.data(), after.size(), 0));
+    const uint64_t journal_off = uint64_t{ journal_eb_id } * opts.erasesize;
+    bool committed = false;
+    for (uint64_t off = journal_off; off < journal_off + opts.erasesize; off += opts.clustersize)
+    {
+        if (!std::memcmp(before.data() + off, after.data() + off, opts.clustersize))
+            continue;
+        if (committed)
+        {
+            std::fill(after.begin() + off, after.begin() + off + opts.clustersize, 0);
+            continue;
+        }
+        ffsp::journal_header hdr;
+        std::memcpy(&hdr, after.data() + off, sizeof(hdr));
+        committed = get_be32(hdr.j_flags) & ffsp::FFSP_JOURNAL_COMMIT;
+    }
+    ASSERT_TRUE(committed);
+    std::copy(after.begin(), after.begin() + opts.erasesize, before.begin());
+    std::copy(after.begin() + journal_off, after.begin() + journal_off + opts.erasesize, before.begin() + journal_off);
+    ASSERT_EQ(ssize_t(before.size()), ffsp::write_raw(*io_, before.data(), before.size(), 0));
+
+    struct ::stat stbuf;
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(-ENOENT, ffsp::fuse::getattr(*fs_, "/file_new", &stbuf));
+    ASSERT_EQ(0, ffsp::fuse::getattr(*fs_, path, &stbuf));
+    ASSERT_EQ(0, stbuf.st_size);
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, SyncFileBeforeCrash)
+{
+    const auto path = "/file_fsync";
+    const auto other_path = "/file_other";
+    const auto& data = ffsp::test::file_content(1024 * 1024 * 3 + 5);
+
+    fuse_file_info fi = {};
+    fuse_file_info other_fi = {};
+    ffsp::fuse::set_delalloc(true);
+    const bool mounted = ffsp::test::fuse_mount_fs(io_, &fs_);
+    ffsp::fuse::set_delalloc(false);
+    ASSERT_TRUE(mounted);
+    ASSERT_NE(nullptr, fs_->delalloc);
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, other_path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, other_path, &other_fi));
+    ASSERT_EQ(int(data.size()), ffsp::fuse::write(*fs_, path, (const char*)data.data(), data.size(), 0, &fi));
+    ASSERT_EQ(int(data.size()), ffsp::fuse::write(*fs_, other_path, (const char*)data.data(), data.size(), 0, &other_fi));
+
+    const uint64_t commit_gen = fs_->commit_gen;
+    ASSERT_EQ(0, ffsp::fuse::fsync(*fs_, path, 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::fsync(*fs_, other_path, 1, &other_fi));
+    ASSERT_EQ(commit_gen + 2, fs_->commit_gen);
+
+    // Simulate a crash while both files are still open.
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (const auto* p : { path, other_path })
+    {
+        std::vector<char> read_buf(data.size());
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, p, &fi));
+        ASSERT_EQ(int(read_buf.size()), ffsp::fuse::read(*fs_, p, read_buf.data(), read_buf.size(), 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, p, &fi));
+        ASSERT_EQ(0, std::memcmp(data.data(), read_buf.data(), read_buf.size()));
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, SyncFileAfterGroupCommit)
+{
+    const auto path = "/file_fsync";
+    const auto& data = ffsp::test::file_content(1024 * 1024 * 3 + 5);
+    const std::vector<char> expected(data.begin(), data.end());
+    const uint64_t half = data.size() / 2;
+
+    fuse_file_info fi = {};
+    ffsp::inode* ino = nullptr;
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, path, &fi));
+    ASSERT_EQ(int(half), ffsp::fuse::write(*fs_, path, (const char*)data.data(), half, 0, &fi));
+    ASSERT_EQ(0, ffsp::lookup(*fs_, &ino, path));
+
+    // Another caller commits while the fsync() caller waits for the lock.
+    //  The inode was not changed since, so fsync() has nothing to do.
+    uint64_t commit_gen = fs_->commit_gen;
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    ASSERT_EQ(commit_gen + 1, fs_->commit_gen);
+    ASSERT_EQ(0, ffsp::sync_inode(*fs_, *ino, commit_gen));
+    ASSERT_EQ(commit_gen + 1, fs_->commit_gen);
+
+    // The inode was changed after the other commit, so it has to be
+    //  committed once more.
+    commit_gen = fs_->commit_gen;
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    ASSERT_EQ(int(data.size() - half), ffsp::fuse::write(*fs_, path, (const char*)data.data() + half, data.size() - half, half, &fi));
+    ASSERT_EQ(0, ffsp::sync_inode(*fs_, *ino, commit_gen));
+    ASSERT_EQ(commit_gen + 2, fs_->commit_gen);
+
+    // Simulate a crash while the file is still open.
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_TRUE(ffsp::test::verify_file(*fs_, path, expected, expected.size()));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, RecoverInodesAfterCrash)
+{
+    const auto file_cnt = 128;
+
+    const auto write_files = [this](int first, int last) {
+        for (auto i = first; i < last; i++)
+        {
+            const auto path = "/file_" + std::to_string(i);
+            // Larger files use cluster indirect data.
+            const auto& write_buf = ffsp::test::file_content(i * 1024);
+            fuse_file_info fi = {};
+
+            ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path.c_str(), S_IFREG, 0));
+            ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+            ASSERT_EQ(int(write_buf.size()), ffsp::fuse::write(*fs_, path.c_str(), (const char*)write_buf.data(), write_buf.size(), 0, &fi));
+            ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+        }
+        ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    };
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    write_files(0, file_cnt / 2);
+
+    // Save the meta data of the first half of the files: the super erase
+    //  block and the journal erase block.
+    const auto erasesize = fs_->erasesize;
+    ffsp::superblock sb;
+    ASSERT_EQ(ssize_t(sizeof(sb)), ffsp::read_raw(*io_, &sb, sizeof(sb), 0));
+    const uint64_t journal_offset = uint64_t{ get_be32(sb.s_journaleb) } * erasesize;
+    std::vector<char> super_eb(erasesize);
+    std::vector<char> journal_eb(erasesize);
+    ASSERT_EQ(ssize_t(erasesize), ffsp::read_raw(*io_, super_eb.data(), erasesize, 0));
+    ASSERT_EQ(ssize_t(erasesize), ffsp::read_raw(*io_, journal_eb.data(), erasesize, journal_offset));
+
+    write_files(file_cnt / 2, file_cnt);
+
+    // Simulate a crash that lost all meta data changes of the second half:
+    //  only the inode clusters themselves can tell about those files.
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+    ASSERT_EQ(ssize_t(erasesize), ffsp::write_raw(*io_, super_eb.data(), erasesize, 0));
+    ASSERT_EQ(ssize_t(erasesize), ffsp::write_raw(*io_, journal_eb.data(), erasesize, journal_offset));
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    for (auto i = 0; i < file_cnt; i++)
+    {
+        const auto path = "/file_" + std::to_string(i);
+        const auto& expected_buf = ffsp::test::file_content(i * 1024);
+        std::vector<char> read_buf(expected_buf.size());
+        fuse_file_info fi = {};
+
+        ASSERT_EQ(0, ffsp::fuse::open(*fs_, path.c_str(), &fi));
+        ASSERT_EQ(int(read_buf.size()), ffsp::fuse::read(*fs_, path.c_str(), read_buf.data(), read_buf.size(), 0, &fi));
+        ASSERT_EQ(0, ffsp::fuse::release(*fs_, path.c_str(), &fi));
+
+        ASSERT_EQ(0, std::memcmp(expected_buf.data(), read_buf.data(), read_buf.size()));
+    }
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
+
+TEST_F(MultiMountFileSystemOperationsApiTest, IgnoreInodesInsideFileData)
+{
+    const auto path = "/file";
+    const auto image_path = "/image";
+    fuse_file_info fi = {};
+
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+
+    // Save the meta data before the inode cluster and its copy are written.
+    const auto erasesize = fs_->erasesize;
+    const auto clustersize = fs_->clustersize;
+    ffsp::superblock sb;
+    ASSERT_EQ(ssize_t(sizeof(sb)), ffsp::read_raw(*io_, &sb, sizeof(sb), 0));
+    const uint64_t journal_offset = uint64_t{ get_be32(sb.s_journaleb) } * erasesize;
+    std::vector<char> super_eb(erasesize);
+    std::vector<char> journal_eb(erasesize);
+    ASSERT_EQ(ssize_t(erasesize), ffsp::read_raw(*io_, super_eb.data(), erasesize, 0));
+    ASSERT_EQ(ssize_t(erasesize), ffsp::read_raw(*io_, journal_eb.data(), erasesize, journal_offset));
+
+    // A file holding an exact copy of a newer inode cluster, like a file
+    //  containing an image of this file system would.
+    ASSERT_EQ(0, ffsp::fuse::chmod(*fs_, path, S_IFREG | 0600));
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    ffsp::inode* ino;
+    ASSERT_EQ(0, ffsp::lookup(*fs_, &ino, path));
+    const ffsp::ino_t ino_no = get_be32(ino->i_no);
+    std::vector<char> image(clustersize);
+    ASSERT_EQ(ssize_t(clustersize), ffsp::read_raw(*io_, image.data(), clustersize, uint64_t{ fs_->ino_map[ino_no] } * clustersize));
+
+    ASSERT_EQ(0, ffsp::fuse::mknod(*fs_, image_path, S_IFREG, 0));
+    ASSERT_EQ(0, ffsp::fuse::open(*fs_, image_path, &fi));
+    ASSERT_EQ(int(image.size()), ffsp::fuse::write(*fs_, image_path, image.data(), image.size(), 0, &fi));
+    ASSERT_EQ(0, ffsp::fuse::release(*fs_, image_path, &fi));
+    ASSERT_EQ(0, ffsp::flush_inodes(*fs_, true));
+    ASSERT_EQ(0, ffsp::lookup(*fs_, &ino, image_path));
+    const ffsp::cl_id_t image_cl_id = get_be32(static_cast<const be32_t*>(ffsp::inode_data(*ino))[0]);
+    const ffsp::eb_id_t image_eb_id = image_cl_id / (erasesize / clustersize);
+
+    ASSERT_TRUE(ffsp::test::crash_fs(fs_));
+    ASSERT_EQ(ssize_t(erasesize), ffsp::write_raw(*io_, super_eb.data(), erasesize, 0));
+    ASSERT_EQ(ssize_t(erasesize), ffsp::write_raw(*io_, journal_eb.data(), erasesize, journal_offset));
+
+    // Only the inode cluster itself is recovered, not its copy.
+    ASSERT_TRUE(ffsp::test::mount_fs(io_, &fs_));
+    ASSERT_NE(image_cl_id, fs_->ino_map[ino_no]);
+    ASSERT_FALSE(ffsp::is_inode_eraseblk_type(fs_->eb_usage[image_eb_id].e_type));
+    ASSERT_EQ(0, ffsp::lookup(*fs_, &ino, path));
+    ASSERT_EQ(uint32_t(S_IFREG | 0600), get_be32(ino->i_mode));
+    ASSERT_TRUE(ffsp::test::unmount_fs(fs_));
+}
@@ -0,0 +1,9 @@
+// The plain loop fallback of the kernels, which is built on platforms
+//  without SSE2 or AVX2 only.
+#define FFSP_NO_SIMD
+#define FFSP_BYTEORDER_TEST_SUITE ByteOrderScalarKernelsTest
+#include "ffsp_byteorder_test.inc"
+
+#if defined(FFSP_SIMD_AVX2) || defined(FFSP_SIMD_SSE2)
+#error "the scalar kernels are built with SIMD instructions"
+#endif
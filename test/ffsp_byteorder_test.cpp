@@ -0,0 +1,7 @@
+// The kernels built with the SIMD instructions the compiler targets.
+#define FFSP_BYTEORDER_TEST_SUITE ByteOrderKernelsTest
+#include "ffsp_byteorder_test.inc"
+
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(FFSP_SIMD_AVX2) && !defined(FFSP_SIMD_SSE2)
+#error "the SIMD kernels are not built on x86-64"
+#endif
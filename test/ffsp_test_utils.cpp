@@ -13,6 +13,7 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <sys/types.h>
 
 #ifdef _WIN32
@@ -56,12 +57,23 @@ bool mount_fs(io_backend* io_ctx, fs_context** fs)
     return io_ctx && ((*fs = ffsp::mount(io_ctx)) != nullptr);
 }
 
+bool fuse_mount_fs(io_backend* io_ctx, fs_context** fs)
+{
+    return io_ctx && ((*fs = ffsp::fuse::mount(io_ctx)) != nullptr);
+}
+
 bool unmount_fs(fs_context* fs)
 {
     auto* io_ctx = ffsp::unmount(fs);
     return io_ctx != nullptr;
 }
 
+bool crash_fs(fs_context* fs)
+{
+    auto* io_ctx = ffsp::abandon(fs);
+    return io_ctx != nullptr;
+}
+
 bool mkfs_ffsp(const char* program,
                uint32_t clustersize, uint32_t erasesize, uint32_t ninoopen,
                uint32_t neraseopen, uint32_t nerasereserve, uint32_t nerasewrites,
@@ -177,6 +189,30 @@ std::vector<unsigned char> file_content(uint64_t size)
     return v;
 }
 
+uint64_t read_metric(fs_context& fs, const char* name)
+{
+    char buf[1024] = {};
+    ffsp::fuse::read(fs, "/.FFSP.d/metrics", buf, sizeof(buf) - 1, 0, nullptr);
+    const auto key = "\"" + std::string(name) + "\":";
+    const char* metric = std::strstr(buf, key.c_str());
+    return metric ? std::strtoull(metric + key.size(), nullptr, 10) : 0;
+}
+
+bool verify_file(fs_context& fs, const char* path, const std::vector<char>& expected, uint64_t size)
+{
+    struct ::stat stbuf;
+    if ((ffsp::fuse::getattr(fs, path, &stbuf) != 0) || (stbuf.st_size != off_t(size)))
+        return false;
+
+    fuse_file_info fi = {};
+    std::vector<char> read_buf(size);
+    if (ffsp::fuse::open(fs, path, &fi) != 0)
+        return false;
+    const int rc = ffsp::fuse::read(fs, path, read_buf.data(), size, 0, &fi);
+    ffsp::fuse::release(fs, path, &fi);
+    return (rc == int(size)) && (std::memcmp(expected.data(), read_buf.data(), size) == 0);
+}
+
 namespace os
 {
 
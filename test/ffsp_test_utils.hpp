@@ -21,7 +21,11 @@ bool remove_file(const char* file_path);
 bool make_fs(io_backend* io_ctx, const mkfs_options& opts);
 
 bool mount_fs(io_backend* io_ctx, fs_context** fs);
+// Mount like the FUSE front end does, with the mount options that were set
+//  through ffsp::fuse::set_delalloc() and friends.
+bool fuse_mount_fs(io_backend* io_ctx, fs_context** fs);
 bool unmount_fs(fs_context* fs);
+bool crash_fs(fs_context* fs);
 
 bool mkfs_ffsp(const char* program,
                uint32_t clustersize, uint32_t erasesize, uint32_t ninoopen,
@@ -37,6 +41,7 @@ bool unmount_ffsp(const char* program, const char* mountpoint);
     number of indes = ((erase block size)
                        - (size of cluster)
                        - (number of erase blocks * size of erase block struct)
+                       - (number of erase blocks * size of erase count)
                        - (size of (root) inode id))
                       / (size of inode id)
 
@@ -45,7 +50,7 @@ bool unmount_ffsp(const char* program, const char* mountpoint);
     - erase block size = 4 MiB
     - cluster size = 32 KiB
     - number of erase blocks = 32
-    - number of inodes = (4194304 - 32768 - 32*8 - 4) / 4 = 1040319
+    - number of inodes = (4194304 - 32768 - 32*8 - 32*4 - 4) / 4 = 1040287
 */
 extern io_backend* default_io_ctx;
 #ifdef _WIN32
@@ -60,6 +65,14 @@ const constexpr mkfs_options default_mkfs_options{ 1024 * 32,       // cluster
                                                    5,               // open eraseblocks
                                                    3,               // reserved eraseblocks
                                                    5 };             // gc trigger
+// Small clusters and erase blocks so that files change their data type
+//  after only a few MiB.
+const constexpr mkfs_options small_mkfs_options{ 1024 * 4,          // cluster
+                                                 1024 * 1024,       // eraseblock
+                                                 128,               // open inodes
+                                                 5,                 // open eraseblocks
+                                                 3,                 // reserved eraseblocks
+                                                 5 };               // gc trigger
 
 const constexpr char* const default_bin_mkfs{ "./mkfs.ffsp" };
 const constexpr char* const default_bin_mount{ "./mount.ffsp" };
@@ -83,6 +96,12 @@ bool default_unmount_ffsp();
 
 std::vector<unsigned char> file_content(uint64_t size);
 
+// Returns the value of the named counter in "/.FFSP.d/metrics".
+uint64_t read_metric(fs_context& fs, const char* name);
+// Checks that the file at the given path has the given size and that its
+//  content matches the first size bytes of expected.
+bool verify_file(fs_context& fs, const char* path, const std::vector<char>& expected, uint64_t size);
+
 namespace os
 {
 
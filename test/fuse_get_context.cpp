@@ -0,0 +1,9 @@
+#include <fuse.h>
+
+// The tests call the operations without a FUSE session. Only the test
+//  binary may replace libfuse's context; mount.ffsp relies on it.
+fuse_context* fuse_get_context()
+{
+    static fuse_context dummy_ctx = {};
+    return &dummy_ctx;
+}
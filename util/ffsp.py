@@ -187,14 +187,18 @@ class EraseblocksWidget():
                    0x04:"file_inode",
                    0x08:"file_clin",
                    0x10:"ebin",
-                   0x20:"empty" }
+                   0x20:"empty",
+                   0x40:"dentry_inode_cold",
+                   0x80:"file_inode_cold" }
         eb2col = { 0x00:(QtCore.Qt.black, QtCore.Qt.yellow),
                    0x01:(QtCore.Qt.white, QtCore.Qt.blue),
                    0x02:(QtCore.Qt.white, QtCore.Qt.darkBlue),
                    0x04:(QtCore.Qt.black, QtCore.Qt.lightGray),
                    0x08:(QtCore.Qt.white, QtCore.Qt.darkGray),
                    0x10:(QtCore.Qt.white, QtCore.Qt.red),
-                   0x20:(QtCore.Qt.white, QtCore.Qt.darkGreen) }
+                   0x20:(QtCore.Qt.white, QtCore.Qt.darkGreen),
+                   0x40:(QtCore.Qt.white, QtCore.Qt.darkCyan),
+                   0x80:(QtCore.Qt.black, QtCore.Qt.cyan) }
 
         self.debug_dir = debug_dir
 
@@ -230,8 +234,9 @@ class EraseblocksWidget():
             eb_type = eb["type"]
             eb_cvalid = eb["cvalid"]
             eb_writeops = eb["writeops"]
+            eb_erasecnt = eb["erasecnt"]
             item_str = "{}".format(eb_id)
-            item_tt = "eb_id: {}\ntype: {}\nValid clusters: {}\nWrite ops: {}\nClusters: {}{}".format(eb_id, eb2str[eb["type"]], eb_cvalid, eb_writeops, len(clusters), " ({}-{})".format(clusters[0], clusters[-1]) if clusters else "")
+            item_tt = "eb_id: {}\ntype: {}\nValid clusters: {}\nWrite ops: {}\nErase count: {}\nClusters: {}{}".format(eb_id, eb2str[eb["type"]], eb_cvalid, eb_writeops, eb_erasecnt, len(clusters), " ({}-{})".format(clusters[0], clusters[-1]) if clusters else "")
 
             item = QtGui.QTableWidgetItem(item_str)
             item.setTextAlignment(QtCore.Qt.AlignCenter)
@@ -307,7 +312,7 @@ class SuperblocksWidget():
 #            print(str(metrics_json))
 
         self.m.setColumnCount(2)
-        self.m.setRowCount(6)
+        self.m.setRowCount(7)
 
         di = metrics_json["debuginfo"]
         self.m.setItem(0, 0, QtGui.QTableWidgetItem("Read Raw"))
@@ -322,6 +327,8 @@ class SuperblocksWidget():
         self.m.setItem(4, 1, QtGui.QTableWidgetItem(str(di["gc_read"])))
         self.m.setItem(5, 0, QtGui.QTableWidgetItem("GC Write"))
         self.m.setItem(5, 1, QtGui.QTableWidgetItem(str(di["gc_write"])))
+        self.m.setItem(6, 0, QtGui.QTableWidgetItem("Meta Data Write"))
+        self.m.setItem(6, 1, QtGui.QTableWidgetItem(str(di["meta_write"])))
 
 
 class MainWindow(QtGui.QMainWindow):